@@ -12,6 +12,22 @@
 // AA-tree declarations
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <stddef.h>
+
+#define AAT_MAXHEIGHT 128
+#define AAT_SEARCH_MANY 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AAT_PREFETCH_ADDR(addr) __builtin_prefetch(addr)
+#else
+#define AAT_PREFETCH_ADDR(addr) ((void)0)
+#endif
+
+struct aat_cursor {
+    void *stack[AAT_MAXHEIGHT];
+    int depth;
+};
+
 struct aat_node {
     struct aat_node *left;
     struct aat_node *right;
@@ -29,6 +45,83 @@ struct aat_node *aat_last(struct aat_node **root);
 struct aat_node *aat_iter(struct aat_node **root, struct aat_node *key);
 struct aat_node *aat_prev(struct aat_node **root, struct aat_node *item);
 struct aat_node *aat_next(struct aat_node **root, struct aat_node *item);
+struct aat_node *aat_cursor_first(struct aat_node **root, 
+    struct aat_cursor *cursor);
+struct aat_node *aat_cursor_last(struct aat_node **root, 
+    struct aat_cursor *cursor);
+struct aat_node *aat_cursor_seek(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key);
+struct aat_node *aat_cursor_item(struct aat_cursor *cursor);
+struct aat_node *aat_cursor_next(struct aat_cursor *cursor);
+struct aat_node *aat_cursor_prev(struct aat_cursor *cursor);
+struct aat_node *aat_cursor_remove(struct aat_node **root, 
+    struct aat_cursor *cursor);
+struct aat_node *aat_remove_node(struct aat_node **root, struct aat_node *node);
+struct aat_node *aat_cursor_seek_from(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key);
+struct aat_node *aat_search_from(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key);
+struct aat_node *aat_insert_hint(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *item);
+void aat_build_sorted(struct aat_node **root, struct aat_node **items, 
+    size_t n);
+void aat_clear_all(struct aat_node **root, 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata);
+int aat_clone(struct aat_node **root, struct aat_node **dst, 
+    struct aat_node *(*copy)(struct aat_node *item, void *udata), 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata);
+size_t aat_insert_batch(struct aat_node **root, struct aat_node **items, 
+    size_t n, struct aat_node **replaced);
+void aat_scan(struct aat_node **root, struct aat_node *lo, struct aat_node *hi, 
+    int (*iter)(struct aat_node *item, void *udata), void *udata);
+void aat_scan_reverse(struct aat_node **root, struct aat_node *lo, 
+    struct aat_node *hi, int (*iter)(struct aat_node *item, void *udata), 
+    void *udata);
+struct aat_node *aat_delete_range(struct aat_node **root, struct aat_node *lo, 
+    struct aat_node *hi);
+void aat_split_at(struct aat_node **root, struct aat_node *key, 
+    struct aat_node **left, struct aat_node **right);
+void aat_join(struct aat_node **left, struct aat_node *pivot, 
+    struct aat_node **right);
+struct aat_node *aat_union(struct aat_node **root, struct aat_node **other, 
+    struct aat_node *(*conflict)(struct aat_node *item, 
+        struct aat_node *other_item, void *udata), 
+    void *udata);
+struct aat_node *aat_intersect(struct aat_node **root, 
+    struct aat_node **other);
+struct aat_node *aat_difference(struct aat_node **root, 
+    struct aat_node **other);
+size_t aat_relayout(struct aat_node **root, struct aat_node *dst);
+void aat_insert_multi(struct aat_node **root, struct aat_node *item);
+struct aat_node *aat_get_or_insert(struct aat_node **root, 
+    struct aat_node *item, int *inserted);
+struct aat_node *aat_get_or_insert_with(struct aat_node **root, 
+    struct aat_node *key, 
+    struct aat_node *(*make)(struct aat_node *key, void *udata), void *udata, 
+    int *inserted);
+struct aat_node *aat_equal_range(struct aat_node **root, struct aat_node *key, 
+    struct aat_node **end);
+size_t aat_count_equal(struct aat_node **root, struct aat_node *key);
+void aat_search_many(struct aat_node **root, struct aat_node **keys, 
+    struct aat_node **found, size_t n);
+
+struct aat_tree {
+    struct aat_node *root;
+    struct aat_node *first;
+    struct aat_node *last;
+    size_t count;
+};
+
+struct aat_node *aat_tree_insert(struct aat_tree *tree, struct aat_node *item);
+struct aat_node *aat_tree_delete(struct aat_tree *tree, struct aat_node *key);
+struct aat_node *aat_tree_remove_node(struct aat_tree *tree, 
+    struct aat_node *node);
+struct aat_node *aat_tree_delete_first(struct aat_tree *tree);
+struct aat_node *aat_tree_delete_last(struct aat_tree *tree);
+struct aat_node *aat_tree_first(struct aat_tree *tree);
+struct aat_node *aat_tree_last(struct aat_tree *tree);
+size_t aat_tree_count(struct aat_tree *tree);
+void aat_tree_sync(struct aat_tree *tree);
 
 ////////////////////////////////////////////////////////////////////////////////
 // AA-tree implementation
@@ -69,43 +162,180 @@ static struct aat_node *aat_split(struct aat_node *node) {
     return node;
 }
 
-static struct aat_node *aat_insert0(struct aat_node *node, 
-    struct aat_node *item, struct aat_node **replaced)
+static void aat_replace(struct aat_node **root, struct aat_node *parent,
+    struct aat_node *node, struct aat_node *child)
 {
-    if (!node) {
-        item->left = 0;
-        item->right = 0;
-        item->level = 1;
-        node = item;
+    if (!parent) {
+        *root = child;
+    } else if (parent->left == node) {
+        parent->left = child;
     } else {
-        int cmp = aat_compare(item, node);
-        if (cmp < 0) {
-            node->left = aat_insert0(node->left, item, replaced);
-        } else if (cmp > 0) {
-            node->right = aat_insert0(node->right, item, replaced);
+        parent->right = child;
+    }
+}
+
+// Links a new item below the last node in the path, on the side given by cmp,
+// and rebalances. On return the path holds the ancestors of the item that were
+// left in place.
+static void aat_insert_link(struct aat_node **root, struct aat_node **path, 
+    int *pathlen, int depth, int cmp, struct aat_node *item)
+{
+    item->left = 0;
+    item->right = 0;
+    item->level = 1;
+    *pathlen = depth;
+    if (depth == 0) {
+        *root = item;
+        return;
+    }
+    if (cmp < 0) {
+        path[depth-1]->left = item;
+    } else {
+        path[depth-1]->right = item;
+    }
+    // Rebalance on the way back up. Once a node and the child below it are
+    // both left unchanged, the rest of the tree above is already balanced.
+    int changed = 1;
+    while (depth > 0) {
+        struct aat_node *node = path[--depth];
+        int level = node->level;
+        struct aat_node *balanced = aat_split(aat_skew(node));
+        if (balanced != node || balanced->level != level) {
+            aat_replace(root, depth > 0 ? path[depth-1] : 0, node, balanced);
+            *pathlen = depth;
+            changed = 1;
+        } else if (changed) {
+            changed = 0;
         } else {
-            *replaced = node;
+            break;
+        }
+    }
+}
+
+// Inserts the item by descending from the last node in the path, which must
+// be an ancestor of the item, or from the root when the path is empty. On
+// return the path holds the ancestors of the item that were left in place.
+// With multi set an equal item is never replaced and goes after the others.
+static struct aat_node *aat_insert_path(struct aat_node **root,
+    struct aat_node **path, int *pathlen, struct aat_node *item, int multi)
+{
+    int depth = *pathlen;
+    int cmp = 0;
+    struct aat_node *node = depth > 0 ? path[--depth] : *root;
+    while (node) {
+        cmp = aat_compare(item, node);
+        if (cmp == 0 && !multi) {
             item->left = node->left;
             item->right = node->right;
             item->level = node->level;
-            node = item;
+            aat_replace(root, depth > 0 ? path[depth-1] : 0, node, item);
+            if (node != item) {
+                aat_clear(node);
+            }
+            *pathlen = depth;
+            return node;
         }
+        path[depth++] = node;
+        node = cmp < 0 ? node->left : node->right;
     }
-    node = aat_skew(node);
-    node = aat_split(node);
-    return node;
+    aat_insert_link(root, path, pathlen, depth, cmp, item);
+    return 0;
 }
 
 struct aat_node *aat_insert(struct aat_node **root, struct aat_node *item) {
-    struct aat_node *replaced = 0;
-    *root = aat_insert0(*root, item, &replaced);
-    if (replaced != item) {
-        aat_clear(replaced);
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int pathlen = 0;
+    return aat_insert_path(root, path, &pathlen, item, 0);
+}
+
+void aat_insert_multi(struct aat_node **root, struct aat_node *item) {
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int pathlen = 0;
+    aat_insert_path(root, path, &pathlen, item, 1);
+}
+
+struct aat_node *aat_get_or_insert_with(struct aat_node **root, 
+    struct aat_node *key, 
+    struct aat_node *(*make)(struct aat_node *key, void *udata), void *udata, 
+    int *inserted)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int depth = 0;
+    int cmp = 0;
+    struct aat_node *node = *root;
+    while (node) {
+        cmp = aat_compare(key, node);
+        if (cmp == 0) {
+            if (inserted) {
+                *inserted = 0;
+            }
+            return node;
+        }
+        path[depth++] = node;
+        node = cmp < 0 ? node->left : node->right;
     }
-    return replaced;
+    struct aat_node *item = make(key, udata);
+    if (item) {
+        int pathlen;
+        aat_insert_link(root, path, &pathlen, depth, cmp, item);
+    }
+    if (inserted) {
+        *inserted = item != 0;
+    }
+    return item;
 }
 
-static struct aat_node *aat_decrease_level(struct aat_node *node) {
+static struct aat_node *aat_make_self(struct aat_node *key, void *udata) {
+    (void)key;
+    return udata;
+}
+
+struct aat_node *aat_get_or_insert(struct aat_node **root, 
+    struct aat_node *item, int *inserted)
+{
+    return aat_get_or_insert_with(root, item, aat_make_self, item, inserted);
+}
+
+// Returns the length of the path to the lowest node that must contain the 
+// item, given that item is greater than or equal to the item that the path was
+// made for. Only the nodes where the path turned left need to be compared.
+static int aat_finger(struct aat_node **path, int pathlen, 
+    struct aat_node *item)
+{
+    int start = pathlen-1;
+    for (int i = pathlen-2; i >= 0; i--) {
+        if (path[i]->left == path[i+1]) {
+            if (aat_compare(item, path[i]) < 0) {
+                break;
+            }
+            start = i;
+        }
+    }
+    return start+1;
+}
+
+size_t aat_insert_batch(struct aat_node **root, struct aat_node **items, 
+    size_t n, struct aat_node **replaced)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int pathlen = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        pathlen = aat_finger(path, pathlen, items[i]);
+        struct aat_node *prev = aat_insert_path(root, path, &pathlen, items[i], 
+            0);
+        if (replaced) {
+            replaced[i] = prev;
+        }
+        if (prev) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Returns true if the level of the node was decreased.
+static int aat_decrease_level(struct aat_node *node) {
     if (node->left || node->right) {
         int level = 0;
         if (node->left && node->right) {
@@ -121,13 +351,13 @@ static struct aat_node *aat_decrease_level(struct aat_node *node) {
             if (node->right && level < node->right->level) {
                 node->right->level = level;
             }
+            return 1;
         }
     }
-    return node;
+    return 0;
 }
 
 static struct aat_node *aat_delete_fixup(struct aat_node *node) {
-    node = aat_decrease_level(node);
     node = aat_skew(node);
     node->right = aat_skew(node->right);
     if (node->right && node->right->right) {
@@ -138,96 +368,325 @@ static struct aat_node *aat_delete_fixup(struct aat_node *node) {
     return node;
 }
 
-static struct aat_node *aat_delete_first0(struct aat_node *node,
-    struct aat_node **deleted)
+// Rebalance the path of nodes above a deleted node. Once the level of a node
+// does not need to decrease, the rest of the tree above is already balanced.
+static void aat_delete_rebalance(struct aat_node **root, 
+    struct aat_node **path, int depth)
 {
-    if (node) {
-        if (!node->left) {
-            *deleted = node;
-            if (node->right) {
-                node = node->right;
-            } else {
-                node = 0;
-            }
-        } else {
-            node->left = aat_delete_first0(node->left, deleted);
-            node = aat_delete_fixup(node);
+    while (depth > 0) {
+        struct aat_node *node = path[--depth];
+        if (!aat_decrease_level(node)) {
+            break;
         }
+        aat_replace(root, depth > 0 ? path[depth-1] : 0, node, 
+            aat_delete_fixup(node));
     }
-    return node;
 }
 
-static struct aat_node *aat_delete_last0(struct aat_node *node,
-    struct aat_node **deleted)
+// Deletes the first node and sets first to the node that takes its place,
+// which is either its right child or its parent.
+static struct aat_node *aat_delete_first0(struct aat_node **root, 
+    struct aat_node **first)
 {
-    if (node) {
-        if (!node->right) {
-            *deleted = node;
-            if (node->left) {
-                node = node->left;
-            } else {
-                node = 0;
-            }
-        } else {
-            node->right = aat_delete_last0(node->right, deleted);
-            node = aat_delete_fixup(node);
-        }
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int depth = 0;
+    struct aat_node *node = *root;
+    if (!node) {
+        *first = 0;
+        return 0;
+    }
+    while (node->left) {
+        path[depth++] = node;
+        node = node->left;
     }
+    *first = node->right ? node->right : depth > 0 ? path[depth-1] : 0;
+    aat_replace(root, depth > 0 ? path[depth-1] : 0, node, node->right);
+    aat_delete_rebalance(root, path, depth);
+    aat_clear(node);
     return node;
 }
 
 struct aat_node *aat_delete_first(struct aat_node **root) {
-    struct aat_node *deleted = 0;
-    *root = aat_delete_first0(*root, &deleted);
-    aat_clear(deleted);
-    return deleted;
+    struct aat_node *first;
+    return aat_delete_first0(root, &first);
+}
+
+static struct aat_node *aat_delete_last0(struct aat_node **root, 
+    struct aat_node **last)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int depth = 0;
+    struct aat_node *node = *root;
+    if (!node) {
+        *last = 0;
+        return 0;
+    }
+    while (node->right) {
+        path[depth++] = node;
+        node = node->right;
+    }
+    *last = node->left ? node->left : depth > 0 ? path[depth-1] : 0;
+    aat_replace(root, depth > 0 ? path[depth-1] : 0, node, node->left);
+    aat_delete_rebalance(root, path, depth);
+    aat_clear(node);
+    return node;
 }
 
 struct aat_node *aat_delete_last(struct aat_node **root) {
-    struct aat_node *deleted = 0;
-    *root = aat_delete_last0(*root, &deleted);
-    aat_clear(deleted);
-    return deleted;
+    struct aat_node *last;
+    return aat_delete_last0(root, &last);
 }
 
-static struct aat_node *aat_delete0(struct aat_node *node, 
-    struct aat_node *key, struct aat_node **deleted)
+// Deletes the node, which is below the last node in the path, or the root when
+// the path is empty. The path must have room for the rest of the tree height.
+static struct aat_node *aat_delete_path(struct aat_node **root, 
+    struct aat_node **path, int depth, struct aat_node *node)
 {
-    if (node) {
+    struct aat_node *parent = depth > 0 ? path[depth-1] : 0;
+    if (!node->left && !node->right) {
+        aat_replace(root, parent, node, 0);
+    } else {
+        // Swap the node with the nearest leaf, which is its predecessor or,
+        // when it has no left child, its successor.
+        int index = depth;
+        path[depth++] = node;
+        struct aat_node *leaf;
+        if (node->left) {
+            leaf = node->left;
+            while (leaf->right) {
+                path[depth++] = leaf;
+                leaf = leaf->right;
+            }
+            aat_replace(root, path[depth-1], leaf, leaf->left);
+        } else {
+            leaf = node->right;
+            while (leaf->left) {
+                path[depth++] = leaf;
+                leaf = leaf->left;
+            }
+            aat_replace(root, path[depth-1], leaf, leaf->right);
+        }
+        leaf->left = node->left;
+        leaf->right = node->right;
+        leaf->level = node->level;
+        aat_replace(root, parent, node, leaf);
+        path[index] = leaf;
+    }
+    aat_delete_rebalance(root, path, depth);
+    aat_clear(node);
+    return node;
+}
+
+struct aat_node *aat_delete(struct aat_node **root, struct aat_node *key) {
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int depth = 0;
+    struct aat_node *node = *root;
+    while (node) {
         int cmp = aat_compare(key, node);
-        if (cmp < 0) {
-            node->left = aat_delete0(node->left, key, deleted);
-        } else if (cmp > 0) {
-            node->right = aat_delete0(node->right, key, deleted);
+        if (cmp == 0) {
+            break;
+        }
+        path[depth++] = node;
+        node = cmp < 0 ? node->left : node->right;
+    }
+    return node ? aat_delete_path(root, path, depth, node) : 0;
+}
+
+// Fills the cursor with the path to the item itself and returns 1, or returns
+// 0 if the item is not in the tree. The search stops early at the item, and
+// otherwise goes to the first item that is equal to it and steps through the
+// equal items, which can be on either side of each other after rotations.
+static int aat_locate(struct aat_node **root, struct aat_node *item, 
+    struct aat_cursor *cursor)
+{
+    int found = 0;
+    cursor->depth = 0;
+    struct aat_node *node = *root;
+    while (node) {
+        cursor->stack[cursor->depth++] = node;
+        if (node == item) {
+            return 1;
+        }
+        int cmp = aat_compare(item, node);
+        if (cmp > 0) {
+            node = node->right;
         } else {
-            *deleted = node;
-            if (!node->left && !node->right) {
-                node = 0;
-            } else {
-                struct aat_node *leaf_deleted = 0;
-                if (!node->left) {
-                    node->right = aat_delete_first0(node->right, &leaf_deleted);
-                } else {
-                    node->left = aat_delete_last0(node->left, &leaf_deleted);
-                }
-                leaf_deleted->left = node->left;
-                leaf_deleted->right = node->right;
-                leaf_deleted->level = node->level;
-                node = leaf_deleted;
+            if (cmp == 0) {
+                found = cursor->depth;
+            }
+            node = node->left;
+        }
+    }
+    cursor->depth = found;
+    while (cursor->depth > 0) {
+        node = cursor->stack[cursor->depth-1];
+        if (node == item) {
+            return 1;
+        }
+        if (aat_compare(item, node) != 0) {
+            break;
+        }
+        if (node->right) {
+            node = node->right;
+            while (node) {
+                cursor->stack[cursor->depth++] = node;
+                node = node->left;
             }
+        } else {
+            struct aat_node *parent;
+            do {
+                node = cursor->stack[--cursor->depth];
+                parent = cursor->depth > 0 ? 
+                    cursor->stack[cursor->depth-1] : 0;
+            } while (parent && parent->right == node);
         }
-        if (node) {
-            node = aat_delete_fixup(node);
+    }
+    cursor->depth = 0;
+    return 0;
+}
+
+// Without parent links the path to the node is found with the compare
+// function, following the node itself rather than any equal item.
+struct aat_node *aat_remove_node(struct aat_node **root, struct aat_node *node) {
+    struct aat_node *path[AAT_MAXHEIGHT];
+    struct aat_cursor cursor;
+    if (!aat_locate(root, node, &cursor)) {
+        return 0;
+    }
+    int depth = cursor.depth-1;
+    for (int i = 0; i < depth; i++) {
+        path[i] = cursor.stack[i];
+    }
+    return aat_delete_path(root, path, depth, node);
+}
+
+// Returns the most items that a subtree with a root at level can hold.
+static size_t aat_build_max(int level) {
+    size_t max = 1;
+    for (int i = 0; i < level && max <= (size_t)-1 / 3; i++) {
+        max *= 3;
+    }
+    return max - 1;
+}
+
+// Builds the items into a subtree with a root at level, by laying them out as
+// a 2-3 tree with every leaf at the same depth. Each 3-node becomes a node 
+// with a right child on the same level.
+static struct aat_node *aat_build0(struct aat_node **items, size_t n, 
+    int level)
+{
+    if (level == 1) {
+        struct aat_node *node = items[0];
+        node->left = 0;
+        node->right = 0;
+        node->level = 1;
+        if (n == 2) {
+            items[1]->left = 0;
+            items[1]->right = 0;
+            items[1]->level = 1;
+            node->right = items[1];
         }
+        return node;
     }
+    if (n-1 <= aat_build_max(level-1)*2) {
+        // 2-node
+        size_t nleft = (n-1)/2;
+        struct aat_node *node = items[nleft];
+        node->left = aat_build0(items, nleft, level-1);
+        node->right = aat_build0(items+nleft+1, n-nleft-1, level-1);
+        node->level = level;
+        return node;
+    }
+    // 3-node
+    size_t nleft = (n-2)/3;
+    size_t nmid = (n-2-nleft)/2;
+    size_t nright = n-2-nleft-nmid;
+    struct aat_node *node = items[nleft];
+    struct aat_node *right = items[nleft+1+nmid];
+    right->left = aat_build0(items+nleft+1, nmid, level-1);
+    right->right = aat_build0(items+nleft+nmid+2, nright, level-1);
+    right->level = level;
+    node->left = aat_build0(items, nleft, level-1);
+    node->right = right;
+    node->level = level;
     return node;
 }
 
-struct aat_node *aat_delete(struct aat_node **root, struct aat_node *key) {
-    struct aat_node *deleted = 0;
-    *root = aat_delete0(*root, key, &deleted);
-    aat_clear(deleted);
-    return deleted;
+void aat_build_sorted(struct aat_node **root, struct aat_node **items, 
+    size_t n)
+{
+    int level = 0;
+    for (size_t m = n+1; m > 1; m >>= 1) {
+        level++;
+    }
+    *root = n > 0 ? aat_build0(items, n, level) : 0;
+}
+
+// Frees the children before the node, so that free_item never sees a node
+// whose subtree is still linked to it.
+static void aat_clear_all0(struct aat_node *node, 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata)
+{
+    if (node) {
+        aat_clear_all0(node->left, free_item, udata);
+        aat_clear_all0(node->right, free_item, udata);
+        aat_clear(node);
+        if (free_item) {
+            free_item(node, udata);
+        }
+    }
+}
+
+void aat_clear_all(struct aat_node **root, 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata)
+{
+    struct aat_node *node = *root;
+    *root = 0;
+    aat_clear_all0(node, free_item, udata);
+}
+
+// Copies the children before the node, so that a failed copy only has to
+// free the subtrees copied so far.
+static int aat_clone0(struct aat_node *node, struct aat_node **dst, 
+    struct aat_node *(*copy)(struct aat_node *item, void *udata), 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata)
+{
+    struct aat_node *left_copy = 0;
+    struct aat_node *right_copy = 0;
+    *dst = 0;
+    if (!node) {
+        return 1;
+    }
+    if (!aat_clone0(node->left, &left_copy, copy, free_item, udata)) {
+        return 0;
+    }
+    if (!aat_clone0(node->right, &right_copy, copy, free_item, udata)) {
+        aat_clear_all0(left_copy, free_item, udata);
+        return 0;
+    }
+    struct aat_node *node_copy = copy(node, udata);
+    if (!node_copy) {
+        aat_clear_all0(left_copy, free_item, udata);
+        aat_clear_all0(right_copy, free_item, udata);
+        return 0;
+    }
+    node_copy->level = node->level;
+    node_copy->left = left_copy;
+    node_copy->right = right_copy;
+    *dst = node_copy;
+    return 1;
+}
+
+int aat_clone(struct aat_node **root, struct aat_node **dst, 
+    struct aat_node *(*copy)(struct aat_node *item, void *udata), 
+    void (*free_item)(struct aat_node *item, void *udata), void *udata)
+{
+    struct aat_node *clone_root;
+    if (!aat_clone0(*root, &clone_root, copy, free_item, udata)) {
+        return 0;
+    }
+    *dst = clone_root;
+    return 1;
 }
 
 struct aat_node *aat_search(struct aat_node **root, struct aat_node *key) {
@@ -271,38 +730,54 @@ struct aat_node *aat_iter(struct aat_node **root, struct aat_node *key) {
     struct aat_node *found = 0;
     struct aat_node *node = *root;
     while (node) {
-        int cmp = aat_compare(key, node);
-        if (cmp < 0) {
-            found = node;
-            node = node->left;
-        } else if (cmp > 0) {
+        if (aat_compare(key, node) > 0) {
             node = node->right;
         } else {
             found = node;
-            node = 0;
+            node = node->left;
         }
     }
     return found;
 }
 
-static struct aat_node *aat_parent(struct aat_node **root, 
-    struct aat_node *item)
+static struct aat_node *aat_iter_after(struct aat_node **root, 
+    struct aat_node *key)
 {
-    struct aat_node *parent = 0;
+    struct aat_node *found = 0;
     struct aat_node *node = *root;
     while (node) {
-        int cmp = aat_compare(item, node);
-        if (cmp < 0) {
-            parent = node;
-            node = node->left;
-        } else if (cmp > 0) {
-            parent = node;
+        if (aat_compare(key, node) >= 0) {
             node = node->right;
         } else {
-            node = 0;
+            found = node;
+            node = node->left;
         }
     }
-    return parent;
+    return found;
+}
+
+struct aat_node *aat_equal_range(struct aat_node **root, struct aat_node *key, 
+    struct aat_node **end)
+{
+    struct aat_node *first = aat_iter(root, key);
+    if (!first || aat_compare(key, first) != 0) {
+        *end = first;
+        return 0;
+    }
+    *end = aat_iter_after(root, key);
+    return first;
+}
+
+// Finds the parent through the path to the item itself, so that next and prev
+// work with duplicate keys.
+static struct aat_node *aat_parent(struct aat_node **root, 
+    struct aat_node *item)
+{
+    struct aat_cursor cursor;
+    if (!aat_locate(root, item, &cursor) || cursor.depth < 2) {
+        return 0;
+    }
+    return cursor.stack[cursor.depth-2];
 }
 
 struct aat_node *aat_next(struct aat_node **root, struct aat_node *node) {
@@ -342,3 +817,662 @@ struct aat_node *aat_prev(struct aat_node **root, struct aat_node *node) {
     }
     return node;
 }
+
+struct aat_node *aat_cursor_item(struct aat_cursor *cursor) {
+    if (cursor->depth == 0) {
+        return 0;
+    }
+    return cursor->stack[cursor->depth-1];
+}
+
+struct aat_node *aat_cursor_first(struct aat_node **root, 
+    struct aat_cursor *cursor)
+{
+    cursor->depth = 0;
+    struct aat_node *node = *root;
+    while (node) {
+        cursor->stack[cursor->depth++] = node;
+        node = node->left;
+    }
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_cursor_last(struct aat_node **root, 
+    struct aat_cursor *cursor)
+{
+    cursor->depth = 0;
+    struct aat_node *node = *root;
+    while (node) {
+        cursor->stack[cursor->depth++] = node;
+        node = node->right;
+    }
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_cursor_seek(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key)
+{
+    int found = 0;
+    cursor->depth = 0;
+    struct aat_node *node = *root;
+    while (node) {
+        cursor->stack[cursor->depth++] = node;
+        if (aat_compare(key, node) > 0) {
+            node = node->right;
+        } else {
+            found = cursor->depth;
+            node = node->left;
+        }
+    }
+    cursor->depth = found;
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_cursor_next(struct aat_cursor *cursor) {
+    struct aat_node *node = aat_cursor_item(cursor);
+    if (node) {
+        if (node->right) {
+            node = node->right;
+            while (node) {
+                cursor->stack[cursor->depth++] = node;
+                node = node->left;
+            }
+        } else {
+            struct aat_node *parent;
+            do {
+                node = cursor->stack[--cursor->depth];
+                parent = aat_cursor_item(cursor);
+            } while (parent && parent->right == node);
+        }
+    }
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_cursor_prev(struct aat_cursor *cursor) {
+    struct aat_node *node = aat_cursor_item(cursor);
+    if (node) {
+        if (node->left) {
+            node = node->left;
+            while (node) {
+                cursor->stack[cursor->depth++] = node;
+                node = node->right;
+            }
+        } else {
+            struct aat_node *parent;
+            do {
+                node = cursor->stack[--cursor->depth];
+                parent = aat_cursor_item(cursor);
+            } while (parent && parent->left == node);
+        }
+    }
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_cursor_remove(struct aat_node **root, 
+    struct aat_cursor *cursor)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    struct aat_node *node = aat_cursor_item(cursor);
+    if (!node) {
+        return 0;
+    }
+    int depth = cursor->depth-1;
+    for (int i = 0; i < depth; i++) {
+        path[i] = cursor->stack[i];
+    }
+    cursor->depth = 0;
+    return aat_delete_path(root, path, depth, node);
+}
+
+// Returns how much of the cursor stack to keep, climbing until the subtree
+// at the top of the kept stack holds the key's position. The found output
+// is the depth of the nearest ancestor that a rightward descent would leave
+// as the lower bound.
+static int aat_climb(struct aat_cursor *cursor, struct aat_node *key, 
+    int inclusive, int *found)
+{
+    int k = cursor->depth-1;
+    *found = 0;
+    if (k < 0) {
+        return 0;
+    }
+    for (;;) {
+        int lo = -1;
+        int hi = -1;
+        for (int j = k-1; j >= 0 && (lo == -1 || hi == -1); j--) {
+            struct aat_node *node = cursor->stack[j];
+            if (node->left == cursor->stack[j+1]) {
+                hi = hi == -1 ? j : hi;
+            } else {
+                lo = lo == -1 ? j : lo;
+            }
+        }
+        if (lo != -1 && aat_compare(key, cursor->stack[lo]) <= 0) {
+            k = lo;
+            continue;
+        }
+        if (hi != -1) {
+            int cmp = aat_compare(key, cursor->stack[hi]);
+            if (cmp > 0 || (cmp == 0 && !inclusive)) {
+                k = hi;
+                continue;
+            }
+        }
+        *found = hi+1;
+        return k+1;
+    }
+}
+
+struct aat_node *aat_cursor_seek_from(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key)
+{
+    int found;
+    cursor->depth = aat_climb(cursor, key, 1, &found);
+    struct aat_node *node = *root;
+    if (cursor->depth > 0) {
+        node = cursor->stack[--cursor->depth];
+    }
+    while (node) {
+        cursor->stack[cursor->depth++] = node;
+        if (aat_compare(key, node) > 0) {
+            node = node->right;
+        } else {
+            found = cursor->depth;
+            node = node->left;
+        }
+    }
+    cursor->depth = found;
+    return aat_cursor_item(cursor);
+}
+
+struct aat_node *aat_search_from(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *key)
+{
+    struct aat_node *item = aat_cursor_seek_from(root, cursor, key);
+    return item && aat_compare(key, item) == 0 ? item : 0;
+}
+
+struct aat_node *aat_insert_hint(struct aat_node **root, 
+    struct aat_cursor *cursor, struct aat_node *item)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int found;
+    int pathlen = aat_climb(cursor, item, 0, &found);
+    for (int i = 0; i < pathlen; i++) {
+        path[i] = cursor->stack[i];
+    }
+    struct aat_node *prev = aat_insert_path(root, path, &pathlen, item, 0);
+    for (int i = 0; i < pathlen; i++) {
+        cursor->stack[i] = path[i];
+    }
+    cursor->depth = pathlen;
+    return prev;
+}
+
+size_t aat_count_equal(struct aat_node **root, struct aat_node *key) {
+    struct aat_cursor cursor;
+    size_t count = 0;
+    struct aat_node *item = aat_cursor_seek(root, &cursor, key);
+    while (item && aat_compare(key, item) == 0) {
+        count++;
+        item = aat_cursor_next(&cursor);
+    }
+    return count;
+}
+
+void aat_scan(struct aat_node **root, struct aat_node *lo, struct aat_node *hi, 
+    int (*iter)(struct aat_node *item, void *udata), void *udata)
+{
+    struct aat_cursor cursor;
+    if (lo && hi && aat_compare(lo, hi) >= 0) {
+        return;
+    }
+    struct aat_node *end = hi ? aat_iter(root, hi) : 0;
+    struct aat_node *item = lo ? aat_cursor_seek(root, &cursor, lo) :
+        aat_cursor_first(root, &cursor);
+    while (item != end) {
+        if (!iter(item, udata)) {
+            return;
+        }
+        item = aat_cursor_next(&cursor);
+    }
+}
+
+void aat_scan_reverse(struct aat_node **root, struct aat_node *lo, 
+    struct aat_node *hi, int (*iter)(struct aat_node *item, void *udata), 
+    void *udata)
+{
+    struct aat_cursor cursor;
+    if (lo && hi && aat_compare(lo, hi) >= 0) {
+        return;
+    }
+    struct aat_node *first = lo ? aat_iter(root, lo) : aat_first(root);
+    struct aat_node *item = hi ? aat_cursor_seek(root, &cursor, hi) : 0;
+    if (item == first) {
+        return;
+    }
+    item = item ? aat_cursor_prev(&cursor) : aat_cursor_last(root, &cursor);
+    while (iter(item, udata) && item != first) {
+        item = aat_cursor_prev(&cursor);
+    }
+}
+
+static struct aat_node *aat_join0(struct aat_node *left_root, 
+    struct aat_node *pivot, struct aat_node *right_root)
+{
+    struct aat_node *path[AAT_MAXHEIGHT];
+    int depth = 0;
+    int left_level = left_root ? left_root->level : 0;
+    int right_level = right_root ? right_root->level : 0;
+    struct aat_node *root;
+    if (left_level == right_level) {
+        pivot->left = left_root;
+        pivot->right = right_root;
+        pivot->level = left_level+1;
+        return pivot;
+    } else if (left_level > right_level) {
+        root = left_root;
+        struct aat_node *node = left_root;
+        while (node->level > right_level+1 || 
+            (node->right && node->right->level > right_level))
+        {
+            path[depth++] = node;
+            node = node->right;
+        }
+        pivot->left = node->right;
+        pivot->right = right_root;
+        pivot->level = right_level+1;
+        node->right = pivot;
+        path[depth++] = node;
+    } else {
+        root = right_root;
+        struct aat_node *node = right_root;
+        while (node->level > left_level+1) {
+            path[depth++] = node;
+            node = node->left;
+        }
+        pivot->left = left_root;
+        pivot->right = node->left;
+        pivot->level = left_level+1;
+        node->left = pivot;
+        path[depth++] = node;
+    }
+    while (depth > 0) {
+        struct aat_node *node = path[--depth];
+        aat_replace(&root, depth > 0 ? path[depth-1] : 0, node, 
+            aat_split(aat_skew(node)));
+    }
+    return root;
+}
+
+static struct aat_node *aat_concat0(struct aat_node *left_root, 
+    struct aat_node *right_root)
+{
+    if (!left_root) {
+        return right_root;
+    }
+    if (!right_root) {
+        return left_root;
+    }
+    struct aat_node *pivot = aat_delete_last(&left_root);
+    return aat_join0(left_root, pivot, right_root);
+}
+
+static void aat_split0(struct aat_node *node, struct aat_node *key, 
+    struct aat_node **left_root, struct aat_node **right_root)
+{
+    if (!node) {
+        *left_root = 0;
+        *right_root = 0;
+    } else if (aat_compare(key, node) <= 0) {
+        struct aat_node *right_node = node->right;
+        aat_split0(node->left, key, left_root, right_root);
+        *right_root = aat_join0(*right_root, node, right_node);
+    } else {
+        struct aat_node *left_node = node->left;
+        aat_split0(node->right, key, left_root, right_root);
+        *left_root = aat_join0(left_node, node, *left_root);
+    }
+}
+
+struct aat_node *aat_delete_range(struct aat_node **root, struct aat_node *lo, 
+    struct aat_node *hi)
+{
+    struct aat_node *left_root = 0;
+    struct aat_node *mid_root = *root;
+    struct aat_node *right_root = 0;
+    if (lo && hi && aat_compare(lo, hi) >= 0) {
+        return 0;
+    }
+    if (lo) {
+        aat_split0(mid_root, lo, &left_root, &mid_root);
+    }
+    if (hi) {
+        aat_split0(mid_root, hi, &mid_root, &right_root);
+    }
+    *root = aat_concat0(left_root, right_root);
+    return mid_root;
+}
+
+void aat_split_at(struct aat_node **root, struct aat_node *key, 
+    struct aat_node **left, struct aat_node **right)
+{
+    struct aat_node *left_root;
+    struct aat_node *right_root;
+    struct aat_node *node = *root;
+    *root = 0;
+    aat_split0(node, key, &left_root, &right_root);
+    *left = left_root;
+    *right = right_root;
+}
+
+void aat_join(struct aat_node **left, struct aat_node *pivot, 
+    struct aat_node **right)
+{
+    struct aat_node *right_root = *right;
+    *right = 0;
+    if (pivot) {
+        *left = aat_join0(*left, pivot, right_root);
+    } else {
+        *left = aat_concat0(*left, right_root);
+    }
+}
+
+// Splits the tree into the items less than the key and the items greater than
+// the key, and returns the item equal to the key, if any.
+static struct aat_node *aat_split3(struct aat_node *node, struct aat_node *key, 
+    struct aat_node **left_root, struct aat_node **right_root)
+{
+    if (!node) {
+        *left_root = 0;
+        *right_root = 0;
+        return 0;
+    }
+    int cmp = aat_compare(key, node);
+    struct aat_node *left_node = node->left;
+    struct aat_node *right_node = node->right;
+    struct aat_node *equal = node;
+    if (cmp < 0) {
+        equal = aat_split3(left_node, key, left_root, right_root);
+        *right_root = aat_join0(*right_root, node, right_node);
+    } else if (cmp > 0) {
+        equal = aat_split3(right_node, key, left_root, right_root);
+        *left_root = aat_join0(left_node, node, *left_root);
+    } else {
+        *left_root = left_node;
+        *right_root = right_node;
+    }
+    return equal;
+}
+
+// Splits the first tree at the root of the other, and recurses on each side
+// with the children of that root. Removed items are joined to the right side
+// of the removed tree, which keeps them in order.
+static struct aat_node *aat_union0(struct aat_node *node, 
+    struct aat_node *other, 
+    struct aat_node *(*conflict)(struct aat_node *item, 
+        struct aat_node *other_item, void *udata), 
+    void *udata, struct aat_node **removed)
+{
+    if (!node) {
+        return other;
+    }
+    if (!other) {
+        return node;
+    }
+    struct aat_node *other_left = other->left;
+    struct aat_node *other_right = other->right;
+    struct aat_node *left_root, *right_root;
+    struct aat_node *equal = aat_split3(node, other, &left_root, &right_root);
+    left_root = aat_union0(left_root, other_left, conflict, udata, removed);
+    struct aat_node *pivot = other;
+    if (equal) {
+        pivot = conflict ? conflict(equal, other, udata) : equal;
+        struct aat_node *loser = pivot == equal ? other : equal;
+        *removed = aat_join0(*removed, loser, 0);
+    }
+    right_root = aat_union0(right_root, other_right, conflict, udata, removed);
+    return aat_join0(left_root, pivot, right_root);
+}
+
+static struct aat_node *aat_intersect0(struct aat_node *node, 
+    struct aat_node *other, struct aat_node **removed)
+{
+    if (!node) {
+        return 0;
+    }
+    if (!other) {
+        *removed = aat_concat0(*removed, node);
+        return 0;
+    }
+    struct aat_node *left_root, *right_root;
+    struct aat_node *equal = aat_split3(node, other, &left_root, &right_root);
+    left_root = aat_intersect0(left_root, other->left, removed);
+    right_root = aat_intersect0(right_root, other->right, removed);
+    if (equal) {
+        return aat_join0(left_root, equal, right_root);
+    }
+    return aat_concat0(left_root, right_root);
+}
+
+static struct aat_node *aat_difference0(struct aat_node *node, 
+    struct aat_node *other, struct aat_node **removed)
+{
+    if (!node || !other) {
+        return node;
+    }
+    struct aat_node *left_root, *right_root;
+    struct aat_node *equal = aat_split3(node, other, &left_root, &right_root);
+    left_root = aat_difference0(left_root, other->left, removed);
+    if (equal) {
+        *removed = aat_join0(*removed, equal, 0);
+    }
+    right_root = aat_difference0(right_root, other->right, removed);
+    return aat_concat0(left_root, right_root);
+}
+
+struct aat_node *aat_union(struct aat_node **root, struct aat_node **other, 
+    struct aat_node *(*conflict)(struct aat_node *item, 
+        struct aat_node *other_item, void *udata), 
+    void *udata)
+{
+    struct aat_node *removed = 0;
+    struct aat_node *other_root = *other;
+    *other = 0;
+    *root = aat_union0(*root, other_root, conflict, udata, &removed);
+    return removed;
+}
+
+struct aat_node *aat_intersect(struct aat_node **root, 
+    struct aat_node **other)
+{
+    struct aat_node *removed = 0;
+    *root = aat_intersect0(*root, *other, &removed);
+    return removed;
+}
+
+struct aat_node *aat_difference(struct aat_node **root, 
+    struct aat_node **other)
+{
+    struct aat_node *removed = 0;
+    *root = aat_difference0(*root, *other, &removed);
+    return removed;
+}
+
+static struct aat_node *aat_relayout0(struct aat_node *node, int height, 
+    struct aat_node *dst, size_t *n);
+
+static void aat_relayout_bottom(struct aat_node *node, int depth, int height, 
+    struct aat_node *dst, size_t *n)
+{
+    if (depth > 1) {
+        if (node->left) {
+            aat_relayout_bottom(node->left, depth-1, height, dst, n);
+        }
+        if (node->right) {
+            aat_relayout_bottom(node->right, depth-1, height, dst, n);
+        }
+    } else {
+        if (node->left) {
+            node->left = aat_relayout0(node->left, height, dst, n);
+        }
+        if (node->right) {
+            node->right = aat_relayout0(node->right, height, dst, n);
+        }
+    }
+}
+
+static struct aat_node *aat_relayout0(struct aat_node *node, int height, 
+    struct aat_node *dst, size_t *n)
+{
+    if (height == 1) {
+        struct aat_node *copy = &dst[(*n)++];
+        *copy = *node;
+        return copy;
+    }
+    int top = height/2;
+    struct aat_node *copy = aat_relayout0(node, top, dst, n);
+    aat_relayout_bottom(copy, top, height-top, dst, n);
+    return copy;
+}
+
+size_t aat_relayout(struct aat_node **root, struct aat_node *dst) {
+    size_t n = 0;
+    if (*root) {
+        *root = aat_relayout0(*root, (*root)->level*2, dst, &n);
+    }
+    return n;
+}
+
+void aat_search_many(struct aat_node **root, struct aat_node **keys, 
+    struct aat_node **found, size_t n)
+{
+    struct aat_node *nodes[AAT_SEARCH_MANY];
+    for (size_t i = 0; i < n; i += AAT_SEARCH_MANY) {
+        size_t m = n-i < AAT_SEARCH_MANY ? n-i : AAT_SEARCH_MANY;
+        for (size_t j = 0; j < m; j++) {
+            nodes[j] = *root;
+            found[i+j] = 0;
+        }
+        int active = 1;
+        while (active) {
+            active = 0;
+            for (size_t j = 0; j < m; j++) {
+                struct aat_node *node = nodes[j];
+                if (!node) {
+                    continue;
+                }
+                int cmp = aat_compare(keys[i+j], node);
+                if (cmp == 0) {
+                    found[i+j] = node;
+                    node = 0;
+                } else {
+                    node = cmp < 0 ? node->left : node->right;
+                    AAT_PREFETCH_ADDR(node);
+                    active |= node != 0;
+                }
+                nodes[j] = node;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tree handle
+////////////////////////////////////////////////////////////////////////////////
+
+struct aat_node *aat_tree_insert(struct aat_tree *tree, struct aat_node *item) {
+    struct aat_node *replaced = aat_insert(&tree->root, item);
+    if (replaced) {
+        if (tree->first == replaced) {
+            tree->first = item;
+        }
+        if (tree->last == replaced) {
+            tree->last = item;
+        }
+    } else {
+        tree->count++;
+        if (!tree->first || aat_compare(item, tree->first) < 0) {
+            tree->first = item;
+        }
+        if (!tree->last || aat_compare(item, tree->last) > 0) {
+            tree->last = item;
+        }
+    }
+    return replaced;
+}
+
+static void aat_tree_removed(struct aat_tree *tree, struct aat_node *node) {
+    tree->count--;
+    if (tree->first == node) {
+        tree->first = aat_first(&tree->root);
+    }
+    if (tree->last == node) {
+        tree->last = aat_last(&tree->root);
+    }
+}
+
+struct aat_node *aat_tree_delete(struct aat_tree *tree, struct aat_node *key) {
+    struct aat_node *deleted = aat_delete(&tree->root, key);
+    if (deleted) {
+        aat_tree_removed(tree, deleted);
+    }
+    return deleted;
+}
+
+struct aat_node *aat_tree_remove_node(struct aat_tree *tree, 
+    struct aat_node *node)
+{
+    struct aat_node *removed = aat_remove_node(&tree->root, node);
+    if (removed) {
+        aat_tree_removed(tree, removed);
+    }
+    return removed;
+}
+
+struct aat_node *aat_tree_delete_first(struct aat_tree *tree) {
+    struct aat_node *node = aat_delete_first0(&tree->root, &tree->first);
+    if (node) {
+        tree->count--;
+        if (tree->last == node) {
+            tree->last = 0;
+        }
+    }
+    return node;
+}
+
+struct aat_node *aat_tree_delete_last(struct aat_tree *tree) {
+    struct aat_node *node = aat_delete_last0(&tree->root, &tree->last);
+    if (node) {
+        tree->count--;
+        if (tree->first == node) {
+            tree->first = 0;
+        }
+    }
+    return node;
+}
+
+struct aat_node *aat_tree_first(struct aat_tree *tree) {
+    return tree->first;
+}
+
+struct aat_node *aat_tree_last(struct aat_tree *tree) {
+    return tree->last;
+}
+
+size_t aat_tree_count(struct aat_tree *tree) {
+    return tree->count;
+}
+
+void aat_tree_sync(struct aat_tree *tree) {
+    struct aat_cursor cursor;
+    struct aat_node *item = aat_cursor_first(&tree->root, &cursor);
+    tree->first = item;
+    tree->last = 0;
+    tree->count = 0;
+    while (item) {
+        tree->last = item;
+        tree->count++;
+        item = aat_cursor_next(&cursor);
+    }
+}
@@ -9,7 +9,186 @@
 #ifndef AAT_H
 #define AAT_H
 
-#define AAT_DEF(specifiers, prefix, type)                                      \
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef AAT_PARALLEL
+#include <pthread.h>
+#endif
+
+// The maximum height of any aat tree. An AA tree with n nodes has a root level
+// no greater than log2(n+1) and a height no greater than twice that level.
+#define AAT_MAXHEIGHT 128
+
+// A cursor holds the path from the root to the current item, allowing for
+// iterating over a tree without calling the compare function. Any change to
+// the tree invalidates all of its cursors.
+struct aat_cursor {
+    void *stack[AAT_MAXHEIGHT];
+    int depth;
+};
+
+// Hints to the processor that the memory at the address will soon be read.
+#if defined(__GNUC__) || defined(__clang__)
+#define AAT_PREFETCH_ADDR(addr) __builtin_prefetch(addr)
+#else
+#define AAT_PREFETCH_ADDR(addr) ((void)0)
+#endif
+
+// Stores a pointer so that all earlier writes are visible to any thread that
+// loads it with AAT_LOAD_ACQUIRE, for publishing a new root to readers.
+#if defined(__GNUC__) || defined(__clang__)
+#define AAT_STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define AAT_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#else
+#define AAT_STORE_RELEASE(ptr, val) (*(ptr) = (val))
+#define AAT_LOAD_ACQUIRE(ptr) (*(ptr))
+#endif
+
+// Define AAT_ATOMIC before including this file to make every load and store
+// of a link or level that the trees make an atomic access, with acquire loads
+// and release stores. This is what lets the readers of AAT_IMPL_SEQLOCK run
+// at the same time as a writer without a data race, and an item that a reader
+// reaches through a link is seen with every write that was made to it before
+// it was linked in. Without AAT_ATOMIC the links are plain fields.
+#ifdef AAT_ATOMIC
+#if !defined(__GNUC__) && !defined(__clang__)
+#error "AAT_ATOMIC needs the GCC or Clang atomic builtins"
+#endif
+#define AAT_LINK_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define AAT_LINK_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#else
+#define AAT_LINK_LOAD(ptr) (*(ptr))
+#define AAT_LINK_STORE(ptr, val) (*(ptr) = (val))
+#endif
+
+#ifdef AAT_ATOMIC
+// A sequence lock for sharing a tree between threads, where readers never
+// write to shared memory. The sequence is odd while a writer is changing the
+// tree. A reader notes the sequence before reading and retries when it has
+// changed after. Writers wait for each other by spinning. A lock that is all
+// zeros is unlocked.
+//
+// No fences are needed, because the links are loaded with acquire and stored
+// with release. A reader that loads any link stored by a writer has seen the
+// start of that write, so its last load of the sequence sees that it changed.
+struct aat_seqlock {
+    unsigned seq;
+};
+
+static inline unsigned aat_seqlock_read_begin(struct aat_seqlock *lock) {
+    unsigned seq;
+    while ((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    return seq;
+}
+
+static inline int aat_seqlock_read_retry(struct aat_seqlock *lock,
+    unsigned seq)
+{
+    return __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE) != seq;
+}
+
+static inline void aat_seqlock_write_begin(struct aat_seqlock *lock) {
+    for (;;) {
+        unsigned seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+        if (!(seq&1) && __atomic_compare_exchange_n(&lock->seq, &seq, seq+1,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+static inline void aat_seqlock_write_end(struct aat_seqlock *lock) {
+    unsigned seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->seq, seq+1, __ATOMIC_RELEASE);
+}
+#endif
+
+// Define AAT_PREFETCH before including this file to have each step down the
+// tree in insert, delete, search, iter and cursor_seek prefetch both children
+// of a node while it is compared. This can help with large trees that do not
+// fit in the cache.
+#ifdef AAT_PREFETCH
+#define AAT_PREFETCH_CHILD(node) AAT_PREFETCH_ADDR(node)
+#else
+#define AAT_PREFETCH_CHILD(node) ((void)0)
+#endif
+
+// Define AAT_STATS before including this file to have the generated functions
+// count what they do, for finding out whether a slowdown comes from a deeper
+// tree, more compares, or more rebalancing. Each kind of tree gets a stats
+// function that returns the counters of the calling thread, which can be read
+// or cleared at any time. Without AAT_STATS the counting compiles to nothing.
+#define AAT_STATS_DEPTHS 64
+
+struct aat_stats {
+    uint64_t compares;        // calls to the compare function
+    uint64_t skews;           // skews that rotated
+    uint64_t splits;          // splits that rotated
+    uint64_t decrease_levels; // decrease_level calls that lowered a level
+    uint64_t descents;        // walks down from the root or a cursor
+    uint64_t depth_total;     // nodes visited by all descents
+    uint64_t depths[AAT_STATS_DEPTHS]; // descents by nodes visited
+};
+
+#ifdef AAT_STATS
+#if defined(__GNUC__) || defined(__clang__)
+#define AAT_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define AAT_THREAD_LOCAL _Thread_local
+#else
+#define AAT_THREAD_LOCAL
+#endif
+#define AAT_STATS_ADD(prefix, field) (prefix##_stats()->field++)
+#define AAT_STATS_DEPTH(prefix, depth) prefix##_stats_depth(depth)
+#define AAT_STATS_STEP(depth) ((depth)++)
+#define AAT_STATS_DEF(specifiers, prefix)                                      \
+specifiers struct aat_stats *prefix##_stats(void);                             \
+
+#define AAT_STATS_IMPL(prefix)                                                 \
+struct aat_stats *prefix##_stats(void) {                                       \
+    static AAT_THREAD_LOCAL struct aat_stats stats;                            \
+    return &stats;                                                             \
+}                                                                              \
+                                                                               \
+static inline void prefix##_stats_depth(int depth) {                           \
+    struct aat_stats *stats = prefix##_stats();                                \
+    stats->descents++;                                                         \
+    stats->depth_total += depth;                                               \
+    stats->depths[depth < AAT_STATS_DEPTHS ? depth : AAT_STATS_DEPTHS-1]++;    \
+}                                                                              \
+
+#else
+#define AAT_STATS_ADD(prefix, field) ((void)0)
+#define AAT_STATS_DEPTH(prefix, depth) ((void)(depth))
+#define AAT_STATS_STEP(depth) ((void)0)
+#define AAT_STATS_DEF(specifiers, prefix)
+#define AAT_STATS_IMPL(prefix)
+#endif
+
+// The number of searches that search_many interleaves at once.
+#define AAT_SEARCH_MANY 16
+
+// The header at the start of a tree saved by the save function of an indexed
+// tree, which is followed by the array of nodes. The magic also detects a file
+// written on a system with a different byte order.
+#define AAT_FILE_MAGIC 0x31544141
+#define AAT_FILE_VERSION 1
+
+struct aat_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t root;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+// Declares the functions of AAT_CORE, which every variant generates.
+#define AAT_DEF_CORE(specifiers, prefix, type)                                 \
+AAT_STATS_DEF(specifiers, prefix)                                              \
 specifiers type *prefix##_insert(type **root, type *item);                     \
 specifiers type *prefix##_delete(type **root, type *key);                      \
 specifiers type *prefix##_search(type **root, type *key);                      \
@@ -20,239 +199,2485 @@ specifiers type *prefix##_last(type **root);                                   \
 specifiers type *prefix##_iter(type **root, type *key);                        \
 specifiers type *prefix##_prev(type **root, type *item);                       \
 specifiers type *prefix##_next(type **root, type *item);                       \
+specifiers type *prefix##_cursor_first(type **root,                            \
+    struct aat_cursor *cursor);                                                \
+specifiers type *prefix##_cursor_last(type **root,                             \
+    struct aat_cursor *cursor);                                                \
+specifiers type *prefix##_cursor_seek(type **root,                             \
+    struct aat_cursor *cursor, type *key);                                     \
+specifiers type *prefix##_cursor_item(struct aat_cursor *cursor);              \
+specifiers type *prefix##_cursor_next(struct aat_cursor *cursor);              \
+specifiers type *prefix##_cursor_prev(struct aat_cursor *cursor);              \
+specifiers type *prefix##_cursor_remove(type **root,                           \
+    struct aat_cursor *cursor);                                                \
+specifiers type *prefix##_remove_node(type **root, type *node);                \
+specifiers type *prefix##_cursor_seek_from(type **root,                        \
+    struct aat_cursor *cursor, type *key);                                     \
+specifiers type *prefix##_search_from(type **root, struct aat_cursor *cursor,  \
+    type *key);                                                                \
+specifiers type *prefix##_insert_hint(type **root, struct aat_cursor *cursor,  \
+    type *item);                                                               \
+specifiers void prefix##_build_sorted(type **root, type **items, size_t n);    \
+specifiers void prefix##_clear_all(type **root,                                \
+    void (*free_item)(type *item, void *udata), void *udata);                  \
+specifiers int prefix##_clone(type **root, type **dst,                         \
+    type *(*copy)(type *item, void *udata),                                    \
+    void (*free_item)(type *item, void *udata), void *udata);                  \
+specifiers size_t prefix##_insert_batch(type **root, type **items, size_t n,   \
+    type **replaced);                                                          \
+specifiers void prefix##_scan(type **root, type *lo, type *hi,                 \
+    int (*iter)(type *item, void *udata), void *udata);                        \
+specifiers void prefix##_scan_reverse(type **root, type *lo, type *hi,         \
+    int (*iter)(type *item, void *udata), void *udata);                        \
+specifiers type *prefix##_delete_range(type **root, type *lo, type *hi);       \
+specifiers void prefix##_split_at(type **root, type *key, type **left,         \
+    type **right);                                                             \
+specifiers void prefix##_join(type **left, type *pivot, type **right);         \
+specifiers type *prefix##_union(type **root, type **other,                     \
+    type *(*conflict)(type *item, type *other_item, void *udata),              \
+    void *udata);                                                              \
+specifiers type *prefix##_intersect(type **root, type **other);                \
+specifiers type *prefix##_difference(type **root, type **other);               \
+specifiers void prefix##_insert_multi(type **root, type *item);                \
+specifiers type *prefix##_get_or_insert(type **root, type *item,               \
+    int *inserted);                                                            \
+specifiers type *prefix##_get_or_insert_with(type **root, type *key,           \
+    type *(*make)(type *key, void *udata), void *udata, int *inserted);        \
+specifiers type *prefix##_equal_range(type **root, type *key, type **end);     \
+specifiers size_t prefix##_count_equal(type **root, type *key);                \
+specifiers void prefix##_search_many(type **root, type **keys, type **found,   \
+    size_t n);                                                                 \
+
+// Declares the functions generated by AAT_IMPL and every variant other than
+// AAT_IMPL_INDEXED, which has no relayout because its links are positions in
+// the base array.
+#define AAT_DEF(specifiers, prefix, type)                                      \
+AAT_DEF_CORE(specifiers, prefix, type)                                         \
+specifiers size_t prefix##_relayout(type **root, type *dst);                   \
 
 #define AAT_FIELDS(type, left, right, level)                                   \
 type *left;                                                                    \
 type *right;                                                                   \
 int level;                                                                     \
 
+// Same as AAT_FIELDS but with an additional link to the parent node, which
+// allows for prev and next to step back up the tree without calling the
+// compare function. Use with AAT_IMPL_PARENT.
+#define AAT_FIELDS_PARENT(type, left, right, parent, level)                    \
+type *left;                                                                    \
+type *right;                                                                   \
+type *parent;                                                                  \
+int level;                                                                     \
+
+// Same as AAT_FIELDS but with an additional count of the items in the subtree
+// of the node, which allows for finding items by their position in the tree.
+// Use with AAT_DEF_COUNTED and AAT_IMPL_COUNTED.
+#define AAT_FIELDS_COUNTED(type, left, right, level, count)                    \
+type *left;                                                                    \
+type *right;                                                                   \
+size_t count;                                                                  \
+int level;                                                                     \
+
+// Same as AAT_FIELDS but without a level field. The level is instead packed
+// into the three low bits of both links, which requires the node to be aligned
+// to at least eight bytes, as any node holding a pointer is on 64-bit systems.
+// The links must only be read through the generated functions.
+// Use with AAT_IMPL_COMPACT.
+#define AAT_FIELDS_COMPACT(type, left, right)                                  \
+type *left;                                                                    \
+type *right;                                                                   \
+
+// Same as AAT_FIELDS but for nodes that are kept in a single array, with the
+// links stored as 32-bit positions in that array rather than as pointers. This
+// makes the links half the size on 64-bit systems and keeps them valid when the
+// array is moved. Use with AAT_IMPL_INDEXED.
+#define AAT_FIELDS_INDEXED(left, right, level)                                 \
+uint32_t left;                                                                 \
+uint32_t right;                                                                \
+int level;                                                                     \
+
+#define AAT_DEF_INDEXED(specifiers, prefix, type)                              \
+AAT_DEF_CORE(specifiers, prefix, type)                                         \
+specifiers size_t prefix##_save(type **root, size_t count, void *dst,          \
+    size_t size);                                                              \
+specifiers type *prefix##_open_mapped(void *data, size_t size, type **root,    \
+    int validate);                                                             \
+
+#define AAT_DEF_KEY(specifiers, prefix, type, keytype)                         \
+AAT_DEF(specifiers, prefix, type)                                              \
+specifiers type *prefix##_search_key(type **root, keytype key);                \
+specifiers type *prefix##_iter_key(type **root, keytype key);                  \
+specifiers type *prefix##_delete_key(type **root, keytype key);                \
+specifiers type *prefix##_cursor_seek_key(type **root,                         \
+    struct aat_cursor *cursor, keytype key);                                   \
+
+#define AAT_DEF_COUNTED(specifiers, prefix, type)                              \
+AAT_DEF(specifiers, prefix, type)                                              \
+specifiers size_t prefix##_count(type **root);                                 \
+specifiers type *prefix##_select(type **root, size_t index);                   \
+specifiers size_t prefix##_rank(type **root, type *key);                       \
+specifiers size_t prefix##_count_range(type **root, type *lo, type *hi);       \
+
 #define AAT_IMPL(prefix, type, left, right, level, compare)                    \
+AAT_LINKS(prefix, type, left, right, level, compare)                           \
+                                                                               \
 static void prefix##_clear(type *node) {                                       \
     if (node) {                                                                \
-        node->left = 0;                                                        \
-        node->right = 0;                                                       \
-        node->level = 0;                                                       \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        AAT_LINK_STORE(&node->level, 0);                                       \
     }                                                                          \
 }                                                                              \
                                                                                \
-static type *prefix##_skew(type *node) {                                       \
-    if (node && node->left &&                                                  \
-        node->left->level == node->level)                                      \
-    {                                                                          \
-        type *left_node = node->left;                                          \
-        node->left = left_node->right;                                         \
-        left_node->right = node;                                               \
-        node = left_node;                                                      \
+static inline void prefix##_refresh(type *node) {                              \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+AAT_CORE(prefix, type, compare)                                                \
+AAT_RELAYOUT(prefix, type)                                                     \
+
+// Same as AAT_IMPL but the items are ordered by a key instead of a compare
+// function, for integer keys or any other key type that works with the < and
+// == operators. The getkey argument is a function or macro with the signature
+// 'keytype getkey(type *node)'. Along with the standard functions, this also
+// generates search, iter, delete, and cursor_seek functions ending with '_key',
+// which take a key rather than an item.
+#define AAT_IMPL_KEY(prefix, type, left, right, level, keytype, getkey)        \
+static inline int prefix##_keycompare(type *a, type *b) {                      \
+    keytype akey = getkey(a);                                                  \
+    keytype bkey = getkey(b);                                                  \
+    return (akey > bkey) - (akey < bkey);                                      \
+}                                                                              \
+                                                                               \
+AAT_LINKS(prefix, type, left, right, level, prefix##_keycompare)               \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        AAT_LINK_STORE(&node->level, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+AAT_CORE(prefix, type, prefix##_keycompare)                                    \
+AAT_RELAYOUT(prefix, type)                                                     \
+                                                                               \
+type *prefix##_search_key(type **root, keytype key) {                          \
+    type *node = *root;                                                        \
+    int depth = 0;                                                             \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        AAT_STATS_ADD(prefix, compares);                                       \
+        AAT_STATS_STEP(depth);                                                 \
+        keytype node_key = getkey(node);                                       \
+        if (key == node_key) {                                                 \
+            break;                                                             \
+        }                                                                      \
+        node = key < node_key ? prefix##_left(node) : prefix##_right(node);    \
     }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
     return node;                                                               \
 }                                                                              \
                                                                                \
-static type *prefix##_split(type *node) {                                      \
-    if (node && node->right && node->right->right &&                           \
-        node->right->right->level == node->level)                              \
+type *prefix##_iter_key(type **root, keytype key) {                            \
+    type *found = 0;                                                           \
+    type *node = *root;                                                        \
+    int depth = 0;                                                             \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        AAT_STATS_ADD(prefix, compares);                                       \
+        if (getkey(node) < key) {                                              \
+            node = prefix##_right(node);                                       \
+        } else {                                                               \
+            found = node;                                                      \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+        AAT_STATS_STEP(depth);                                                 \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
+    return found;                                                              \
+}                                                                              \
+                                                                               \
+type *prefix##_delete_key(type **root, keytype key) {                          \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        AAT_STATS_ADD(prefix, compares);                                       \
+        keytype node_key = getkey(node);                                       \
+        if (key == node_key) {                                                 \
+            break;                                                             \
+        }                                                                      \
+        path[depth++] = node;                                                  \
+        node = key < node_key ? prefix##_left(node) : prefix##_right(node);    \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth+(node != 0));                                \
+    return node ? prefix##_delete_path(root, path, depth, node) : 0;           \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_seek_key(type **root, struct aat_cursor *cursor,         \
+    keytype key)                                                               \
+{                                                                              \
+    int found = 0;                                                             \
+    cursor->depth = 0;                                                         \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        cursor->stack[cursor->depth++] = node;                                 \
+        AAT_STATS_ADD(prefix, compares);                                       \
+        if (getkey(node) < key) {                                              \
+            node = prefix##_right(node);                                       \
+        } else {                                                               \
+            found = cursor->depth;                                             \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, cursor->depth);                                    \
+    cursor->depth = found;                                                     \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+
+// Same as AAT_IMPL but for nodes that use AAT_FIELDS_COMPACT.
+#define AAT_IMPL_COMPACT(prefix, type, left, right, compare)                   \
+static inline type *prefix##_left(type *node) {                                \
+    return (type*)((uintptr_t)AAT_LINK_LOAD(&node->left) & ~(uintptr_t)7);     \
+}                                                                              \
+                                                                               \
+static inline type *prefix##_right(type *node) {                               \
+    return (type*)((uintptr_t)AAT_LINK_LOAD(&node->right) & ~(uintptr_t)7);    \
+}                                                                              \
+                                                                               \
+static inline int prefix##_level(type *node) {                                 \
+    return (int)(((uintptr_t)AAT_LINK_LOAD(&node->left) & 7) |                 \
+        ((uintptr_t)AAT_LINK_LOAD(&node->right) & 7) << 3);                    \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setlevel(type *node, int new_level) {              \
+    AAT_LINK_STORE(&node->left, (type*)((uintptr_t)prefix##_left(node) |       \
+        (uintptr_t)(new_level & 7)));                                          \
+    AAT_LINK_STORE(&node->right, (type*)((uintptr_t)prefix##_right(node) |     \
+        (uintptr_t)(new_level >> 3 & 7)));                                     \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setleft(type *node, type *child) {                 \
+    AAT_LINK_STORE(&node->left, (type*)((uintptr_t)child |                     \
+        ((uintptr_t)AAT_LINK_LOAD(&node->left) & 7)));                         \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setright(type *node, type *child) {                \
+    AAT_LINK_STORE(&node->right, (type*)((uintptr_t)child |                    \
+        ((uintptr_t)AAT_LINK_LOAD(&node->right) & 7)));                        \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setroot(type **root, type *node) {                 \
+    AAT_LINK_STORE(root, node);                                                \
+}                                                                              \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+AAT_FIND_PARENT(prefix, type, compare)                                         \
+AAT_CORE(prefix, type, compare)                                                \
+AAT_RELAYOUT(prefix, type)                                                     \
+
+// Same as AAT_IMPL but for nodes that use AAT_FIELDS_INDEXED. The base is an
+// expression, such as a global variable, which evaluates to a pointer to the
+// first node of the array. A link holds the position of a node plus one, and
+// zero for no node, which allows for arrays of up to UINT32_MAX-1 nodes. The
+// functions still take and return pointers to nodes.
+//
+// Along with the standard functions, this also generates the following for
+// storing a tree in a file that can be memory-mapped back in.
+//
+//   save: writes the header and the first count nodes of the array to dst,
+//         which must be at least the returned number of bytes or else nothing
+//         is written.
+//   open_mapped: checks the header of a saved tree and returns the array of
+//                nodes, which should become the new base, or NULL if the data
+//                is not a tree of this type. This takes O(1) time unless
+//                validate is set, which also checks that the links, levels and
+//                order of every node in the tree are valid in O(n) time.
+#define AAT_IMPL_INDEXED(prefix, type, left, right, level, compare, base)      \
+static inline type *prefix##_left(type *node) {                                \
+    uint32_t link = AAT_LINK_LOAD(&node->left);                                \
+    return link ? (base)+(link-1) : 0;                                         \
+}                                                                              \
+                                                                               \
+static inline type *prefix##_right(type *node) {                               \
+    uint32_t link = AAT_LINK_LOAD(&node->right);                               \
+    return link ? (base)+(link-1) : 0;                                         \
+}                                                                              \
+                                                                               \
+static inline int prefix##_level(type *node) {                                 \
+    return AAT_LINK_LOAD(&node->level);                                        \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setlevel(type *node, int new_level) {              \
+    AAT_LINK_STORE(&node->level, new_level);                                   \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setleft(type *node, type *child) {                 \
+    AAT_LINK_STORE(&node->left, child ? (uint32_t)(child-(base))+1 : 0);       \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setright(type *node, type *child) {                \
+    AAT_LINK_STORE(&node->right, child ? (uint32_t)(child-(base))+1 : 0);      \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setroot(type **root, type *node) {                 \
+    AAT_LINK_STORE(root, node);                                                \
+}                                                                              \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        AAT_LINK_STORE(&node->level, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+AAT_FIND_PARENT(prefix, type, compare)                                         \
+AAT_CORE(prefix, type, compare)                                                \
+                                                                               \
+size_t prefix##_save(type **root, size_t count, void *dst, size_t size) {      \
+    size_t needed = sizeof(struct aat_file_header) + count*sizeof(type);       \
+    if (size >= needed) {                                                      \
+        struct aat_file_header *header = (struct aat_file_header*)dst;         \
+        header->magic = AAT_FILE_MAGIC;                                        \
+        header->version = AAT_FILE_VERSION;                                    \
+        header->node_size = (uint32_t)sizeof(type);                            \
+        header->root = *root ? (uint32_t)(*root-(base))+1 : 0;                 \
+        header->count = count;                                                 \
+        header->reserved = 0;                                                  \
+        if (count > 0) {                                                       \
+            memcpy((char*)dst + sizeof(struct aat_file_header), (base),        \
+                count*sizeof(type));                                           \
+        }                                                                      \
+    }                                                                          \
+    return needed;                                                             \
+}                                                                              \
+                                                                               \
+static int prefix##_valid_mapped0(type *nodes, size_t count, type *node,       \
+    type **last)                                                               \
+{                                                                              \
+    int node_level = node->level;                                              \
+    if (node->left > count || node->right > count) {                           \
+        return 0;                                                              \
+    }                                                                          \
+    type *left_node = node->left ? nodes+(node->left-1) : 0;                   \
+    type *right_node = node->right ? nodes+(node->right-1) : 0;                \
+    if (node_level < 1 || node_level > AAT_MAXHEIGHT/2) {                      \
+        return 0;                                                              \
+    }                                                                          \
+    if ((node_level > 1 && (!left_node || !right_node)) ||                     \
+        (left_node && left_node->level != node_level-1))                       \
     {                                                                          \
-        type *right_node = node->right;                                        \
-        node->right = right_node->left;                                        \
-        right_node->left = node;                                               \
-        right_node->level++;                                                   \
-        node = right_node;                                                     \
+        return 0;                                                              \
+    }                                                                          \
+    if (right_node) {                                                          \
+        if (right_node->level != node_level &&                                 \
+            right_node->level != node_level-1)                                 \
+        {                                                                      \
+            return 0;                                                          \
+        }                                                                      \
+        if (right_node->right > count || (right_node->right &&                 \
+            nodes[right_node->right-1].level >= node_level))                   \
+        {                                                                      \
+            return 0;                                                          \
+        }                                                                      \
+    }                                                                          \
+    if (left_node && !prefix##_valid_mapped0(nodes, count, left_node, last)) { \
+        return 0;                                                              \
+    }                                                                          \
+    if (*last && prefix##_order(*last, node) >= 0) {                           \
+        return 0;                                                              \
+    }                                                                          \
+    *last = node;                                                              \
+    return !right_node || prefix##_valid_mapped0(nodes, count, right_node,     \
+        last);                                                                 \
+}                                                                              \
+                                                                               \
+type *prefix##_open_mapped(void *data, size_t size, type **root,               \
+    int validate)                                                              \
+{                                                                              \
+    struct aat_file_header *header = (struct aat_file_header*)data;            \
+    if (size < sizeof(struct aat_file_header) ||                               \
+        header->magic != AAT_FILE_MAGIC ||                                     \
+        header->version != AAT_FILE_VERSION ||                                 \
+        header->node_size != sizeof(type) ||                                   \
+        header->count > UINT32_MAX-1 ||                                        \
+        header->count > (size-sizeof(struct aat_file_header))/sizeof(type) ||  \
+        header->root > header->count)                                          \
+    {                                                                          \
+        return 0;                                                              \
+    }                                                                          \
+    type *nodes = (type*)((char*)data + sizeof(struct aat_file_header));       \
+    type *node = header->root ? nodes+(header->root-1) : 0;                    \
+    type *last = 0;                                                            \
+    if (validate && node &&                                                    \
+        !prefix##_valid_mapped0(nodes, header->count, node, &last))            \
+    {                                                                          \
+        return 0;                                                              \
+    }                                                                          \
+    *root = node;                                                              \
+    return nodes;                                                              \
+}                                                                              \
+
+// Same as AAT_IMPL but for nodes that use AAT_FIELDS_PARENT. The parent links
+// are kept up to date by every function that changes the tree.
+#define AAT_IMPL_PARENT(prefix, type, left, right, parent, level, compare)     \
+AAT_GETTERS(prefix, type, left, right, level)                                  \
+                                                                               \
+static inline void prefix##_setleft(type *node, type *child) {                 \
+    AAT_LINK_STORE(&node->left, child);                                        \
+    if (child) {                                                               \
+        AAT_LINK_STORE(&child->parent, node);                                  \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setright(type *node, type *child) {                \
+    AAT_LINK_STORE(&node->right, child);                                       \
+    if (child) {                                                               \
+        AAT_LINK_STORE(&child->parent, node);                                  \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setroot(type **root, type *node) {                 \
+    AAT_LINK_STORE(root, node);                                                \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->parent, 0);                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        AAT_LINK_STORE(&node->parent, 0);                                      \
+        AAT_LINK_STORE(&node->level, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline type *prefix##_parent(type **root, type *item) {                 \
+    (void)root;                                                                \
+    return AAT_LINK_LOAD(&item->parent);                                       \
+}                                                                              \
+                                                                               \
+static inline int prefix##_parent_links(void) {                                \
+    return 1;                                                                  \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+AAT_CORE(prefix, type, compare)                                                \
+AAT_RELAYOUT(prefix, type)                                                     \
+
+// Same as AAT_IMPL but with a user-defined update function for keeping an
+// aggregate of each subtree in the node, such as a sum or a maximum value.
+// The update function has the signature 'void update(type *node)' and is called
+// on a node whenever its children change, after the children themselves have
+// been updated.
+#define AAT_IMPL_AUGMENTED(prefix, type, left, right, level, compare, update)  \
+AAT_LINKS(prefix, type, left, right, level, compare)                           \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        AAT_LINK_STORE(&node->level, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    update(node);                                                              \
+}                                                                              \
+                                                                               \
+AAT_CORE(prefix, type, compare)                                                \
+AAT_RELAYOUT(prefix, type)                                                     \
+
+// Same as AAT_IMPL but for nodes that use AAT_FIELDS_COUNTED. Along with the
+// standard functions, this also generates the following, which all take
+// O(log n) time.
+//
+//   count: returns the number of items in the tree.
+//   select: returns the item at a zero-based position, or NULL.
+//   rank: returns the number of items that are less than the key.
+//   count_range: returns the number of items that are greater than or equal
+//                to lo and less than hi.
+#define AAT_IMPL_COUNTED(prefix, type, left, right, level, count, compare)     \
+AAT_LINKS(prefix, type, left, right, level, compare)                           \
+                                                                               \
+static void prefix##_clear(type *node) {                                       \
+    if (node) {                                                                \
+        AAT_LINK_STORE(&node->left, 0);                                        \
+        AAT_LINK_STORE(&node->right, 0);                                       \
+        node->count = 0;                                                       \
+        AAT_LINK_STORE(&node->level, 0);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline size_t prefix##_subcount(type *node) {                           \
+    return node ? node->count : 0;                                             \
+}                                                                              \
+                                                                               \
+static inline void prefix##_refresh(type *node) {                              \
+    node->count = 1 + prefix##_subcount(node->left) +                          \
+        prefix##_subcount(node->right);                                        \
+}                                                                              \
+                                                                               \
+AAT_CORE(prefix, type, compare)                                                \
+AAT_RELAYOUT(prefix, type)                                                     \
+                                                                               \
+size_t prefix##_count(type **root) {                                           \
+    return prefix##_subcount(*root);                                           \
+}                                                                              \
+                                                                               \
+type *prefix##_select(type **root, size_t index) {                             \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        size_t nleft = prefix##_subcount(node->left);                          \
+        if (index < nleft) {                                                   \
+            node = node->left;                                                 \
+        } else if (index > nleft) {                                            \
+            index -= nleft+1;                                                  \
+            node = node->right;                                                \
+        } else {                                                               \
+            break;                                                             \
+        }                                                                      \
     }                                                                          \
     return node;                                                               \
 }                                                                              \
                                                                                \
-static type *prefix##_insert0(type *node, type *item, type **replaced) {       \
-    if (!node) {                                                               \
-        item->left = 0;                                                        \
-        item->right = 0;                                                       \
-        item->level = 1;                                                       \
-        node = item;                                                           \
+size_t prefix##_rank(type **root, type *key) {                                 \
+    size_t rank = 0;                                                           \
+    type *node = *root;                                                        \
+    int depth = 0;                                                             \
+    while (node) {                                                             \
+        if (prefix##_order(key, node) > 0) {                                   \
+            rank += prefix##_subcount(node->left)+1;                           \
+            node = node->right;                                                \
+        } else {                                                               \
+            node = node->left;                                                 \
+        }                                                                      \
+        AAT_STATS_STEP(depth);                                                 \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
+    return rank;                                                               \
+}                                                                              \
+                                                                               \
+size_t prefix##_count_range(type **root, type *lo, type *hi) {                 \
+    size_t start = prefix##_rank(root, lo);                                    \
+    size_t end = prefix##_rank(root, hi);                                      \
+    return end > start ? end-start : 0;                                        \
+}                                                                              \
+
+// Declares the functions generated by AAT_IMPL_FREEZE.
+#define AAT_DEF_FREEZE(specifiers, prefix, type, keytype)                      \
+specifiers size_t prefix##_freeze(type **root, keytype *keys, type **items,    \
+    size_t n);                                                                 \
+specifiers type *prefix##_frozen_lower_bound(keytype *keys, type **items,      \
+    size_t n, keytype key);                                                    \
+specifiers type *prefix##_frozen_search(keytype *keys, type **items,           \
+    size_t n, keytype key);                                                    \
+
+// Generates functions for exporting a tree into a read-only array that is
+// faster to search, for integer keys or any other key type that works with
+// the < and == operators. This may be used along with any of the AAT_IMPL
+// variants for the same prefix and type. The getkey argument is a function
+// or macro with the signature 'keytype getkey(type *node)'.
+//
+//   freeze: writes the keys and the items of the tree, in Eytzinger order,
+//           into the keys and items arrays, and returns the number of items.
+//           Nothing is written if there are more than n items.
+//   frozen_lower_bound: returns the first item with a key that is greater
+//                       than or equal to the key, or NULL.
+//   frozen_search: returns the item with the key, or NULL.
+//
+// A frozen array is not changed by later changes to the tree, which must be
+// frozen again for them to show.
+#define AAT_IMPL_FREEZE(prefix, type, keytype, getkey)                         \
+static void prefix##_freeze0(struct aat_cursor *cursor, keytype *keys,         \
+    type **items, size_t k, size_t n)                                          \
+{                                                                              \
+    if (k <= n) {                                                              \
+        prefix##_freeze0(cursor, keys, items, k*2, n);                         \
+        type *item = prefix##_cursor_item(cursor);                             \
+        keys[k-1] = getkey(item);                                              \
+        items[k-1] = item;                                                     \
+        prefix##_cursor_next(cursor);                                          \
+        prefix##_freeze0(cursor, keys, items, k*2+1, n);                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+size_t prefix##_freeze(type **root, keytype *keys, type **items, size_t n) {   \
+    struct aat_cursor cursor;                                                  \
+    size_t count = 0;                                                          \
+    type *item = prefix##_cursor_first(root, &cursor);                         \
+    while (item) {                                                             \
+        count++;                                                               \
+        item = prefix##_cursor_next(&cursor);                                  \
+    }                                                                          \
+    if (count <= n) {                                                          \
+        prefix##_cursor_first(root, &cursor);                                  \
+        prefix##_freeze0(&cursor, keys, items, 1, count);                      \
+    }                                                                          \
+    return count;                                                              \
+}                                                                              \
+                                                                               \
+type *prefix##_frozen_lower_bound(keytype *keys, type **items, size_t n,       \
+    keytype key)                                                               \
+{                                                                              \
+    size_t k = 1;                                                              \
+    while (k <= n) {                                                           \
+        AAT_PREFETCH_ADDR((void*)((uintptr_t)keys +                            \
+            (k*16-1)*sizeof(keytype)));                                        \
+        k = k*2 + (keys[k-1] < key);                                           \
+    }                                                                          \
+    while (k&1) {                                                              \
+        k >>= 1;                                                               \
+    }                                                                          \
+    k >>= 1;                                                                   \
+    return k ? items[k-1] : 0;                                                 \
+}                                                                              \
+                                                                               \
+type *prefix##_frozen_search(keytype *keys, type **items, size_t n,            \
+    keytype key)                                                               \
+{                                                                              \
+    type *item = prefix##_frozen_lower_bound(keys, items, n, key);             \
+    return item && getkey(item) == key ? item : 0;                             \
+}                                                                              \
+
+// Defines a tree handle, which holds the root of a tree along with its first
+// and last items and its number of items. Use this before AAT_IMPL_TREE.
+#define AAT_DEF_TREE(specifiers, prefix, type)                                 \
+struct prefix##_tree {                                                         \
+    type *root;                                                                \
+    type *first;                                                               \
+    type *last;                                                                \
+    size_t count;                                                              \
+};                                                                             \
+specifiers type *prefix##_tree_insert(struct prefix##_tree *tree, type *item); \
+specifiers type *prefix##_tree_delete(struct prefix##_tree *tree, type *key);  \
+specifiers type *prefix##_tree_remove_node(struct prefix##_tree *tree,         \
+    type *node);                                                               \
+specifiers type *prefix##_tree_delete_first(struct prefix##_tree *tree);       \
+specifiers type *prefix##_tree_delete_last(struct prefix##_tree *tree);        \
+specifiers type *prefix##_tree_first(struct prefix##_tree *tree);              \
+specifiers type *prefix##_tree_last(struct prefix##_tree *tree);               \
+specifiers size_t prefix##_tree_count(struct prefix##_tree *tree);             \
+specifiers void prefix##_tree_sync(struct prefix##_tree *tree);                \
+
+// Generates the functions for a tree handle defined by AAT_DEF_TREE. This may
+// be used along with any of the AAT_IMPL variants for the same prefix and
+// type. A handle that is all zeros is an empty tree.
+//
+//   tree_first, tree_last: return the cached first or last item in O(1).
+//   tree_delete_first, tree_delete_last: make a single walk down the side of
+//                                        the tree, which also finds the item
+//                                        that takes the place of the removed
+//                                        one.
+//   tree_count: returns the number of items in O(1).
+//   tree_sync: updates the handle after its root was changed directly, such
+//              as by passing &tree->root to the other functions.
+//
+// Every other function that only reads the tree may be called with
+// &tree->root as the root.
+#define AAT_IMPL_TREE(prefix, type)                                            \
+type *prefix##_tree_insert(struct prefix##_tree *tree, type *item) {           \
+    type *replaced = prefix##_insert(&tree->root, item);                       \
+    if (replaced) {                                                            \
+        if (tree->first == replaced) {                                         \
+            tree->first = item;                                                \
+        }                                                                      \
+        if (tree->last == replaced) {                                          \
+            tree->last = item;                                                 \
+        }                                                                      \
+    } else {                                                                   \
+        tree->count++;                                                         \
+        if (!tree->first || prefix##_order(item, tree->first) < 0) {           \
+            tree->first = item;                                                \
+        }                                                                      \
+        if (!tree->last || prefix##_order(item, tree->last) > 0) {             \
+            tree->last = item;                                                 \
+        }                                                                      \
+    }                                                                          \
+    return replaced;                                                           \
+}                                                                              \
+                                                                               \
+static void prefix##_tree_removed(struct prefix##_tree *tree, type *node) {    \
+    tree->count--;                                                             \
+    if (tree->first == node) {                                                 \
+        tree->first = prefix##_first(&tree->root);                             \
+    }                                                                          \
+    if (tree->last == node) {                                                  \
+        tree->last = prefix##_last(&tree->root);                               \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_delete(struct prefix##_tree *tree, type *key) {            \
+    type *deleted = prefix##_delete(&tree->root, key);                         \
+    if (deleted) {                                                             \
+        prefix##_tree_removed(tree, deleted);                                  \
+    }                                                                          \
+    return deleted;                                                            \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_remove_node(struct prefix##_tree *tree, type *node) {      \
+    type *removed = prefix##_remove_node(&tree->root, node);                   \
+    if (removed) {                                                             \
+        prefix##_tree_removed(tree, removed);                                  \
+    }                                                                          \
+    return removed;                                                            \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_delete_first(struct prefix##_tree *tree) {                 \
+    type *node = prefix##_delete_first0(&tree->root, &tree->first);            \
+    if (node) {                                                                \
+        tree->count--;                                                         \
+        if (tree->last == node) {                                              \
+            tree->last = 0;                                                    \
+        }                                                                      \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_delete_last(struct prefix##_tree *tree) {                  \
+    type *node = prefix##_delete_last0(&tree->root, &tree->last);              \
+    if (node) {                                                                \
+        tree->count--;                                                         \
+        if (tree->first == node) {                                             \
+            tree->first = 0;                                                   \
+        }                                                                      \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_first(struct prefix##_tree *tree) {                        \
+    return tree->first;                                                        \
+}                                                                              \
+                                                                               \
+type *prefix##_tree_last(struct prefix##_tree *tree) {                         \
+    return tree->last;                                                         \
+}                                                                              \
+                                                                               \
+size_t prefix##_tree_count(struct prefix##_tree *tree) {                       \
+    return tree->count;                                                        \
+}                                                                              \
+                                                                               \
+void prefix##_tree_sync(struct prefix##_tree *tree) {                          \
+    struct aat_cursor cursor;                                                  \
+    type *item = prefix##_cursor_first(&tree->root, &cursor);                  \
+    tree->first = item;                                                        \
+    tree->last = 0;                                                            \
+    tree->count = 0;                                                           \
+    while (item) {                                                             \
+        tree->last = item;                                                     \
+        tree->count++;                                                         \
+        item = prefix##_cursor_next(&cursor);                                  \
+    }                                                                          \
+}                                                                              \
+
+// Node pools are only generated when AAT_POOL is defined before including
+// this file, so that the other trees do not bring in stdlib.h.
+#ifdef AAT_POOL
+
+// The memory allocator for node pools, which defaults to malloc and free from
+// stdlib.h. Define both AAT_MALLOC and AAT_FREE before including this file to
+// use another one.
+#ifndef AAT_MALLOC
+#include <stdlib.h>
+#define AAT_MALLOC(size) malloc(size)
+#define AAT_FREE(ptr) free(ptr)
+#endif
+
+// The size of a node pool chunk, including the cache line that holds its
+// header, and the cache line size that the chunks are aligned to.
+#ifndef AAT_POOL_CHUNK
+#define AAT_POOL_CHUNK 16384
+#endif
+#define AAT_CACHE_LINE 64
+
+struct aat_pool_chunk {
+    struct aat_pool_chunk *next;
+    void *raw;
+};
+
+// Defines a node pool, which hands out nodes from chunks of about
+// AAT_POOL_CHUNK bytes that start on a cache line, keeping the nodes of a tree
+// close together in memory. Use this before AAT_IMPL_POOL. A pool that is all
+// zeros is empty.
+#define AAT_DEF_POOL(specifiers, prefix, type)                                 \
+struct prefix##_pool {                                                         \
+    struct aat_pool_chunk *chunks;                                             \
+    type *free;                                                                \
+    type *unused;                                                              \
+    size_t nunused;                                                            \
+    size_t count;                                                              \
+};                                                                             \
+specifiers type *prefix##_pool_alloc(struct prefix##_pool *pool);              \
+specifiers void prefix##_pool_free(struct prefix##_pool *pool, type *node);    \
+specifiers void prefix##_pool_release(struct prefix##_pool *pool);             \
+specifiers type *prefix##_insert_new(type **root, type *item,                  \
+    struct prefix##_pool *pool);                                               \
+specifiers int prefix##_delete_free(type **root, type *key,                    \
+    struct prefix##_pool *pool);                                               \
+specifiers void prefix##_destroy(type **root, struct prefix##_pool *pool);     \
+
+// Generates the functions for a node pool defined by AAT_DEF_POOL, for trees
+// whose nodes are all owned by the pool. This may be used along with any of
+// the AAT_IMPL variants except for indexed nodes, which must live in their
+// base array. Memory comes from AAT_MALLOC and is only given back to it by
+// pool_release.
+//
+//   pool_alloc: returns a zeroed node, or NULL when out of memory.
+//   pool_free: puts a node back into the pool for the next pool_alloc.
+//   pool_release: frees all of the memory of the pool, including any nodes
+//                 that are still in use, leaving an empty pool.
+//   insert_new: inserts a copy of the item made in a node from the pool,
+//               putting the item that it replaced back into the pool. Returns
+//               the new node, or NULL when out of memory.
+//   delete_free: deletes the item for the key and puts it back into the
+//                pool. Returns 1 if it was found.
+//   destroy: puts every node of the tree back into the pool in O(n), without
+//            rebalancing, and leaves an empty tree.
+#define AAT_IMPL_POOL(prefix, type)                                            \
+typedef char prefix##_pool_fits[sizeof(type) >= sizeof(type*) ? 1 : -1];       \
+                                                                               \
+static int prefix##_pool_grow(struct prefix##_pool *pool) {                    \
+    size_t n = (AAT_POOL_CHUNK-AAT_CACHE_LINE)/sizeof(type);                   \
+    n = n > 0 ? n : 1;                                                         \
+    char *raw = (char*)AAT_MALLOC(sizeof(struct aat_pool_chunk)+               \
+        AAT_CACHE_LINE-1+n*sizeof(type));                                      \
+    if (!raw) {                                                                \
+        return 0;                                                              \
+    }                                                                          \
+    uintptr_t start = ((uintptr_t)(raw+sizeof(struct aat_pool_chunk))+         \
+        AAT_CACHE_LINE-1) & ~(uintptr_t)(AAT_CACHE_LINE-1);                    \
+    struct aat_pool_chunk *chunk = (struct aat_pool_chunk*)start-1;            \
+    chunk->raw = raw;                                                          \
+    chunk->next = pool->chunks;                                                \
+    pool->chunks = chunk;                                                      \
+    pool->unused = (type*)start;                                               \
+    pool->nunused = n;                                                         \
+    return 1;                                                                  \
+}                                                                              \
+                                                                               \
+type *prefix##_pool_alloc(struct prefix##_pool *pool) {                        \
+    type *node = pool->free;                                                   \
+    if (node) {                                                                \
+        memcpy(&pool->free, node, sizeof(type*));                              \
+    } else {                                                                   \
+        if (pool->nunused == 0 && !prefix##_pool_grow(pool)) {                 \
+            return 0;                                                          \
+        }                                                                      \
+        node = pool->unused++;                                                 \
+        pool->nunused--;                                                       \
+    }                                                                          \
+    memset(node, 0, sizeof(type));                                             \
+    pool->count++;                                                             \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+void prefix##_pool_free(struct prefix##_pool *pool, type *node) {              \
+    memcpy(node, &pool->free, sizeof(type*));                                  \
+    pool->free = node;                                                         \
+    pool->count--;                                                             \
+}                                                                              \
+                                                                               \
+void prefix##_pool_release(struct prefix##_pool *pool) {                       \
+    while (pool->chunks) {                                                     \
+        struct aat_pool_chunk *next = pool->chunks->next;                      \
+        AAT_FREE(pool->chunks->raw);                                           \
+        pool->chunks = next;                                                   \
+    }                                                                          \
+    memset(pool, 0, sizeof(struct prefix##_pool));                             \
+}                                                                              \
+                                                                               \
+type *prefix##_insert_new(type **root, type *item,                             \
+    struct prefix##_pool *pool)                                                \
+{                                                                              \
+    type *node = prefix##_pool_alloc(pool);                                    \
+    if (!node) {                                                               \
+        return 0;                                                              \
+    }                                                                          \
+    memcpy(node, item, sizeof(type));                                          \
+    type *prev = prefix##_insert(root, node);                                  \
+    if (prev) {                                                                \
+        prefix##_pool_free(pool, prev);                                        \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+int prefix##_delete_free(type **root, type *key, struct prefix##_pool *pool) { \
+    type *node = prefix##_delete(root, key);                                   \
+    if (node) {                                                                \
+        prefix##_pool_free(pool, node);                                        \
+    }                                                                          \
+    return node != 0;                                                          \
+}                                                                              \
+                                                                               \
+static void prefix##_pool_put(type *node, void *udata) {                       \
+    prefix##_pool_free((struct prefix##_pool*)udata, node);                    \
+}                                                                              \
+                                                                               \
+void prefix##_destroy(type **root, struct prefix##_pool *pool) {               \
+    prefix##_clear_all(root, prefix##_pool_put, pool);                         \
+}                                                                              \
+
+#endif
+
+// Defines the allocator hooks for persistent trees and declares the functions
+// generated by AAT_IMPL_PERSIST.
+#define AAT_DEF_PERSIST(specifiers, prefix, type)                              \
+struct prefix##_persist {                                                      \
+    type *(*copy)(type *node, void *udata);                                    \
+    void (*retire)(type *node, void *udata);                                   \
+    void *udata;                                                               \
+};                                                                             \
+specifiers int prefix##_persist_insert(type **root, type *item,                \
+    type **replaced, struct prefix##_persist *persist);                        \
+specifiers int prefix##_persist_delete(type **root, type *key,                 \
+    type **deleted, struct prefix##_persist *persist);                         \
+specifiers type *prefix##_snapshot(type **root);                               \
+
+// Generates functions that change a tree without writing to any of its nodes,
+// so that readers can keep using an older root while a writer makes a new
+// one. Each node that would be changed is first copied with the copy hook of
+// a persistent struct defined by AAT_DEF_PERSIST, which must return a new node
+// holding all of the fields of the node, links included, or NULL when it is
+// out of memory. This may be used with any of the AAT_IMPL variants for the
+// same prefix and type other than AAT_IMPL_PARENT, as a parent link can not be
+// shared by two trees.
+//
+//   persist_insert: inserts the item, or replaces the equal item, which is
+//                   stored in replaced. Returns 0 if a copy failed, leaving the
+//                   tree unchanged.
+//   persist_delete: deletes the item equal to the key, which is stored in
+//                   deleted, or NULL. Returns 0 if a copy failed, leaving the
+//                   tree unchanged.
+//   snapshot: returns the current root, for use by a reader on another thread.
+//
+// The new root is stored into root with AAT_STORE_RELEASE, after which every
+// node that was replaced by a copy is passed to the retire hook. Readers that
+// took their root before then may still be using those nodes, so retire
+// should free them only once all such readers are done, such as with epochs or
+// reference counts. Replaced and deleted items are left as is for the same
+// reason. Writers must not run at the same time as each other.
+#define AAT_IMPL_PERSIST(prefix, type)                                         \
+struct prefix##_persist_txn {                                                  \
+    struct prefix##_persist *persist;                                          \
+    type *fresh[AAT_MAXHEIGHT*6];                                              \
+    type *orig[AAT_MAXHEIGHT*6];                                               \
+    int count;                                                                 \
+};                                                                             \
+                                                                               \
+static type *prefix##_persist_own(struct prefix##_persist_txn *txn,            \
+    type *node)                                                                \
+{                                                                              \
+    for (int i = txn->count-1; i >= 0; i--) {                                  \
+        if (txn->fresh[i] == node) {                                           \
+            return node;                                                       \
+        }                                                                      \
+    }                                                                          \
+    if (txn->count == AAT_MAXHEIGHT*6) {                                       \
+        return 0;                                                              \
+    }                                                                          \
+    type *copy = txn->persist->copy(node, txn->persist->udata);                \
+    if (copy) {                                                                \
+        txn->fresh[txn->count] = copy;                                         \
+        txn->orig[txn->count] = node;                                          \
+        txn->count++;                                                          \
+    }                                                                          \
+    return copy;                                                               \
+}                                                                              \
+                                                                               \
+static int prefix##_persist_finish(struct prefix##_persist_txn *txn,           \
+    type **root, type *new_root, int ok)                                       \
+{                                                                              \
+    struct prefix##_persist *persist = txn->persist;                           \
+    if (ok) {                                                                  \
+        AAT_STORE_RELEASE(root, new_root);                                     \
+    }                                                                          \
+    for (int i = 0; i < txn->count; i++) {                                     \
+        if (txn->orig[i]) {                                                    \
+            persist->retire(ok ? txn->orig[i] : txn->fresh[i],                 \
+                persist->udata);                                               \
+        }                                                                      \
+    }                                                                          \
+    return ok;                                                                 \
+}                                                                              \
+                                                                               \
+static type *prefix##_persist_skew(struct prefix##_persist_txn *txn,           \
+    type *node)                                                                \
+{                                                                              \
+    type *left_node = prefix##_left(node);                                     \
+    if (left_node && prefix##_level(left_node) == prefix##_level(node)) {      \
+        node = prefix##_persist_own(txn, node);                                \
+        left_node = node ? prefix##_persist_own(txn, left_node) : 0;           \
+        if (!left_node) {                                                      \
+            return 0;                                                          \
+        }                                                                      \
+        prefix##_setleft(node, prefix##_right(left_node));                     \
+        prefix##_setright(left_node, node);                                    \
+        prefix##_refresh(node);                                                \
+        prefix##_refresh(left_node);                                           \
+        AAT_STATS_ADD(prefix, skews);                                          \
+        node = left_node;                                                      \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static type *prefix##_persist_split(struct prefix##_persist_txn *txn,          \
+    type *node)                                                                \
+{                                                                              \
+    type *right_node = prefix##_right(node);                                   \
+    if (right_node && prefix##_right(right_node) &&                            \
+        prefix##_level(prefix##_right(right_node)) == prefix##_level(node))    \
+    {                                                                          \
+        node = prefix##_persist_own(txn, node);                                \
+        right_node = node ? prefix##_persist_own(txn, right_node) : 0;         \
+        if (!right_node) {                                                     \
+            return 0;                                                          \
+        }                                                                      \
+        prefix##_setright(node, prefix##_left(right_node));                    \
+        prefix##_setleft(right_node, node);                                    \
+        prefix##_setlevel(right_node, prefix##_level(right_node)+1);           \
+        prefix##_refresh(node);                                                \
+        prefix##_refresh(right_node);                                          \
+        AAT_STATS_ADD(prefix, splits);                                         \
+        node = right_node;                                                     \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static int prefix##_persist_decrease_level(struct prefix##_persist_txn *txn,   \
+    type *node)                                                                \
+{                                                                              \
+    type *left_node = prefix##_left(node);                                     \
+    type *right_node = prefix##_right(node);                                   \
+    if (left_node || right_node) {                                             \
+        int new_level = 0;                                                     \
+        if (left_node && right_node) {                                         \
+            if (prefix##_level(left_node) < prefix##_level(right_node)) {      \
+                new_level = prefix##_level(left_node);                         \
+            } else {                                                           \
+                new_level = prefix##_level(right_node);                        \
+            }                                                                  \
+        }                                                                      \
+        new_level++;                                                           \
+        if (new_level < prefix##_level(node)) {                                \
+            prefix##_setlevel(node, new_level);                                \
+            if (right_node && new_level < prefix##_level(right_node)) {        \
+                right_node = prefix##_persist_own(txn, right_node);            \
+                if (!right_node) {                                             \
+                    return -1;                                                 \
+                }                                                              \
+                prefix##_setlevel(right_node, new_level);                      \
+                prefix##_setright(node, right_node);                           \
+            }                                                                  \
+            AAT_STATS_ADD(prefix, decrease_levels);                            \
+            return 1;                                                          \
+        }                                                                      \
+    }                                                                          \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static type *prefix##_persist_fixup(struct prefix##_persist_txn *txn,          \
+    type *node)                                                                \
+{                                                                              \
+    node = prefix##_persist_skew(txn, node);                                   \
+    type *right_node = node ? prefix##_right(node) : 0;                        \
+    if (right_node) {                                                          \
+        right_node = prefix##_persist_skew(txn, right_node);                   \
+        if (!right_node) {                                                     \
+            return 0;                                                          \
+        }                                                                      \
+        prefix##_setright(node, right_node);                                   \
+        type *next = prefix##_right(right_node);                               \
+        if (next) {                                                            \
+            type *skewed = prefix##_persist_skew(txn, next);                   \
+            if (skewed != next) {                                              \
+                right_node = skewed ?                                          \
+                    prefix##_persist_own(txn, right_node) : 0;                 \
+                if (!right_node) {                                             \
+                    return 0;                                                  \
+                }                                                              \
+                prefix##_setright(right_node, skewed);                         \
+                prefix##_setright(node, right_node);                           \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    node = node ? prefix##_persist_split(txn, node) : 0;                       \
+    right_node = node ? prefix##_right(node) : 0;                              \
+    if (right_node) {                                                          \
+        right_node = prefix##_persist_split(txn, right_node);                  \
+        if (!right_node) {                                                     \
+            return 0;                                                          \
+        }                                                                      \
+        prefix##_setright(node, right_node);                                   \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+int prefix##_persist_insert(type **root, type *item, type **replaced,          \
+    struct prefix##_persist *persist)                                          \
+{                                                                              \
+    struct prefix##_persist_txn txn;                                           \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    char dirs[AAT_MAXHEIGHT];                                                  \
+    int depth = 0;                                                             \
+    txn.persist = persist;                                                     \
+    txn.count = 0;                                                             \
+    if (replaced) {                                                            \
+        *replaced = 0;                                                         \
+    }                                                                          \
+    if (prefix##_parent_links()) {                                             \
+        return 0;                                                              \
+    }                                                                          \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        int cmp = prefix##_order(item, node);                                  \
+        if (cmp == 0) {                                                        \
+            break;                                                             \
+        }                                                                      \
+        path[depth] = node;                                                    \
+        dirs[depth++] = cmp > 0;                                               \
+        node = cmp < 0 ? prefix##_left(node) : prefix##_right(node);           \
+    }                                                                          \
+    txn.fresh[txn.count] = item;                                               \
+    txn.orig[txn.count] = 0;                                                   \
+    txn.count++;                                                               \
+    if (node) {                                                                \
+        prefix##_setleft(item, prefix##_left(node));                           \
+        prefix##_setright(item, prefix##_right(node));                         \
+        prefix##_setlevel(item, prefix##_level(node));                         \
+    } else {                                                                   \
+        prefix##_setleft(item, 0);                                             \
+        prefix##_setright(item, 0);                                            \
+        prefix##_setlevel(item, 1);                                            \
+    }                                                                          \
+    prefix##_refresh(item);                                                    \
+    type *child = item;                                                        \
+    while (depth > 0 && child) {                                               \
+        depth--;                                                               \
+        type *parent = prefix##_persist_own(&txn, path[depth]);                \
+        if (!parent) {                                                         \
+            child = 0;                                                         \
+            break;                                                             \
+        }                                                                      \
+        if (dirs[depth]) {                                                     \
+            prefix##_setright(parent, child);                                  \
+        } else {                                                               \
+            prefix##_setleft(parent, child);                                   \
+        }                                                                      \
+        prefix##_refresh(parent);                                              \
+        if (!node) {                                                           \
+            parent = prefix##_persist_skew(&txn, parent);                      \
+            parent = parent ? prefix##_persist_split(&txn, parent) : 0;        \
+        }                                                                      \
+        child = parent;                                                        \
+    }                                                                          \
+    if (!child) {                                                              \
+        prefix##_clear(item);                                                  \
+        return prefix##_persist_finish(&txn, root, 0, 0);                      \
+    }                                                                          \
+    if (replaced) {                                                            \
+        *replaced = node;                                                      \
+    }                                                                          \
+    return prefix##_persist_finish(&txn, root, child, 1);                      \
+}                                                                              \
+                                                                               \
+int prefix##_persist_delete(type **root, type *key, type **deleted,            \
+    struct prefix##_persist *persist)                                          \
+{                                                                              \
+    struct prefix##_persist_txn txn;                                           \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    char dirs[AAT_MAXHEIGHT];                                                  \
+    int depth = 0;                                                             \
+    txn.persist = persist;                                                     \
+    txn.count = 0;                                                             \
+    if (deleted) {                                                             \
+        *deleted = 0;                                                          \
+    }                                                                          \
+    if (prefix##_parent_links()) {                                             \
+        return 0;                                                              \
+    }                                                                          \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        int cmp = prefix##_order(key, node);                                   \
+        if (cmp == 0) {                                                        \
+            break;                                                             \
+        }                                                                      \
+        path[depth] = node;                                                    \
+        dirs[depth++] = cmp > 0;                                               \
+        node = cmp < 0 ? prefix##_left(node) : prefix##_right(node);           \
+    }                                                                          \
+    if (!node) {                                                               \
+        return 1;                                                              \
+    }                                                                          \
+    type *child = 0;                                                           \
+    type *leaf = 0;                                                            \
+    if (prefix##_left(node)) {                                                 \
+        path[depth] = node;                                                    \
+        dirs[depth++] = 0;                                                     \
+        leaf = prefix##_left(node);                                            \
+        while (prefix##_right(leaf)) {                                         \
+            path[depth] = leaf;                                                \
+            dirs[depth++] = 1;                                                 \
+            leaf = prefix##_right(leaf);                                       \
+        }                                                                      \
+        child = prefix##_left(leaf);                                           \
+    } else if (prefix##_right(node)) {                                         \
+        path[depth] = node;                                                    \
+        dirs[depth++] = 1;                                                     \
+        leaf = prefix##_right(node);                                           \
+        while (prefix##_left(leaf)) {                                          \
+            path[depth] = leaf;                                                \
+            dirs[depth++] = 0;                                                 \
+            leaf = prefix##_left(leaf);                                        \
+        }                                                                      \
+        child = prefix##_right(leaf);                                          \
+    }                                                                          \
+    int balanced = 0;                                                          \
+    int ok = 1;                                                                \
+    while (depth > 0) {                                                        \
+        depth--;                                                               \
+        type *parent;                                                          \
+        if (path[depth] == node) {                                             \
+            parent = prefix##_persist_own(&txn, leaf);                         \
+            if (parent) {                                                      \
+                prefix##_setleft(parent, prefix##_left(node));                 \
+                prefix##_setright(parent, prefix##_right(node));               \
+                prefix##_setlevel(parent, prefix##_level(node));               \
+            }                                                                  \
+        } else {                                                               \
+            parent = prefix##_persist_own(&txn, path[depth]);                  \
+        }                                                                      \
+        if (!parent) {                                                         \
+            ok = 0;                                                            \
+            break;                                                             \
+        }                                                                      \
+        if (dirs[depth]) {                                                     \
+            prefix##_setright(parent, child);                                  \
+        } else {                                                               \
+            prefix##_setleft(parent, child);                                   \
+        }                                                                      \
+        prefix##_refresh(parent);                                              \
+        if (!balanced) {                                                       \
+            int decreased = prefix##_persist_decrease_level(&txn, parent);     \
+            if (decreased < 0) {                                               \
+                ok = 0;                                                        \
+                break;                                                         \
+            }                                                                  \
+            if (decreased) {                                                   \
+                parent = prefix##_persist_fixup(&txn, parent);                 \
+                if (!parent) {                                                 \
+                    ok = 0;                                                    \
+                    break;                                                     \
+                }                                                              \
+            } else {                                                           \
+                balanced = 1;                                                  \
+            }                                                                  \
+        }                                                                      \
+        child = parent;                                                        \
+    }                                                                          \
+    if (!ok) {                                                                 \
+        return prefix##_persist_finish(&txn, root, 0, 0);                      \
+    }                                                                          \
+    if (deleted) {                                                             \
+        *deleted = node;                                                       \
+    }                                                                          \
+    return prefix##_persist_finish(&txn, root, child, 1);                      \
+}                                                                              \
+                                                                               \
+type *prefix##_snapshot(type **root) {                                         \
+    return AAT_LOAD_ACQUIRE(root);                                             \
+}                                                                              \
+
+#ifdef AAT_ATOMIC
+
+// Declares the functions generated by AAT_IMPL_SEQLOCK.
+#define AAT_DEF_SEQLOCK(specifiers, prefix, type)                              \
+specifiers type *prefix##_seq_search(struct aat_seqlock *lock, type **root,    \
+    type *key);                                                                \
+specifiers type *prefix##_seq_iter(struct aat_seqlock *lock, type **root,      \
+    type *key);                                                                \
+specifiers type *prefix##_seq_first(struct aat_seqlock *lock, type **root);    \
+specifiers type *prefix##_seq_last(struct aat_seqlock *lock, type **root);     \
+specifiers type *prefix##_seq_insert(struct aat_seqlock *lock, type **root,    \
+    type *item);                                                               \
+specifiers type *prefix##_seq_delete(struct aat_seqlock *lock, type **root,    \
+    type *key);                                                                \
+
+// Generates functions that share a tree between threads with an aat_seqlock,
+// only when AAT_ATOMIC is defined before including this file. This may be
+// used along with any of the AAT_IMPL variants for the same prefix and type.
+// The readers take no lock and run again when a writer changed the tree while
+// they were reading, and the writers run one at a time. While other threads
+// write, only the seq functions may be called, or search, iter, first and last
+// between aat_seqlock_read_begin and aat_seqlock_read_retry.
+//
+// A reader may still be looking at an item after it was deleted. A deleted
+// item must stay in memory, with the same key, until every reader that
+// started before the delete is done, such as after the reader threads have
+// been joined. Until then it may be inserted again but not freed or reused.
+// The key of an item must be set before it is inserted.
+#define AAT_IMPL_SEQLOCK(prefix, type)                                         \
+type *prefix##_seq_search(struct aat_seqlock *lock, type **root, type *key) {  \
+    type *item;                                                                \
+    unsigned seq;                                                              \
+    do {                                                                       \
+        seq = aat_seqlock_read_begin(lock);                                    \
+        item = prefix##_search(root, key);                                     \
+    } while (aat_seqlock_read_retry(lock, seq));                               \
+    return item;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_seq_iter(struct aat_seqlock *lock, type **root, type *key) {    \
+    type *item;                                                                \
+    unsigned seq;                                                              \
+    do {                                                                       \
+        seq = aat_seqlock_read_begin(lock);                                    \
+        item = prefix##_iter(root, key);                                       \
+    } while (aat_seqlock_read_retry(lock, seq));                               \
+    return item;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_seq_first(struct aat_seqlock *lock, type **root) {              \
+    type *item;                                                                \
+    unsigned seq;                                                              \
+    do {                                                                       \
+        seq = aat_seqlock_read_begin(lock);                                    \
+        item = prefix##_first(root);                                           \
+    } while (aat_seqlock_read_retry(lock, seq));                               \
+    return item;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_seq_last(struct aat_seqlock *lock, type **root) {               \
+    type *item;                                                                \
+    unsigned seq;                                                              \
+    do {                                                                       \
+        seq = aat_seqlock_read_begin(lock);                                    \
+        item = prefix##_last(root);                                            \
+    } while (aat_seqlock_read_retry(lock, seq));                               \
+    return item;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_seq_insert(struct aat_seqlock *lock, type **root, type *item) { \
+    aat_seqlock_write_begin(lock);                                             \
+    type *replaced = prefix##_insert(root, item);                              \
+    aat_seqlock_write_end(lock);                                               \
+    return replaced;                                                           \
+}                                                                              \
+                                                                               \
+type *prefix##_seq_delete(struct aat_seqlock *lock, type **root, type *key) {  \
+    aat_seqlock_write_begin(lock);                                             \
+    type *deleted = prefix##_delete(root, key);                                \
+    aat_seqlock_write_end(lock);                                               \
+    return deleted;                                                            \
+}                                                                              \
+
+#endif
+
+#ifdef AAT_PARALLEL
+
+// The most threads used by any one of the parallel functions.
+#define AAT_PARALLEL_MAXTHREADS 64
+
+// The most pieces that the parallel functions split a tree into, which are
+// handed out to the threads as they become free.
+#define AAT_PARALLEL_TASKS 1024
+
+// Declares the functions generated by AAT_IMPL_PARALLEL.
+#define AAT_DEF_PARALLEL(specifiers, prefix, type)                             \
+specifiers void prefix##_parallel_foreach(type **root,                         \
+    void (*iter)(type *item, void *udata), void *udata, int threads);          \
+specifiers void prefix##_parallel_reduce(type **root, void *accs, size_t size, \
+    void (*fold)(void *acc, type *item, void *udata),                          \
+    void (*merge)(void *acc, void *other, void *udata), void *udata,           \
+    int threads);                                                              \
+specifiers void prefix##_parallel_build_sorted(type **root, type **items,      \
+    size_t n, int threads);                                                    \
+
+// Generates functions that spread the work over a tree across threads, only
+// when AAT_PARALLEL is defined before including this file, in which case the
+// program must be linked with pthreads. This may be used along with any of
+// the AAT_IMPL variants for the same prefix and type. The tree is split into
+// the subtrees at a depth where there are a few for each thread, and each
+// thread takes the next subtree when it is done with its last one. The items
+// above that depth are handled by the calling thread.
+//
+//   parallel_foreach: calls iter for every item, in no particular order and
+//                     from many threads at once.
+//   parallel_reduce: folds every item into one of the accumulators, which is
+//                    an array of threads accumulators of size bytes each that
+//                    are already set to the identity. The rest are then
+//                    merged into the first one. Fold and merge must give the
+//                    same result in any order.
+//   parallel_build_sorted: the same as build_sorted, with the subtrees below
+//                          the top levels built by different threads.
+//
+// A threads value below one is treated as one.
+#define AAT_IMPL_PARALLEL(prefix, type)                                        \
+struct prefix##_parallel {                                                     \
+    pthread_mutex_t mutex;                                                     \
+    int next;                                                                  \
+    int ntasks;                                                                \
+    type *tasks[AAT_PARALLEL_TASKS];                                           \
+    type **items[AAT_PARALLEL_TASKS];                                          \
+    size_t counts[AAT_PARALLEL_TASKS];                                         \
+    int cut;                                                                   \
+    void (*iter)(type *item, void *udata);                                     \
+    void (*fold)(void *acc, type *item, void *udata);                          \
+    char *accs;                                                                \
+    size_t size;                                                               \
+    void *udata;                                                               \
+};                                                                             \
+                                                                               \
+struct prefix##_parallel_thread {                                              \
+    struct prefix##_parallel *ctx;                                             \
+    int index;                                                                 \
+};                                                                             \
+                                                                               \
+static int prefix##_parallel_take(struct prefix##_parallel *ctx) {             \
+    pthread_mutex_lock(&ctx->mutex);                                           \
+    int task = ctx->next < ctx->ntasks ? ctx->next++ : -1;                     \
+    pthread_mutex_unlock(&ctx->mutex);                                         \
+    return task;                                                               \
+}                                                                              \
+                                                                               \
+static void prefix##_parallel_visit(struct prefix##_parallel *ctx, int index,  \
+    type *item)                                                                \
+{                                                                              \
+    if (ctx->iter) {                                                           \
+        ctx->iter(item, ctx->udata);                                           \
+    } else {                                                                   \
+        ctx->fold(ctx->accs+(size_t)index*ctx->size, item, ctx->udata);        \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void *prefix##_parallel_scan(void *arg) {                               \
+    struct prefix##_parallel_thread *thread = arg;                             \
+    struct prefix##_parallel *ctx = thread->ctx;                               \
+    type *stack[AAT_MAXHEIGHT];                                                \
+    int task;                                                                  \
+    while ((task = prefix##_parallel_take(ctx)) != -1) {                       \
+        int depth = 0;                                                         \
+        type *node = ctx->tasks[task];                                         \
+        while (node || depth > 0) {                                            \
+            while (node) {                                                     \
+                stack[depth++] = node;                                         \
+                node = prefix##_left(node);                                    \
+            }                                                                  \
+            node = stack[--depth];                                             \
+            prefix##_parallel_visit(ctx, thread->index, node);                 \
+            node = prefix##_right(node);                                       \
+        }                                                                      \
+    }                                                                          \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static void prefix##_parallel_run(struct prefix##_parallel *ctx,               \
+    void *(*work)(void *arg), int threads)                                     \
+{                                                                              \
+    pthread_t ids[AAT_PARALLEL_MAXTHREADS];                                    \
+    struct prefix##_parallel_thread args[AAT_PARALLEL_MAXTHREADS];             \
+    int started = 1;                                                           \
+    pthread_mutex_init(&ctx->mutex, 0);                                        \
+    ctx->next = 0;                                                             \
+    for (int i = 0; i < threads; i++) {                                        \
+        args[i].ctx = ctx;                                                     \
+        args[i].index = i;                                                     \
+    }                                                                          \
+    while (started < threads) {                                                \
+        if (pthread_create(&ids[started], 0, work, &args[started]) != 0) {     \
+            break;                                                             \
+        }                                                                      \
+        started++;                                                             \
+    }                                                                          \
+    work(&args[0]);                                                            \
+    for (int i = 1; i < started; i++) {                                        \
+        pthread_join(ids[i], 0);                                               \
+    }                                                                          \
+    pthread_mutex_destroy(&ctx->mutex);                                        \
+}                                                                              \
+                                                                               \
+static int prefix##_parallel_threads(int threads) {                            \
+    if (threads < 1) {                                                         \
+        return 1;                                                              \
+    }                                                                          \
+    if (threads > AAT_PARALLEL_MAXTHREADS) {                                   \
+        return AAT_PARALLEL_MAXTHREADS;                                        \
+    }                                                                          \
+    return threads;                                                            \
+}                                                                              \
+                                                                               \
+static void prefix##_parallel_split(struct prefix##_parallel *ctx,             \
+    type *node, int depth)                                                     \
+{                                                                              \
+    if (!node) {                                                               \
+        return;                                                                \
+    }                                                                          \
+    if (depth == 0) {                                                          \
+        ctx->tasks[ctx->ntasks++] = node;                                      \
+        return;                                                                \
+    }                                                                          \
+    prefix##_parallel_split(ctx, prefix##_left(node), depth-1);                \
+    prefix##_parallel_visit(ctx, 0, node);                                     \
+    prefix##_parallel_split(ctx, prefix##_right(node), depth-1);               \
+}                                                                              \
+                                                                               \
+static void prefix##_parallel_each(struct prefix##_parallel *ctx, type **root, \
+    int threads)                                                               \
+{                                                                              \
+    int depth = 0;                                                             \
+    threads = prefix##_parallel_threads(threads);                              \
+    while (depth < 8 && (1<<depth) < threads*4) {                              \
+        depth++;                                                               \
+    }                                                                          \
+    ctx->ntasks = 0;                                                           \
+    prefix##_parallel_split(ctx, *root, threads > 1 ? depth : 0);              \
+    prefix##_parallel_run(ctx, prefix##_parallel_scan, threads);               \
+}                                                                              \
+                                                                               \
+void prefix##_parallel_foreach(type **root,                                    \
+    void (*iter)(type *item, void *udata), void *udata, int threads)           \
+{                                                                              \
+    struct prefix##_parallel ctx;                                              \
+    ctx.iter = iter;                                                           \
+    ctx.udata = udata;                                                         \
+    prefix##_parallel_each(&ctx, root, threads);                               \
+}                                                                              \
+                                                                               \
+void prefix##_parallel_reduce(type **root, void *accs, size_t size,            \
+    void (*fold)(void *acc, type *item, void *udata),                          \
+    void (*merge)(void *acc, void *other, void *udata), void *udata,           \
+    int threads)                                                               \
+{                                                                              \
+    struct prefix##_parallel ctx;                                              \
+    ctx.iter = 0;                                                              \
+    ctx.fold = fold;                                                           \
+    ctx.accs = accs;                                                           \
+    ctx.size = size;                                                           \
+    ctx.udata = udata;                                                         \
+    prefix##_parallel_each(&ctx, root, threads);                               \
+    threads = prefix##_parallel_threads(threads);                              \
+    for (int i = 1; i < threads; i++) {                                        \
+        merge(ctx.accs, ctx.accs+(size_t)i*size, udata);                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_parallel_build0(struct prefix##_parallel *ctx,           \
+    type **items, size_t n, int level, int link)                               \
+{                                                                              \
+    if (level <= ctx->cut) {                                                   \
+        if (!link) {                                                           \
+            ctx->items[ctx->ntasks] = items;                                   \
+            ctx->counts[ctx->ntasks] = n;                                      \
+            ctx->ntasks++;                                                     \
+        }                                                                      \
+        if (level == 1) {                                                      \
+            return items[0];                                                   \
+        }                                                                      \
+        if (n-1 <= prefix##_build_max(level-1)*2) {                            \
+            return items[(n-1)/2];                                             \
+        }                                                                      \
+        return items[(n-2)/3];                                                 \
+    }                                                                          \
+    if (n-1 <= prefix##_build_max(level-1)*2) {                                \
+        size_t nleft = (n-1)/2;                                                \
+        type *node = items[nleft];                                             \
+        type *left = prefix##_parallel_build0(ctx, items, nleft, level-1,      \
+            link);                                                             \
+        type *right = prefix##_parallel_build0(ctx, items+nleft+1,             \
+            n-nleft-1, level-1, link);                                         \
+        if (link) {                                                            \
+            prefix##_setleft(node, left);                                      \
+            prefix##_setright(node, right);                                    \
+            prefix##_setlevel(node, level);                                    \
+            prefix##_refresh(node);                                            \
+        }                                                                      \
+        return node;                                                           \
+    }                                                                          \
+    size_t nleft = (n-2)/3;                                                    \
+    size_t nmid = (n-2-nleft)/2;                                               \
+    size_t nright = n-2-nleft-nmid;                                            \
+    type *node = items[nleft];                                                 \
+    type *right_node = items[nleft+1+nmid];                                    \
+    type *left = prefix##_parallel_build0(ctx, items, nleft, level-1, link);   \
+    type *mid = prefix##_parallel_build0(ctx, items+nleft+1, nmid, level-1,    \
+        link);                                                                 \
+    type *right = prefix##_parallel_build0(ctx, items+nleft+nmid+2, nright,    \
+        level-1, link);                                                        \
+    if (link) {                                                                \
+        prefix##_setleft(right_node, mid);                                     \
+        prefix##_setright(right_node, right);                                  \
+        prefix##_setlevel(right_node, level);                                  \
+        prefix##_refresh(right_node);                                          \
+        prefix##_setleft(node, left);                                          \
+        prefix##_setright(node, right_node);                                   \
+        prefix##_setlevel(node, level);                                        \
+        prefix##_refresh(node);                                                \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static void *prefix##_parallel_build(void *arg) {                              \
+    struct prefix##_parallel_thread *thread = arg;                             \
+    struct prefix##_parallel *ctx = thread->ctx;                               \
+    int task;                                                                  \
+    while ((task = prefix##_parallel_take(ctx)) != -1) {                       \
+        prefix##_build0(ctx->items[task], ctx->counts[task], ctx->cut);        \
+    }                                                                          \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+void prefix##_parallel_build_sorted(type **root, type **items, size_t n,       \
+    int threads)                                                               \
+{                                                                              \
+    struct prefix##_parallel ctx;                                              \
+    int level = 0;                                                             \
+    for (size_t m = n+1; m > 1; m >>= 1) {                                     \
+        level++;                                                               \
+    }                                                                          \
+    int depth = 0;                                                             \
+    threads = prefix##_parallel_threads(threads);                              \
+    while (depth < 6 && depth < level-1 && (1<<depth) < threads*4) {           \
+        depth++;                                                               \
+    }                                                                          \
+    if (threads == 1 || depth == 0) {                                          \
+        prefix##_build_sorted(root, items, n);                                 \
+        return;                                                                \
+    }                                                                          \
+    ctx.cut = level-depth;                                                     \
+    ctx.ntasks = 0;                                                            \
+    prefix##_parallel_build0(&ctx, items, n, level, 0);                        \
+    prefix##_parallel_run(&ctx, prefix##_parallel_build, threads);             \
+    type *node = prefix##_parallel_build0(&ctx, items, n, level, 1);           \
+    prefix##_setroot(root, node);                                              \
+}                                                                              \
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Internal macros shared by all of the AAT_IMPL variants above. Each variant
+// provides the functions for reading and writing the fields of a node, which
+// AAT_CORE uses to generate the tree algorithms.
+//
+// Insert and delete keep the path from the root in a fixed-size stack and
+// rebalance on the way back up, stopping as soon as the rest of the tree above
+// is known to be balanced. For insert that is when a node and the child below
+// it are both left unchanged, and for delete it is when the level of a node
+// does not need to decrease.
+//
+// Variants that keep an aggregate for each subtree provide a refresh function,
+// which is called on a node after its children change, from the bottom up.
+// When rebalancing stops early the rest of the nodes on the path are still
+// refreshed.
+//
+// Inserting a batch of sorted items keeps the part of the path that was left
+// in place by the previous insert. The next item starts its descent from the
+// lowest node on that path which must contain it, which is found by comparing
+// with the nodes where the path turned left, from the bottom up.
+//
+// Building from sorted items lays them out as a 2-3 tree with every leaf at
+// the same depth, where each 3-node becomes a node with a right child on the
+// same level.
+//
+// Joining two trees with a pivot item between them walks down the side of the
+// taller tree to the node on the level just above the shorter tree, hangs the
+// pivot there with the shorter tree as one of its children, and rebalances
+// back up. Splitting a tree at a key joins the pieces on either side of the
+// search path from the bottom up. Both take O(log n) time.
+//
+// Union, intersect and difference split the first tree at the root of the
+// other, recurse on the two halves with the children of that root, and join
+// the results back together. For trees of m and n items with m <= n this
+// takes O(m log(n/m + 1)) time. The removed items are gathered into one more
+// tree, in key order, by joining them to its right side.
+//
+// Relayout copies the tree in van Emde Boas order. The top half of the levels
+// are laid out first, followed by each of the subtrees hanging below them from
+// left to right, with the same applied to every part. Any path from the root
+// then crosses O(log n / log B) blocks of B nodes, for any block size, which
+// keeps searches within fewer cache lines and pages. A node at the bottom of a
+// part is linked to the copies of its children after they are laid out.
+////////////////////////////////////////////////////////////////////////////////
+
+#define AAT_LINKS(prefix, type, left, right, level, compare)                   \
+AAT_GETTERS(prefix, type, left, right, level)                                  \
+                                                                               \
+static inline void prefix##_setleft(type *node, type *child) {                 \
+    AAT_LINK_STORE(&node->left, child);                                        \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setright(type *node, type *child) {                \
+    AAT_LINK_STORE(&node->right, child);                                       \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setroot(type **root, type *node) {                 \
+    AAT_LINK_STORE(root, node);                                                \
+}                                                                              \
+                                                                               \
+AAT_FIND_PARENT(prefix, type, compare)                                         \
+
+#define AAT_RELAYOUT(prefix, type)                                             \
+static type *prefix##_relayout0(type *node, int height, type *dst,             \
+    size_t *n);                                                                \
+                                                                               \
+static void prefix##_relayout_bottom(type *node, int depth, int height,        \
+    type *dst, size_t *n)                                                      \
+{                                                                              \
+    type *left_node = prefix##_left(node);                                     \
+    type *right_node = prefix##_right(node);                                   \
+    if (depth > 1) {                                                           \
+        if (left_node) {                                                       \
+            prefix##_relayout_bottom(left_node, depth-1, height, dst, n);      \
+        }                                                                      \
+        if (right_node) {                                                      \
+            prefix##_relayout_bottom(right_node, depth-1, height, dst, n);     \
+        }                                                                      \
+    } else {                                                                   \
+        if (left_node) {                                                       \
+            left_node = prefix##_relayout0(left_node, height, dst, n);         \
+            prefix##_setleft(node, left_node);                                 \
+        }                                                                      \
+        if (right_node) {                                                      \
+            right_node = prefix##_relayout0(right_node, height, dst, n);       \
+            prefix##_setright(node, right_node);                               \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_relayout0(type *node, int height, type *dst,             \
+    size_t *n)                                                                 \
+{                                                                              \
+    if (height == 1) {                                                         \
+        type *copy = &dst[(*n)++];                                             \
+        *copy = *node;                                                         \
+        return copy;                                                           \
+    }                                                                          \
+    int top = height/2;                                                        \
+    type *copy = prefix##_relayout0(node, top, dst, n);                        \
+    prefix##_relayout_bottom(copy, top, height-top, dst, n);                   \
+    return copy;                                                               \
+}                                                                              \
+                                                                               \
+size_t prefix##_relayout(type **root, type *dst) {                             \
+    size_t n = 0;                                                              \
+    if (*root) {                                                               \
+        prefix##_setroot(root,                                                 \
+            prefix##_relayout0(*root, prefix##_level(*root)*2, dst, &n));      \
+    }                                                                          \
+    return n;                                                                  \
+}                                                                              \
+
+#define AAT_FIND_PARENT(prefix, type, compare)                                 \
+static inline int prefix##_parent_links(void) {                                \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static int prefix##_locate(type **root, type *item,                            \
+    struct aat_cursor *cursor);                                                \
+                                                                               \
+static type *prefix##_parent(type **root, type *item) {                        \
+    struct aat_cursor cursor;                                                  \
+    if (!prefix##_locate(root, item, &cursor) || cursor.depth < 2) {           \
+        return 0;                                                              \
+    }                                                                          \
+    return (type*)cursor.stack[cursor.depth-2];                                \
+}                                                                              \
+
+#define AAT_GETTERS(prefix, type, left, right, level)                          \
+static inline type *prefix##_left(type *node) {                                \
+    return AAT_LINK_LOAD(&node->left);                                         \
+}                                                                              \
+                                                                               \
+static inline type *prefix##_right(type *node) {                               \
+    return AAT_LINK_LOAD(&node->right);                                        \
+}                                                                              \
+                                                                               \
+static inline int prefix##_level(type *node) {                                 \
+    return AAT_LINK_LOAD(&node->level);                                        \
+}                                                                              \
+                                                                               \
+static inline void prefix##_setlevel(type *node, int new_level) {              \
+    AAT_LINK_STORE(&node->level, new_level);                                   \
+}                                                                              \
+
+#define AAT_CORE(prefix, type, compare)                                        \
+AAT_STATS_IMPL(prefix)                                                         \
+                                                                               \
+static inline int prefix##_order(type *a, type *b) {                           \
+    AAT_STATS_ADD(prefix, compares);                                           \
+    return compare(a, b);                                                      \
+}                                                                              \
+                                                                               \
+static inline void prefix##_prefetch(type *node) {                             \
+    AAT_PREFETCH_CHILD(prefix##_left(node));                                   \
+    AAT_PREFETCH_CHILD(prefix##_right(node));                                  \
+    (void)node;                                                                \
+}                                                                              \
+                                                                               \
+static int prefix##_locate(type **root, type *item,                            \
+    struct aat_cursor *cursor)                                                 \
+{                                                                              \
+    int found = 0;                                                             \
+    cursor->depth = 0;                                                         \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        cursor->stack[cursor->depth++] = node;                                 \
+        if (node == item) {                                                    \
+            return 1;                                                          \
+        }                                                                      \
+        int cmp = prefix##_order(item, node);                                  \
+        if (cmp > 0) {                                                         \
+            node = prefix##_right(node);                                       \
+        } else {                                                               \
+            if (cmp == 0) {                                                    \
+                found = cursor->depth;                                         \
+            }                                                                  \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+    }                                                                          \
+    cursor->depth = found;                                                     \
+    while (cursor->depth > 0) {                                                \
+        node = (type*)cursor->stack[cursor->depth-1];                          \
+        if (node == item) {                                                    \
+            return 1;                                                          \
+        }                                                                      \
+        if (prefix##_order(item, node) != 0) {                                 \
+            break;                                                             \
+        }                                                                      \
+        if (prefix##_right(node)) {                                            \
+            node = prefix##_right(node);                                       \
+            while (node) {                                                     \
+                cursor->stack[cursor->depth++] = node;                         \
+                node = prefix##_left(node);                                    \
+            }                                                                  \
+        } else {                                                               \
+            type *parent;                                                      \
+            do {                                                               \
+                node = (type*)cursor->stack[--cursor->depth];                  \
+                parent = cursor->depth > 0 ?                                   \
+                    (type*)cursor->stack[cursor->depth-1] : 0;                 \
+            } while (parent && prefix##_right(parent) == node);                \
+        }                                                                      \
+    }                                                                          \
+    cursor->depth = 0;                                                         \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static type *prefix##_skew(type *node) {                                       \
+    if (node && prefix##_left(node) &&                                         \
+        prefix##_level(prefix##_left(node)) == prefix##_level(node))           \
+    {                                                                          \
+        type *left_node = prefix##_left(node);                                 \
+        prefix##_setleft(node, prefix##_right(left_node));                     \
+        prefix##_setright(left_node, node);                                    \
+        prefix##_refresh(node);                                                \
+        prefix##_refresh(left_node);                                           \
+        AAT_STATS_ADD(prefix, skews);                                          \
+        node = left_node;                                                      \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static type *prefix##_split(type *node) {                                      \
+    if (node && prefix##_right(node) &&                                        \
+        prefix##_right(prefix##_right(node)) &&                                \
+        prefix##_level(prefix##_right(prefix##_right(node))) ==                \
+            prefix##_level(node))                                              \
+    {                                                                          \
+        type *right_node = prefix##_right(node);                               \
+        prefix##_setright(node, prefix##_left(right_node));                    \
+        prefix##_setleft(right_node, node);                                    \
+        prefix##_setlevel(right_node, prefix##_level(right_node)+1);           \
+        prefix##_refresh(node);                                                \
+        prefix##_refresh(right_node);                                          \
+        AAT_STATS_ADD(prefix, splits);                                         \
+        node = right_node;                                                     \
+    }                                                                          \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static void prefix##_replace(type **root, type *parent, type *node,            \
+    type *child)                                                               \
+{                                                                              \
+    if (!parent) {                                                             \
+        prefix##_setroot(root, child);                                         \
+    } else if (prefix##_left(parent) == node) {                                \
+        prefix##_setleft(parent, child);                                       \
+    } else {                                                                   \
+        prefix##_setright(parent, child);                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void prefix##_insert_link(type **root, type **path, int *pathlen,       \
+    int depth, int cmp, type *item)                                            \
+{                                                                              \
+    prefix##_setleft(item, 0);                                                 \
+    prefix##_setright(item, 0);                                                \
+    prefix##_setlevel(item, 1);                                                \
+    prefix##_refresh(item);                                                    \
+    *pathlen = depth;                                                          \
+    if (depth == 0) {                                                          \
+        prefix##_setroot(root, item);                                          \
+        return;                                                                \
+    }                                                                          \
+    if (cmp < 0) {                                                             \
+        prefix##_setleft(path[depth-1], item);                                 \
+    } else {                                                                   \
+        prefix##_setright(path[depth-1], item);                                \
+    }                                                                          \
+    int changed = 1;                                                           \
+    while (depth > 0) {                                                        \
+        type *node = path[--depth];                                            \
+        prefix##_refresh(node);                                                \
+        int old_level = prefix##_level(node);                                  \
+        type *balanced = prefix##_split(prefix##_skew(node));                  \
+        if (balanced != node || prefix##_level(balanced) != old_level) {       \
+            prefix##_replace(root, depth > 0 ? path[depth-1] : 0, node,        \
+                balanced);                                                     \
+            *pathlen = depth;                                                  \
+            changed = 1;                                                       \
+        } else if (changed) {                                                  \
+            changed = 0;                                                       \
+        } else {                                                               \
+            break;                                                             \
+        }                                                                      \
+    }                                                                          \
+    while (depth > 0) {                                                        \
+        prefix##_refresh(path[--depth]);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_insert_path(type **root, type **path, int *pathlen,      \
+    type *item, int multi)                                                     \
+{                                                                              \
+    int depth = *pathlen;                                                      \
+    int cmp = 0;                                                               \
+    type *node = depth > 0 ? path[--depth] : *root;                            \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        cmp = prefix##_order(item, node);                                      \
+        if (cmp == 0 && !multi) {                                              \
+            prefix##_setleft(item, prefix##_left(node));                       \
+            prefix##_setright(item, prefix##_right(node));                     \
+            prefix##_setlevel(item, prefix##_level(node));                     \
+            prefix##_refresh(item);                                            \
+            prefix##_replace(root, depth > 0 ? path[depth-1] : 0, node, item); \
+            if (node != item) {                                                \
+                prefix##_clear(node);                                          \
+            }                                                                  \
+            AAT_STATS_DEPTH(prefix, depth+1);                                  \
+            *pathlen = depth;                                                  \
+            while (depth > 0) {                                                \
+                prefix##_refresh(path[--depth]);                               \
+            }                                                                  \
+            return node;                                                       \
+        }                                                                      \
+        path[depth++] = node;                                                  \
+        node = cmp < 0 ? prefix##_left(node) : prefix##_right(node);           \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
+    prefix##_insert_link(root, path, pathlen, depth, cmp, item);               \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+type *prefix##_insert(type **root, type *item) {                               \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int pathlen = 0;                                                           \
+    return prefix##_insert_path(root, path, &pathlen, item, 0);                \
+}                                                                              \
+                                                                               \
+void prefix##_insert_multi(type **root, type *item) {                          \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int pathlen = 0;                                                           \
+    prefix##_insert_path(root, path, &pathlen, item, 1);                       \
+}                                                                              \
+                                                                               \
+type *prefix##_get_or_insert_with(type **root, type *key,                      \
+    type *(*make)(type *key, void *udata), void *udata, int *inserted)         \
+{                                                                              \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    int cmp = 0;                                                               \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        cmp = prefix##_order(key, node);                                       \
+        if (cmp == 0) {                                                        \
+            AAT_STATS_DEPTH(prefix, depth+1);                                  \
+            if (inserted) {                                                    \
+                *inserted = 0;                                                 \
+            }                                                                  \
+            return node;                                                       \
+        }                                                                      \
+        path[depth++] = node;                                                  \
+        node = cmp < 0 ? prefix##_left(node) : prefix##_right(node);           \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
+    type *item = make(key, udata);                                             \
+    if (item) {                                                                \
+        int pathlen;                                                           \
+        prefix##_insert_link(root, path, &pathlen, depth, cmp, item);          \
+    }                                                                          \
+    if (inserted) {                                                            \
+        *inserted = item != 0;                                                 \
+    }                                                                          \
+    return item;                                                               \
+}                                                                              \
+                                                                               \
+static type *prefix##_make_self(type *key, void *udata) {                      \
+    (void)key;                                                                 \
+    return (type*)udata;                                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_get_or_insert(type **root, type *item, int *inserted) {         \
+    return prefix##_get_or_insert_with(root, item, prefix##_make_self, item,   \
+        inserted);                                                             \
+}                                                                              \
+                                                                               \
+static int prefix##_finger(type **path, int pathlen, type *item) {             \
+    int start = pathlen-1;                                                     \
+    for (int i = pathlen-2; i >= 0; i--) {                                     \
+        if (prefix##_left(path[i]) == path[i+1]) {                             \
+            if (prefix##_order(item, path[i]) < 0) {                           \
+                break;                                                         \
+            }                                                                  \
+            start = i;                                                         \
+        }                                                                      \
+    }                                                                          \
+    return start+1;                                                            \
+}                                                                              \
+                                                                               \
+size_t prefix##_insert_batch(type **root, type **items, size_t n,              \
+    type **replaced)                                                           \
+{                                                                              \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int pathlen = 0;                                                           \
+    size_t count = 0;                                                          \
+    for (size_t i = 0; i < n; i++) {                                           \
+        pathlen = prefix##_finger(path, pathlen, items[i]);                    \
+        type *prev = prefix##_insert_path(root, path, &pathlen, items[i],      \
+            0);                                                                \
+        if (replaced) {                                                        \
+            replaced[i] = prev;                                                \
+        }                                                                      \
+        if (prev) {                                                            \
+            count++;                                                           \
+        }                                                                      \
+    }                                                                          \
+    return count;                                                              \
+}                                                                              \
+                                                                               \
+static int prefix##_decrease_level(type *node) {                               \
+    type *left_node = prefix##_left(node);                                     \
+    type *right_node = prefix##_right(node);                                   \
+    if (left_node || right_node) {                                             \
+        int new_level = 0;                                                     \
+        if (left_node && right_node) {                                         \
+            if (prefix##_level(left_node) < prefix##_level(right_node)) {      \
+                new_level = prefix##_level(left_node);                         \
+            } else {                                                           \
+                new_level = prefix##_level(right_node);                        \
+            }                                                                  \
+        }                                                                      \
+        new_level++;                                                           \
+        if (new_level < prefix##_level(node)) {                                \
+            prefix##_setlevel(node, new_level);                                \
+            if (right_node && new_level < prefix##_level(right_node)) {        \
+                prefix##_setlevel(right_node, new_level);                      \
+            }                                                                  \
+            AAT_STATS_ADD(prefix, decrease_levels);                            \
+            return 1;                                                          \
+        }                                                                      \
+    }                                                                          \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+static type *prefix##_delete_fixup(type *node) {                               \
+    node = prefix##_skew(node);                                                \
+    prefix##_setright(node, prefix##_skew(prefix##_right(node)));              \
+    type *right_node = prefix##_right(node);                                   \
+    if (right_node && prefix##_right(right_node)) {                            \
+        prefix##_setright(right_node,                                          \
+            prefix##_skew(prefix##_right(right_node)));                        \
+    }                                                                          \
+    node = prefix##_split(node);                                               \
+    prefix##_setright(node, prefix##_split(prefix##_right(node)));             \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+static void prefix##_delete_rebalance(type **root, type **path, int depth) {   \
+    while (depth > 0) {                                                        \
+        type *node = path[--depth];                                            \
+        prefix##_refresh(node);                                                \
+        if (!prefix##_decrease_level(node)) {                                  \
+            break;                                                             \
+        }                                                                      \
+        prefix##_replace(root, depth > 0 ? path[depth-1] : 0, node,            \
+            prefix##_delete_fixup(node));                                      \
+    }                                                                          \
+    while (depth > 0) {                                                        \
+        prefix##_refresh(path[--depth]);                                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_delete_first0(type **root, type **first) {               \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    type *node = *root;                                                        \
+    if (!node) {                                                               \
+        *first = 0;                                                            \
+        return 0;                                                              \
+    }                                                                          \
+    while (prefix##_left(node)) {                                              \
+        path[depth++] = node;                                                  \
+        node = prefix##_left(node);                                            \
+    }                                                                          \
+    type *right = prefix##_right(node);                                        \
+    *first = right ? right : depth > 0 ? path[depth-1] : 0;                    \
+    prefix##_replace(root, depth > 0 ? path[depth-1] : 0, node, right);        \
+    prefix##_delete_rebalance(root, path, depth);                              \
+    prefix##_clear(node);                                                      \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_delete_first(type **root) {                                     \
+    type *first;                                                               \
+    return prefix##_delete_first0(root, &first);                               \
+}                                                                              \
+                                                                               \
+static type *prefix##_delete_last0(type **root, type **last) {                 \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    type *node = *root;                                                        \
+    if (!node) {                                                               \
+        *last = 0;                                                             \
+        return 0;                                                              \
+    }                                                                          \
+    while (prefix##_right(node)) {                                             \
+        path[depth++] = node;                                                  \
+        node = prefix##_right(node);                                           \
+    }                                                                          \
+    type *left = prefix##_left(node);                                          \
+    *last = left ? left : depth > 0 ? path[depth-1] : 0;                       \
+    prefix##_replace(root, depth > 0 ? path[depth-1] : 0, node, left);         \
+    prefix##_delete_rebalance(root, path, depth);                              \
+    prefix##_clear(node);                                                      \
+    return node;                                                               \
+}                                                                              \
+                                                                               \
+type *prefix##_delete_last(type **root) {                                      \
+    type *last;                                                                \
+    return prefix##_delete_last0(root, &last);                                 \
+}                                                                              \
+                                                                               \
+static type *prefix##_delete_path(type **root, type **path, int depth,         \
+    type *node)                                                                \
+{                                                                              \
+    type *parent = depth > 0 ? path[depth-1] : 0;                              \
+    if (!prefix##_left(node) && !prefix##_right(node)) {                       \
+        prefix##_replace(root, parent, node, 0);                               \
     } else {                                                                   \
-        int cmp = compare(item, node);                                         \
-        if (cmp < 0) {                                                         \
-            node->left = prefix##_insert0(node->left, item, replaced);         \
-        } else if (cmp > 0) {                                                  \
-            node->right = prefix##_insert0(node->right, item, replaced);       \
+        int index = depth;                                                     \
+        path[depth++] = node;                                                  \
+        type *leaf;                                                            \
+        if (prefix##_left(node)) {                                             \
+            leaf = prefix##_left(node);                                        \
+            while (prefix##_right(leaf)) {                                     \
+                path[depth++] = leaf;                                          \
+                leaf = prefix##_right(leaf);                                   \
+            }                                                                  \
+            prefix##_replace(root, path[depth-1], leaf, prefix##_left(leaf));  \
         } else {                                                               \
-            *replaced = node;                                                  \
-            item->left = node->left;                                           \
-            item->right = node->right;                                         \
-            item->level = node->level;                                         \
-            node = item;                                                       \
+            leaf = prefix##_right(node);                                       \
+            while (prefix##_left(leaf)) {                                      \
+                path[depth++] = leaf;                                          \
+                leaf = prefix##_left(leaf);                                    \
+            }                                                                  \
+            prefix##_replace(root, path[depth-1], leaf, prefix##_right(leaf)); \
         }                                                                      \
+        prefix##_setleft(leaf, prefix##_left(node));                           \
+        prefix##_setright(leaf, prefix##_right(node));                         \
+        prefix##_setlevel(leaf, prefix##_level(node));                         \
+        prefix##_replace(root, parent, node, leaf);                            \
+        path[index] = leaf;                                                    \
     }                                                                          \
-    node = prefix##_skew(node);                                                \
-    node = prefix##_split(node);                                               \
+    prefix##_delete_rebalance(root, path, depth);                              \
+    prefix##_clear(node);                                                      \
     return node;                                                               \
 }                                                                              \
                                                                                \
-type *prefix##_insert(type **root, type *item) {                               \
-    type *replaced = 0;                                                        \
-    *root = prefix##_insert0(*root, item, &replaced);                          \
-    if (replaced != item) {                                                    \
-        prefix##_clear(replaced);                                              \
+type *prefix##_remove_node(type **root, type *node) {                          \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    if (prefix##_parent_links()) {                                             \
+        type *top = node;                                                      \
+        type *parent = prefix##_parent(root, node);                            \
+        while (parent) {                                                       \
+            path[depth++] = parent;                                            \
+            top = parent;                                                      \
+            parent = prefix##_parent(root, parent);                            \
+        }                                                                      \
+        if (top != *root) {                                                    \
+            return 0;                                                          \
+        }                                                                      \
+        for (int i = 0; i < depth/2; i++) {                                    \
+            type *swap = path[i];                                              \
+            path[i] = path[depth-1-i];                                         \
+            path[depth-1-i] = swap;                                            \
+        }                                                                      \
+    } else {                                                                   \
+        struct aat_cursor cursor;                                              \
+        if (!prefix##_locate(root, node, &cursor)) {                           \
+            return 0;                                                          \
+        }                                                                      \
+        depth = cursor.depth-1;                                                \
+        for (int i = 0; i < depth; i++) {                                      \
+            path[i] = (type*)cursor.stack[i];                                  \
+        }                                                                      \
     }                                                                          \
-    return replaced;                                                           \
+    return prefix##_delete_path(root, path, depth, node);                      \
 }                                                                              \
                                                                                \
-static type *prefix##_decrease_level(type *node) {                             \
-    if (node->left || node->right) {                                           \
-        int new_level = 0;                                                     \
-        if (node->left && node->right) {                                       \
-            if (node->left->level < node->right->level) {                      \
-                new_level = node->left->level;                                 \
-            } else {                                                           \
-                new_level = node->right->level;                                \
-            }                                                                  \
-        }                                                                      \
-        new_level++;                                                           \
-        if (new_level < node->level) {                                         \
-            node->level = new_level;                                           \
-            if (node->right && new_level < node->right->level) {               \
-                node->right->level = new_level;                                \
-            }                                                                  \
+type *prefix##_delete(type **root, type *key) {                                \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        prefix##_prefetch(node);                                               \
+        int cmp = prefix##_order(key, node);                                   \
+        if (cmp == 0) {                                                        \
+            break;                                                             \
         }                                                                      \
+        path[depth++] = node;                                                  \
+        node = cmp < 0 ? prefix##_left(node) : prefix##_right(node);           \
     }                                                                          \
-    return node;                                                               \
+    AAT_STATS_DEPTH(prefix, depth+(node != 0));                                \
+    return node ? prefix##_delete_path(root, path, depth, node) : 0;           \
 }                                                                              \
                                                                                \
-static type *prefix##_delete_fixup(type *node) {                               \
-    node = prefix##_decrease_level(node);                                      \
-    node = prefix##_skew(node);                                                \
-    node->right = prefix##_skew(node->right);                                  \
-    if (node->right && node->right->right) {                                   \
-        node->right->right = prefix##_skew(node->right->right);                \
+static size_t prefix##_build_max(int level) {                                  \
+    size_t max = 1;                                                            \
+    for (int i = 0; i < level && max <= (size_t)-1 / 3; i++) {                 \
+        max *= 3;                                                              \
     }                                                                          \
-    node = prefix##_split(node);                                               \
-    node->right = prefix##_split(node->right);                                 \
-    return node;                                                               \
+    return max - 1;                                                            \
 }                                                                              \
                                                                                \
-static type *prefix##_delete_first0(type *node,                                \
-    type **deleted)                                                            \
-{                                                                              \
-    if (node) {                                                                \
-        if (!node->left) {                                                     \
-            *deleted = node;                                                   \
-            if (node->right) {                                                 \
-                node = node->right;                                            \
-            } else {                                                           \
-                node = 0;                                                      \
-            }                                                                  \
-        } else {                                                               \
-            node->left = prefix##_delete_first0(node->left, deleted);          \
-            node = prefix##_delete_fixup(node);                                \
+static type *prefix##_build0(type **items, size_t n, int level) {              \
+    if (level == 1) {                                                          \
+        type *node = items[0];                                                 \
+        prefix##_setleft(node, 0);                                             \
+        prefix##_setright(node, 0);                                            \
+        prefix##_setlevel(node, 1);                                            \
+        if (n == 2) {                                                          \
+            prefix##_setleft(items[1], 0);                                     \
+            prefix##_setright(items[1], 0);                                    \
+            prefix##_setlevel(items[1], 1);                                    \
+            prefix##_refresh(items[1]);                                        \
+            prefix##_setright(node, items[1]);                                 \
         }                                                                      \
+        prefix##_refresh(node);                                                \
+        return node;                                                           \
+    }                                                                          \
+    if (n-1 <= prefix##_build_max(level-1)*2) {                                \
+        size_t nleft = (n-1)/2;                                                \
+        type *node = items[nleft];                                             \
+        prefix##_setleft(node, prefix##_build0(items, nleft, level-1));        \
+        prefix##_setright(node, prefix##_build0(items+nleft+1, n-nleft-1,      \
+            level-1));                                                         \
+        prefix##_setlevel(node, level);                                        \
+        prefix##_refresh(node);                                                \
+        return node;                                                           \
     }                                                                          \
+    size_t nleft = (n-2)/3;                                                    \
+    size_t nmid = (n-2-nleft)/2;                                               \
+    size_t nright = n-2-nleft-nmid;                                            \
+    type *node = items[nleft];                                                 \
+    type *right_node = items[nleft+1+nmid];                                    \
+    prefix##_setleft(right_node, prefix##_build0(items+nleft+1, nmid,          \
+        level-1));                                                             \
+    prefix##_setright(right_node, prefix##_build0(items+nleft+nmid+2, nright,  \
+        level-1));                                                             \
+    prefix##_setlevel(right_node, level);                                      \
+    prefix##_refresh(right_node);                                              \
+    prefix##_setleft(node, prefix##_build0(items, nleft, level-1));            \
+    prefix##_setright(node, right_node);                                       \
+    prefix##_setlevel(node, level);                                            \
+    prefix##_refresh(node);                                                    \
     return node;                                                               \
 }                                                                              \
                                                                                \
-static type *prefix##_delete_last0(type *node,                                 \
-    type **deleted)                                                            \
+void prefix##_build_sorted(type **root, type **items, size_t n) {              \
+    int level = 0;                                                             \
+    for (size_t m = n+1; m > 1; m >>= 1) {                                     \
+        level++;                                                               \
+    }                                                                          \
+    prefix##_setroot(root, n > 0 ? prefix##_build0(items, n, level) : 0);      \
+}                                                                              \
+                                                                               \
+static void prefix##_clear_all0(type *node,                                    \
+    void (*free_item)(type *item, void *udata), void *udata)                   \
 {                                                                              \
     if (node) {                                                                \
-        if (!node->right) {                                                    \
-            *deleted = node;                                                   \
-            if (node->left) {                                                  \
-                node = node->left;                                             \
-            } else {                                                           \
-                node = 0;                                                      \
-            }                                                                  \
-        } else {                                                               \
-            node->right = prefix##_delete_last0(node->right, deleted);         \
-            node = prefix##_delete_fixup(node);                                \
+        prefix##_clear_all0(prefix##_left(node), free_item, udata);            \
+        prefix##_clear_all0(prefix##_right(node), free_item, udata);           \
+        prefix##_clear(node);                                                  \
+        if (free_item) {                                                       \
+            free_item(node, udata);                                            \
         }                                                                      \
     }                                                                          \
-    return node;                                                               \
-}                                                                              \
-                                                                               \
-type *prefix##_delete_first(type **root) {                                     \
-    type *deleted = 0;                                                         \
-    *root = prefix##_delete_first0(*root, &deleted);                           \
-    prefix##_clear(deleted);                                                   \
-    return deleted;                                                            \
 }                                                                              \
                                                                                \
-type *prefix##_delete_last(type **root) {                                      \
-    type *deleted = 0;                                                         \
-    *root = prefix##_delete_last0(*root, &deleted);                            \
-    prefix##_clear(deleted);                                                   \
-    return deleted;                                                            \
+void prefix##_clear_all(type **root,                                           \
+    void (*free_item)(type *item, void *udata), void *udata)                   \
+{                                                                              \
+    type *node = *root;                                                        \
+    prefix##_setroot(root, 0);                                                 \
+    prefix##_clear_all0(node, free_item, udata);                               \
 }                                                                              \
                                                                                \
-static type *prefix##_delete0(type *node,                                      \
-    type *key, type **deleted)                                                 \
+static int prefix##_clone0(type *node, type **dst,                             \
+    type *(*copy)(type *item, void *udata),                                    \
+    void (*free_item)(type *item, void *udata), void *udata)                   \
 {                                                                              \
-    if (node) {                                                                \
-        int cmp = compare(key, node);                                          \
-        if (cmp < 0) {                                                         \
-            node->left = prefix##_delete0(node->left, key, deleted);           \
-        } else if (cmp > 0) {                                                  \
-            node->right = prefix##_delete0(node->right, key, deleted);         \
-        } else {                                                               \
-            *deleted = node;                                                   \
-            if (!node->left && !node->right) {                                 \
-                node = 0;                                                      \
-            } else {                                                           \
-                type *leaf_deleted = 0;                                        \
-                if (!node->left) {                                             \
-                    node->right = prefix##_delete_first0(node->right,          \
-                        &leaf_deleted);                                        \
-                } else {                                                       \
-                    node->left = prefix##_delete_last0(node->left,             \
-                        &leaf_deleted);                                        \
-                }                                                              \
-                leaf_deleted->left = node->left;                               \
-                leaf_deleted->right = node->right;                             \
-                leaf_deleted->level = node->level;                             \
-                node = leaf_deleted;                                           \
-            }                                                                  \
-        }                                                                      \
-        if (node) {                                                            \
-            node = prefix##_delete_fixup(node);                                \
-        }                                                                      \
+    type *left_copy = 0;                                                       \
+    type *right_copy = 0;                                                      \
+    *dst = 0;                                                                  \
+    if (!node) {                                                               \
+        return 1;                                                              \
     }                                                                          \
-    return node;                                                               \
+    if (!prefix##_clone0(prefix##_left(node), &left_copy, copy, free_item,     \
+        udata))                                                                \
+    {                                                                          \
+        return 0;                                                              \
+    }                                                                          \
+    if (!prefix##_clone0(prefix##_right(node), &right_copy, copy, free_item,   \
+        udata))                                                                \
+    {                                                                          \
+        prefix##_clear_all0(left_copy, free_item, udata);                      \
+        return 0;                                                              \
+    }                                                                          \
+    type *node_copy = copy(node, udata);                                       \
+    if (!node_copy) {                                                          \
+        prefix##_clear_all0(left_copy, free_item, udata);                      \
+        prefix##_clear_all0(right_copy, free_item, udata);                     \
+        return 0;                                                              \
+    }                                                                          \
+    prefix##_clear(node_copy);                                                 \
+    prefix##_setlevel(node_copy, prefix##_level(node));                        \
+    prefix##_setleft(node_copy, left_copy);                                    \
+    prefix##_setright(node_copy, right_copy);                                  \
+    prefix##_refresh(node_copy);                                               \
+    *dst = node_copy;                                                          \
+    return 1;                                                                  \
 }                                                                              \
                                                                                \
-type *prefix##_delete(type **root, type *key) {                                \
-    type *deleted = 0;                                                         \
-    *root = prefix##_delete0(*root, key, &deleted);                            \
-    prefix##_clear(deleted);                                                   \
-    return deleted;                                                            \
+int prefix##_clone(type **root, type **dst,                                    \
+    type *(*copy)(type *item, void *udata),                                    \
+    void (*free_item)(type *item, void *udata), void *udata)                   \
+{                                                                              \
+    type *clone_root;                                                          \
+    if (!prefix##_clone0(*root, &clone_root, copy, free_item, udata)) {        \
+        return 0;                                                              \
+    }                                                                          \
+    prefix##_setroot(dst, clone_root);                                         \
+    return 1;                                                                  \
 }                                                                              \
                                                                                \
 type *prefix##_search(type **root, type *key) {                                \
     type *found = 0;                                                           \
-    type *node = *root;                                                        \
+    type *node = AAT_LINK_LOAD(root);                                          \
+    int depth = 0;                                                             \
     while (node) {                                                             \
-        int cmp = compare(key, node);                                          \
+        prefix##_prefetch(node);                                               \
+        int cmp = prefix##_order(key, node);                                   \
         if (cmp < 0) {                                                         \
-            node = node->left;                                                 \
+            node = prefix##_left(node);                                        \
         } else if (cmp > 0) {                                                  \
-            node = node->right;                                                \
+            node = prefix##_right(node);                                       \
         } else {                                                               \
             found = node;                                                      \
             node = 0;                                                          \
         }                                                                      \
+        AAT_STATS_STEP(depth);                                                 \
     }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
     return found;                                                              \
 }                                                                              \
                                                                                \
+void prefix##_search_many(type **root, type **keys, type **found,              \
+    size_t n)                                                                  \
+{                                                                              \
+    type *nodes[AAT_SEARCH_MANY];                                              \
+    for (size_t i = 0; i < n; i += AAT_SEARCH_MANY) {                          \
+        size_t m = n-i < AAT_SEARCH_MANY ? n-i : AAT_SEARCH_MANY;              \
+        for (size_t j = 0; j < m; j++) {                                       \
+            nodes[j] = *root;                                                  \
+            found[i+j] = 0;                                                    \
+        }                                                                      \
+        int active = 1;                                                        \
+        while (active) {                                                       \
+            active = 0;                                                        \
+            for (size_t j = 0; j < m; j++) {                                   \
+                type *node = nodes[j];                                         \
+                if (!node) {                                                   \
+                    continue;                                                  \
+                }                                                              \
+                int cmp = prefix##_order(keys[i+j], node);                     \
+                if (cmp == 0) {                                                \
+                    found[i+j] = node;                                         \
+                    node = 0;                                                  \
+                } else {                                                       \
+                    node = cmp < 0 ? prefix##_left(node) :                     \
+                        prefix##_right(node);                                  \
+                    AAT_PREFETCH_ADDR(node);                                   \
+                    active |= node != 0;                                       \
+                }                                                              \
+                nodes[j] = node;                                               \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
 type *prefix##_first(type **root) {                                            \
-    type *node = *root;                                                        \
+    type *node = AAT_LINK_LOAD(root);                                          \
     if (node) {                                                                \
-        while (node->left) {                                                   \
-            node = node->left;                                                 \
+        while (prefix##_left(node)) {                                          \
+            node = prefix##_left(node);                                        \
         }                                                                      \
     }                                                                          \
     return node;                                                               \
 }                                                                              \
                                                                                \
 type *prefix##_last(type **root) {                                             \
-    type *node = *root;                                                        \
+    type *node = AAT_LINK_LOAD(root);                                          \
     if (node) {                                                                \
-        while (node->right) {                                                  \
-            node = node->right;                                                \
+        while (prefix##_right(node)) {                                         \
+            node = prefix##_right(node);                                       \
         }                                                                      \
     }                                                                          \
     return node;                                                               \
@@ -260,52 +2685,60 @@ type *prefix##_last(type **root) {                                             \
                                                                                \
 type *prefix##_iter(type **root, type *key) {                                  \
     type *found = 0;                                                           \
-    type *node = *root;                                                        \
+    type *node = AAT_LINK_LOAD(root);                                          \
+    int depth = 0;                                                             \
     while (node) {                                                             \
-        int cmp = compare(key, node);                                          \
-        if (cmp < 0) {                                                         \
-            found = node;                                                      \
-            node = node->left;                                                 \
-        } else if (cmp > 0) {                                                  \
-            node = node->right;                                                \
+        prefix##_prefetch(node);                                               \
+        if (prefix##_order(key, node) > 0) {                                   \
+            node = prefix##_right(node);                                       \
         } else {                                                               \
             found = node;                                                      \
-            node = 0;                                                          \
+            node = prefix##_left(node);                                        \
         }                                                                      \
+        AAT_STATS_STEP(depth);                                                 \
     }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
     return found;                                                              \
 }                                                                              \
                                                                                \
-static type *prefix##_parent(type **root,                                      \
-    type *item)                                                                \
-{                                                                              \
-    type *parent = 0;                                                          \
+static type *prefix##_iter_after(type **root, type *key) {                     \
+    type *found = 0;                                                           \
     type *node = *root;                                                        \
+    int depth = 0;                                                             \
     while (node) {                                                             \
-        int cmp = compare(item, node);                                         \
-        if (cmp < 0) {                                                         \
-            parent = node;                                                     \
-            node = node->left;                                                 \
-        } else if (cmp > 0) {                                                  \
-            parent = node;                                                     \
-            node = node->right;                                                \
+        prefix##_prefetch(node);                                               \
+        if (prefix##_order(key, node) >= 0) {                                  \
+            node = prefix##_right(node);                                       \
         } else {                                                               \
-            node = 0;                                                          \
+            found = node;                                                      \
+            node = prefix##_left(node);                                        \
         }                                                                      \
+        AAT_STATS_STEP(depth);                                                 \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, depth);                                            \
+    return found;                                                              \
+}                                                                              \
+                                                                               \
+type *prefix##_equal_range(type **root, type *key, type **end) {               \
+    type *first = prefix##_iter(root, key);                                    \
+    if (!first || prefix##_order(key, first) != 0) {                           \
+        *end = first;                                                          \
+        return 0;                                                              \
     }                                                                          \
-    return parent;                                                             \
+    *end = prefix##_iter_after(root, key);                                     \
+    return first;                                                              \
 }                                                                              \
                                                                                \
 type *prefix##_next(type **root, type *node) {                                 \
     if (node) {                                                                \
-        if (node->right) {                                                     \
-            node = node->right;                                                \
-            while (node->left) {                                               \
-                node = node->left;                                             \
+        if (prefix##_right(node)) {                                            \
+            node = prefix##_right(node);                                       \
+            while (prefix##_left(node)) {                                      \
+                node = prefix##_left(node);                                    \
             }                                                                  \
         } else {                                                               \
             type *parent = prefix##_parent(root, node);                        \
-            while (parent && parent->left != node) {                           \
+            while (parent && prefix##_left(parent) != node) {                  \
                 node = parent;                                                 \
                 parent = prefix##_parent(root, parent);                        \
             }                                                                  \
@@ -317,14 +2750,14 @@ type *prefix##_next(type **root, type *node) {                                 \
                                                                                \
 type *prefix##_prev(type **root, type *node) {                                 \
     if (node) {                                                                \
-        if (node->left) {                                                      \
-            node = node->left;                                                 \
-            while (node->right) {                                              \
-                node = node->right;                                            \
+        if (prefix##_left(node)) {                                             \
+            node = prefix##_left(node);                                        \
+            while (prefix##_right(node)) {                                     \
+                node = prefix##_right(node);                                   \
             }                                                                  \
         } else {                                                               \
             type *parent = prefix##_parent(root, node);                        \
-            while (parent && parent->right != node) {                          \
+            while (parent && prefix##_right(parent) != node) {                 \
                 node = parent;                                                 \
                 parent = prefix##_parent(root, parent);                        \
             }                                                                  \
@@ -333,5 +2766,471 @@ type *prefix##_prev(type **root, type *node) {                                 \
     }                                                                          \
     return node;                                                               \
 }                                                                              \
+                                                                               \
+type *prefix##_cursor_item(struct aat_cursor *cursor) {                        \
+    if (cursor->depth == 0) {                                                  \
+        return 0;                                                              \
+    }                                                                          \
+    return (type*)cursor->stack[cursor->depth-1];                              \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_first(type **root, struct aat_cursor *cursor) {          \
+    cursor->depth = 0;                                                         \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        cursor->stack[cursor->depth++] = node;                                 \
+        node = prefix##_left(node);                                            \
+    }                                                                          \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_last(type **root, struct aat_cursor *cursor) {           \
+    cursor->depth = 0;                                                         \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        cursor->stack[cursor->depth++] = node;                                 \
+        node = prefix##_right(node);                                           \
+    }                                                                          \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_seek(type **root, struct aat_cursor *cursor,             \
+    type *key)                                                                 \
+{                                                                              \
+    int found = 0;                                                             \
+    cursor->depth = 0;                                                         \
+    type *node = *root;                                                        \
+    while (node) {                                                             \
+        cursor->stack[cursor->depth++] = node;                                 \
+        prefix##_prefetch(node);                                               \
+        if (prefix##_order(key, node) > 0) {                                   \
+            node = prefix##_right(node);                                       \
+        } else {                                                               \
+            found = cursor->depth;                                             \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, cursor->depth);                                    \
+    cursor->depth = found;                                                     \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_next(struct aat_cursor *cursor) {                        \
+    type *node = prefix##_cursor_item(cursor);                                 \
+    if (node) {                                                                \
+        if (prefix##_right(node)) {                                            \
+            node = prefix##_right(node);                                       \
+            while (node) {                                                     \
+                cursor->stack[cursor->depth++] = node;                         \
+                node = prefix##_left(node);                                    \
+            }                                                                  \
+        } else {                                                               \
+            type *parent;                                                      \
+            do {                                                               \
+                node = (type*)cursor->stack[--cursor->depth];                  \
+                parent = prefix##_cursor_item(cursor);                         \
+            } while (parent && prefix##_right(parent) == node);                \
+        }                                                                      \
+    }                                                                          \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_prev(struct aat_cursor *cursor) {                        \
+    type *node = prefix##_cursor_item(cursor);                                 \
+    if (node) {                                                                \
+        if (prefix##_left(node)) {                                             \
+            node = prefix##_left(node);                                        \
+            while (node) {                                                     \
+                cursor->stack[cursor->depth++] = node;                         \
+                node = prefix##_right(node);                                   \
+            }                                                                  \
+        } else {                                                               \
+            type *parent;                                                      \
+            do {                                                               \
+                node = (type*)cursor->stack[--cursor->depth];                  \
+                parent = prefix##_cursor_item(cursor);                         \
+            } while (parent && prefix##_left(parent) == node);                 \
+        }                                                                      \
+    }                                                                          \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_remove(type **root, struct aat_cursor *cursor) {         \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    type *node = prefix##_cursor_item(cursor);                                 \
+    if (!node) {                                                               \
+        return 0;                                                              \
+    }                                                                          \
+    int depth = cursor->depth-1;                                               \
+    for (int i = 0; i < depth; i++) {                                          \
+        path[i] = (type*)cursor->stack[i];                                     \
+    }                                                                          \
+    cursor->depth = 0;                                                         \
+    return prefix##_delete_path(root, path, depth, node);                      \
+}                                                                              \
+                                                                               \
+static int prefix##_climb(struct aat_cursor *cursor, type *key, int inclusive, \
+    int *found)                                                                \
+{                                                                              \
+    int k = cursor->depth-1;                                                   \
+    *found = 0;                                                                \
+    if (k < 0) {                                                               \
+        return 0;                                                              \
+    }                                                                          \
+    for (;;) {                                                                 \
+        int lo = -1;                                                           \
+        int hi = -1;                                                           \
+        for (int j = k-1; j >= 0 && (lo == -1 || hi == -1); j--) {             \
+            type *node = (type*)cursor->stack[j];                              \
+            if (prefix##_left(node) == cursor->stack[j+1]) {                   \
+                hi = hi == -1 ? j : hi;                                        \
+            } else {                                                           \
+                lo = lo == -1 ? j : lo;                                        \
+            }                                                                  \
+        }                                                                      \
+        if (lo != -1 && prefix##_order(key, (type*)cursor->stack[lo]) <= 0) {  \
+            k = lo;                                                            \
+            continue;                                                          \
+        }                                                                      \
+        if (hi != -1) {                                                        \
+            int cmp = prefix##_order(key, (type*)cursor->stack[hi]);           \
+            if (cmp > 0 || (cmp == 0 && !inclusive)) {                         \
+                k = hi;                                                        \
+                continue;                                                      \
+            }                                                                  \
+        }                                                                      \
+        *found = hi+1;                                                         \
+        return k+1;                                                            \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+type *prefix##_cursor_seek_from(type **root, struct aat_cursor *cursor,        \
+    type *key)                                                                 \
+{                                                                              \
+    int found;                                                                 \
+    cursor->depth = prefix##_climb(cursor, key, 1, &found);                    \
+    type *node = *root;                                                        \
+    if (cursor->depth > 0) {                                                   \
+        node = (type*)cursor->stack[--cursor->depth];                          \
+    }                                                                          \
+    while (node) {                                                             \
+        cursor->stack[cursor->depth++] = node;                                 \
+        prefix##_prefetch(node);                                               \
+        if (prefix##_order(key, node) > 0) {                                   \
+            node = prefix##_right(node);                                       \
+        } else {                                                               \
+            found = cursor->depth;                                             \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+    }                                                                          \
+    AAT_STATS_DEPTH(prefix, cursor->depth);                                    \
+    cursor->depth = found;                                                     \
+    return prefix##_cursor_item(cursor);                                       \
+}                                                                              \
+                                                                               \
+type *prefix##_search_from(type **root, struct aat_cursor *cursor,             \
+    type *key)                                                                 \
+{                                                                              \
+    type *item = prefix##_cursor_seek_from(root, cursor, key);                 \
+    return item && prefix##_order(key, item) == 0 ? item : 0;                  \
+}                                                                              \
+                                                                               \
+type *prefix##_insert_hint(type **root, struct aat_cursor *cursor,             \
+    type *item)                                                                \
+{                                                                              \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int found;                                                                 \
+    int pathlen = prefix##_climb(cursor, item, 0, &found);                     \
+    for (int i = 0; i < pathlen; i++) {                                        \
+        path[i] = (type*)cursor->stack[i];                                     \
+    }                                                                          \
+    type *prev = prefix##_insert_path(root, path, &pathlen, item, 0);          \
+    for (int i = 0; i < pathlen; i++) {                                        \
+        cursor->stack[i] = path[i];                                            \
+    }                                                                          \
+    cursor->depth = pathlen;                                                   \
+    return prev;                                                               \
+}                                                                              \
+                                                                               \
+size_t prefix##_count_equal(type **root, type *key) {                          \
+    struct aat_cursor cursor;                                                  \
+    size_t count = 0;                                                          \
+    type *item = prefix##_cursor_seek(root, &cursor, key);                     \
+    while (item && prefix##_order(key, item) == 0) {                           \
+        count++;                                                               \
+        item = prefix##_cursor_next(&cursor);                                  \
+    }                                                                          \
+    return count;                                                              \
+}                                                                              \
+                                                                               \
+void prefix##_scan(type **root, type *lo, type *hi,                            \
+    int (*iter)(type *item, void *udata), void *udata)                         \
+{                                                                              \
+    struct aat_cursor cursor;                                                  \
+    if (lo && hi && prefix##_order(lo, hi) >= 0) {                             \
+        return;                                                                \
+    }                                                                          \
+    type *end = hi ? prefix##_iter(root, hi) : 0;                              \
+    type *item = lo ? prefix##_cursor_seek(root, &cursor, lo) :                \
+        prefix##_cursor_first(root, &cursor);                                  \
+    while (item != end) {                                                      \
+        if (!iter(item, udata)) {                                              \
+            return;                                                            \
+        }                                                                      \
+        item = prefix##_cursor_next(&cursor);                                  \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+void prefix##_scan_reverse(type **root, type *lo, type *hi,                    \
+    int (*iter)(type *item, void *udata), void *udata)                         \
+{                                                                              \
+    struct aat_cursor cursor;                                                  \
+    if (lo && hi && prefix##_order(lo, hi) >= 0) {                             \
+        return;                                                                \
+    }                                                                          \
+    type *first = lo ? prefix##_iter(root, lo) : prefix##_first(root);         \
+    type *item = hi ? prefix##_cursor_seek(root, &cursor, hi) : 0;             \
+    if (item == first) {                                                       \
+        return;                                                                \
+    }                                                                          \
+    item = item ? prefix##_cursor_prev(&cursor) :                              \
+        prefix##_cursor_last(root, &cursor);                                   \
+    while (iter(item, udata) && item != first) {                               \
+        item = prefix##_cursor_prev(&cursor);                                  \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_join0(type *left_root, type *pivot, type *right_root) {  \
+    type *path[AAT_MAXHEIGHT];                                                 \
+    int depth = 0;                                                             \
+    int left_level = left_root ? prefix##_level(left_root) : 0;                \
+    int right_level = right_root ? prefix##_level(right_root) : 0;             \
+    type *root;                                                                \
+    if (left_level == right_level) {                                           \
+        prefix##_setleft(pivot, left_root);                                    \
+        prefix##_setright(pivot, right_root);                                  \
+        prefix##_setlevel(pivot, left_level+1);                                \
+        prefix##_refresh(pivot);                                               \
+        return pivot;                                                          \
+    } else if (left_level > right_level) {                                     \
+        root = left_root;                                                      \
+        type *node = left_root;                                                \
+        while (prefix##_level(node) > right_level+1 ||                         \
+            (prefix##_right(node) &&                                           \
+                prefix##_level(prefix##_right(node)) > right_level))           \
+        {                                                                      \
+            path[depth++] = node;                                              \
+            node = prefix##_right(node);                                       \
+        }                                                                      \
+        prefix##_setleft(pivot, prefix##_right(node));                         \
+        prefix##_setright(pivot, right_root);                                  \
+        prefix##_setlevel(pivot, right_level+1);                               \
+        prefix##_refresh(pivot);                                               \
+        prefix##_setright(node, pivot);                                        \
+        path[depth++] = node;                                                  \
+    } else {                                                                   \
+        root = right_root;                                                     \
+        type *node = right_root;                                               \
+        while (prefix##_level(node) > left_level+1) {                          \
+            path[depth++] = node;                                              \
+            node = prefix##_left(node);                                        \
+        }                                                                      \
+        prefix##_setleft(pivot, left_root);                                    \
+        prefix##_setright(pivot, prefix##_left(node));                         \
+        prefix##_setlevel(pivot, left_level+1);                                \
+        prefix##_refresh(pivot);                                               \
+        prefix##_setleft(node, pivot);                                         \
+        path[depth++] = node;                                                  \
+    }                                                                          \
+    while (depth > 0) {                                                        \
+        type *node = path[--depth];                                            \
+        prefix##_refresh(node);                                                \
+        prefix##_replace(&root, depth > 0 ? path[depth-1] : 0, node,           \
+            prefix##_split(prefix##_skew(node)));                              \
+    }                                                                          \
+    return root;                                                               \
+}                                                                              \
+                                                                               \
+static type *prefix##_concat0(type *left_root, type *right_root) {             \
+    if (!left_root) {                                                          \
+        return right_root;                                                     \
+    }                                                                          \
+    if (!right_root) {                                                         \
+        return left_root;                                                      \
+    }                                                                          \
+    type *pivot = prefix##_delete_last(&left_root);                            \
+    return prefix##_join0(left_root, pivot, right_root);                       \
+}                                                                              \
+                                                                               \
+static void prefix##_split0(type *node, type *key, type **left_root,           \
+    type **right_root)                                                         \
+{                                                                              \
+    if (!node) {                                                               \
+        *left_root = 0;                                                        \
+        *right_root = 0;                                                       \
+    } else if (prefix##_order(key, node) <= 0) {                               \
+        type *right_node = prefix##_right(node);                               \
+        prefix##_split0(prefix##_left(node), key, left_root, right_root);      \
+        *right_root = prefix##_join0(*right_root, node, right_node);           \
+    } else {                                                                   \
+        type *left_node = prefix##_left(node);                                 \
+        prefix##_split0(prefix##_right(node), key, left_root, right_root);     \
+        *left_root = prefix##_join0(left_node, node, *left_root);              \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+type *prefix##_delete_range(type **root, type *lo, type *hi) {                 \
+    type *left_root = 0;                                                       \
+    type *mid_root = *root;                                                    \
+    type *right_root = 0;                                                      \
+    if (lo && hi && prefix##_order(lo, hi) >= 0) {                             \
+        return 0;                                                              \
+    }                                                                          \
+    if (lo) {                                                                  \
+        prefix##_split0(mid_root, lo, &left_root, &mid_root);                  \
+    }                                                                          \
+    if (hi) {                                                                  \
+        prefix##_split0(mid_root, hi, &mid_root, &right_root);                 \
+    }                                                                          \
+    prefix##_setroot(root, prefix##_concat0(left_root, right_root));           \
+    prefix##_setroot(&mid_root, mid_root);                                     \
+    return mid_root;                                                           \
+}                                                                              \
+                                                                               \
+void prefix##_split_at(type **root, type *key, type **left, type **right) {    \
+    type *left_root;                                                           \
+    type *right_root;                                                          \
+    type *node = *root;                                                        \
+    prefix##_setroot(root, 0);                                                 \
+    prefix##_split0(node, key, &left_root, &right_root);                       \
+    prefix##_setroot(left, left_root);                                         \
+    prefix##_setroot(right, right_root);                                       \
+}                                                                              \
+                                                                               \
+void prefix##_join(type **left, type *pivot, type **right) {                   \
+    type *right_root = *right;                                                 \
+    prefix##_setroot(right, 0);                                                \
+    if (pivot) {                                                               \
+        prefix##_setroot(left, prefix##_join0(*left, pivot, right_root));      \
+    } else {                                                                   \
+        prefix##_setroot(left, prefix##_concat0(*left, right_root));           \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static type *prefix##_split3(type *node, type *key, type **left_root,          \
+    type **right_root)                                                         \
+{                                                                              \
+    if (!node) {                                                               \
+        *left_root = 0;                                                        \
+        *right_root = 0;                                                       \
+        return 0;                                                              \
+    }                                                                          \
+    int cmp = prefix##_order(key, node);                                       \
+    type *left_node = prefix##_left(node);                                     \
+    type *right_node = prefix##_right(node);                                   \
+    type *equal = node;                                                        \
+    if (cmp < 0) {                                                             \
+        equal = prefix##_split3(left_node, key, left_root, right_root);        \
+        *right_root = prefix##_join0(*right_root, node, right_node);           \
+    } else if (cmp > 0) {                                                      \
+        equal = prefix##_split3(right_node, key, left_root, right_root);       \
+        *left_root = prefix##_join0(left_node, node, *left_root);              \
+    } else {                                                                   \
+        *left_root = left_node;                                                \
+        *right_root = right_node;                                              \
+    }                                                                          \
+    return equal;                                                              \
+}                                                                              \
+                                                                               \
+static type *prefix##_union0(type *node, type *other,                          \
+    type *(*conflict)(type *item, type *other_item, void *udata), void *udata, \
+    type **removed)                                                            \
+{                                                                              \
+    if (!node) {                                                               \
+        return other;                                                          \
+    }                                                                          \
+    if (!other) {                                                              \
+        return node;                                                           \
+    }                                                                          \
+    type *other_left = prefix##_left(other);                                   \
+    type *other_right = prefix##_right(other);                                 \
+    type *left_root, *right_root;                                              \
+    type *equal = prefix##_split3(node, other, &left_root, &right_root);       \
+    left_root = prefix##_union0(left_root, other_left, conflict, udata,        \
+        removed);                                                              \
+    type *pivot = other;                                                       \
+    if (equal) {                                                               \
+        pivot = conflict ? conflict(equal, other, udata) : equal;              \
+        type *loser = pivot == equal ? other : equal;                          \
+        *removed = prefix##_join0(*removed, loser, 0);                         \
+    }                                                                          \
+    right_root = prefix##_union0(right_root, other_right, conflict, udata,     \
+        removed);                                                              \
+    return prefix##_join0(left_root, pivot, right_root);                       \
+}                                                                              \
+                                                                               \
+static type *prefix##_intersect0(type *node, type *other, type **removed) {    \
+    if (!node) {                                                               \
+        return 0;                                                              \
+    }                                                                          \
+    if (!other) {                                                              \
+        *removed = prefix##_concat0(*removed, node);                           \
+        return 0;                                                              \
+    }                                                                          \
+    type *left_root, *right_root;                                              \
+    type *equal = prefix##_split3(node, other, &left_root, &right_root);       \
+    left_root = prefix##_intersect0(left_root, prefix##_left(other), removed); \
+    right_root = prefix##_intersect0(right_root, prefix##_right(other),        \
+        removed);                                                              \
+    if (equal) {                                                               \
+        return prefix##_join0(left_root, equal, right_root);                   \
+    }                                                                          \
+    return prefix##_concat0(left_root, right_root);                            \
+}                                                                              \
+                                                                               \
+static type *prefix##_difference0(type *node, type *other, type **removed) {   \
+    if (!node || !other) {                                                     \
+        return node;                                                           \
+    }                                                                          \
+    type *left_root, *right_root;                                              \
+    type *equal = prefix##_split3(node, other, &left_root, &right_root);       \
+    left_root = prefix##_difference0(left_root, prefix##_left(other),          \
+        removed);                                                              \
+    if (equal) {                                                               \
+        *removed = prefix##_join0(*removed, equal, 0);                         \
+    }                                                                          \
+    right_root = prefix##_difference0(right_root, prefix##_right(other),       \
+        removed);                                                              \
+    return prefix##_concat0(left_root, right_root);                            \
+}                                                                              \
+                                                                               \
+type *prefix##_union(type **root, type **other,                                \
+    type *(*conflict)(type *item, type *other_item, void *udata), void *udata) \
+{                                                                              \
+    type *removed = 0;                                                         \
+    type *node = *root;                                                        \
+    type *other_root = *other;                                                 \
+    prefix##_setroot(other, 0);                                                \
+    node = prefix##_union0(node, other_root, conflict, udata, &removed);       \
+    prefix##_setroot(root, node);                                              \
+    prefix##_setroot(&removed, removed);                                       \
+    return removed;                                                            \
+}                                                                              \
+                                                                               \
+type *prefix##_intersect(type **root, type **other) {                          \
+    type *removed = 0;                                                         \
+    type *node = prefix##_intersect0(*root, *other, &removed);                 \
+    prefix##_setroot(root, node);                                              \
+    prefix##_setroot(&removed, removed);                                       \
+    return removed;                                                            \
+}                                                                              \
+                                                                               \
+type *prefix##_difference(type **root, type **other) {                         \
+    type *removed = 0;                                                         \
+    type *node = prefix##_difference0(*root, *other, &removed);                \
+    prefix##_setroot(root, node);                                              \
+    prefix##_setroot(&removed, removed);                                       \
+    return removed;                                                            \
+}                                                                              \
 
 #endif // AAT_H
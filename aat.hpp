@@ -0,0 +1,405 @@
+// https://github.com/tidwall/aatree
+//
+// Copyright 2023 Joshua J Baker. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file.
+
+// Single header file for using aat binary search trees from C++17. The tree
+// template generates the same functions as the AAT_IMPL variants of aat.h, as
+// members of a class that is specialized for each item type, hook and compare
+// functor, so that the compare is always inlined.
+
+#ifndef AAT_HPP
+#define AAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include "aat.h"
+
+namespace aat {
+
+// The links of an item in a tree, which is a member of the item type.
+template <class T>
+struct hook {
+    T *left = nullptr;
+    T *right = nullptr;
+    int level = 0;
+};
+
+// Same as hook with a link to the parent, for trees with the parent_links
+// option.
+template <class T>
+struct parent_hook {
+    T *left = nullptr;
+    T *right = nullptr;
+    T *parent = nullptr;
+    int level = 0;
+};
+
+// Orders items with the < operator. A compare functor returns less than zero,
+// zero, or greater than zero, the same as the compare function of aat.h.
+template <class T>
+struct less_compare {
+    int operator()(const T &a, const T &b) const {
+        return a < b ? -1 : b < a;
+    }
+};
+
+// The options of a tree, which can be changed by deriving from this struct.
+//
+//   parent_links: keeps a parent link in each item, which must use
+//                 parent_hook, making remove and iterating with prev and next
+//                 take no compares.
+//   augmented: calls the static update function of the options whenever the
+//              children of an item change, after the children themselves have
+//              been updated, with the signature 'void update(T *item)'.
+//   stats: counts the operations of the tree in the struct returned by the
+//          stats function, the same as AAT_STATS does for aat.h.
+struct options {
+    static constexpr bool parent_links = false;
+    static constexpr bool augmented = false;
+    static constexpr bool stats = false;
+};
+
+// The core functions are generated in this file with their stats hooks going
+// to members of the tree, whether or not AAT_STATS is defined.
+#pragma push_macro("AAT_STATS_ADD")
+#pragma push_macro("AAT_STATS_DEPTH")
+#pragma push_macro("AAT_STATS_STEP")
+#pragma push_macro("AAT_STATS_IMPL")
+#undef AAT_STATS_ADD
+#undef AAT_STATS_DEPTH
+#undef AAT_STATS_STEP
+#undef AAT_STATS_IMPL
+#define AAT_STATS_ADD(prefix, field) prefix##_stats_add(&aat_stats::field)
+#define AAT_STATS_DEPTH(prefix, depth) prefix##_stats_depth(depth)
+#define AAT_STATS_STEP(depth) ((depth)++)
+#define AAT_STATS_IMPL(prefix)
+
+// An intrusive tree of items of type T, linked through the hook member. The
+// tree never allocates and items must stay in place while they are in it.
+// Items are passed by pointer and keys by reference, like in aat.h, and any
+// function that takes a key only calls the compare functor on it.
+template <class T, auto Hook, class Compare = less_compare<T>,
+    class Options = options>
+class tree {
+    struct core {
+        static auto &link(T *node) {
+            return node->*Hook;
+        }
+
+        static T *impl_left(T *node) {
+            return link(node).left;
+        }
+
+        static T *impl_right(T *node) {
+            return link(node).right;
+        }
+
+        static int impl_level(T *node) {
+            return link(node).level;
+        }
+
+        static void impl_setlevel(T *node, int new_level) {
+            link(node).level = new_level;
+        }
+
+        static void impl_setleft(T *node, T *child) {
+            link(node).left = child;
+            if constexpr (Options::parent_links) {
+                if (child) {
+                    link(child).parent = node;
+                }
+            }
+        }
+
+        static void impl_setright(T *node, T *child) {
+            link(node).right = child;
+            if constexpr (Options::parent_links) {
+                if (child) {
+                    link(child).parent = node;
+                }
+            }
+        }
+
+        static void impl_setroot(T **root, T *node) {
+            *root = node;
+            if constexpr (Options::parent_links) {
+                if (node) {
+                    link(node).parent = nullptr;
+                }
+            }
+        }
+
+        static void impl_clear(T *node) {
+            if (node) {
+                link(node).left = nullptr;
+                link(node).right = nullptr;
+                link(node).level = 0;
+                if constexpr (Options::parent_links) {
+                    link(node).parent = nullptr;
+                }
+            }
+        }
+
+        static void impl_refresh(T *node) {
+            if constexpr (Options::augmented) {
+                Options::update(node);
+            } else {
+                (void)node;
+            }
+        }
+
+        static int impl_parent_links() {
+            return Options::parent_links;
+        }
+
+        static int impl_compare(T *a, T *b) {
+            return Compare()(*a, *b);
+        }
+
+        static T *impl_parent(T **root, T *item) {
+            if constexpr (Options::parent_links) {
+                (void)root;
+                return link(item).parent;
+            } else {
+                aat_cursor cursor;
+                if (!impl_locate(root, item, &cursor) || cursor.depth < 2) {
+                    return nullptr;
+                }
+                return (T*)cursor.stack[cursor.depth-2];
+            }
+        }
+
+        static aat_stats &impl_stats() {
+            static thread_local aat_stats stats;
+            return stats;
+        }
+
+        static void impl_stats_add(uint64_t aat_stats::*field) {
+            if constexpr (Options::stats) {
+                impl_stats().*field += 1;
+            } else {
+                (void)field;
+            }
+        }
+
+        static void impl_stats_depth(int depth) {
+            if constexpr (Options::stats) {
+                aat_stats &stats = impl_stats();
+                stats.descents++;
+                stats.depth_total += depth;
+                stats.depths[depth < AAT_STATS_DEPTHS ? depth :
+                    AAT_STATS_DEPTHS-1]++;
+            } else {
+                (void)depth;
+            }
+        }
+
+        AAT_CORE(impl, T, impl_compare)
+    };
+
+    T *root_ = nullptr;
+
+public:
+    // A bidirectional iterator that holds the path from the root to its item,
+    // so that stepping to the next or previous item takes no compares. Any
+    // change to the tree invalidates its iterators, the same as a cursor.
+    class iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        iterator() {
+            cursor_.depth = 0;
+        }
+
+        iterator(const iterator &other) {
+            *this = other;
+        }
+
+        iterator &operator=(const iterator &other) {
+            root_ = other.root_;
+            cursor_.depth = other.cursor_.depth;
+            std::memcpy(cursor_.stack, other.cursor_.stack,
+                sizeof(void*)*cursor_.depth);
+            return *this;
+        }
+
+        T &operator*() const {
+            return *get();
+        }
+
+        T *operator->() const {
+            return get();
+        }
+
+        // Returns the item, or nullptr at the end.
+        T *get() const {
+            return core().impl_cursor_item(&cursor_);
+        }
+
+        iterator &operator++() {
+            core().impl_cursor_next(&cursor_);
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        // Stepping back from the end goes to the last item.
+        iterator &operator--() {
+            if (cursor_.depth == 0) {
+                core().impl_cursor_last(root_, &cursor_);
+            } else {
+                core().impl_cursor_prev(&cursor_);
+            }
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator prev = *this;
+            --*this;
+            return prev;
+        }
+
+        bool operator==(const iterator &other) const {
+            return get() == other.get();
+        }
+
+        bool operator!=(const iterator &other) const {
+            return get() != other.get();
+        }
+
+    private:
+        friend class tree;
+
+        explicit iterator(T **root) : root_(root) {
+            cursor_.depth = 0;
+        }
+
+        T **root_ = nullptr;
+        mutable aat_cursor cursor_;
+    };
+
+    using value_type = T;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+
+    tree() = default;
+    tree(const tree &) = delete;
+    tree &operator=(const tree &) = delete;
+
+    tree(tree &&other) noexcept : root_(other.root_) {
+        other.root_ = nullptr;
+    }
+
+    tree &operator=(tree &&other) noexcept {
+        root_ = other.root_;
+        other.root_ = nullptr;
+        return *this;
+    }
+
+    // Inserts the item, returning the item that it replaced, if any.
+    T *insert(T *item) {
+        return core().impl_insert(&root_, item);
+    }
+
+    // Inserts the item after any items that are equal to it.
+    void insert_multi(T *item) {
+        core().impl_insert_multi(&root_, item);
+    }
+
+    // Deletes and returns the item that is equal to the key, if any.
+    T *erase(const T &key) {
+        return core().impl_delete(&root_, const_cast<T*>(&key));
+    }
+
+    // Deletes the item itself, which must be in the tree.
+    T *remove(T *item) {
+        return core().impl_remove_node(&root_, item);
+    }
+
+    // Returns the item that is equal to the key, if any.
+    T *find(const T &key) {
+        return core().impl_search(&root_, const_cast<T*>(&key));
+    }
+
+    // Returns an iterator at the first item that is not less than the key.
+    iterator lower_bound(const T &key) {
+        iterator iter(&root_);
+        core().impl_cursor_seek(&root_, &iter.cursor_, const_cast<T*>(&key));
+        return iter;
+    }
+
+    T *first() {
+        return core().impl_first(&root_);
+    }
+
+    T *last() {
+        return core().impl_last(&root_);
+    }
+
+    T *pop_first() {
+        return core().impl_delete_first(&root_);
+    }
+
+    T *pop_last() {
+        return core().impl_delete_last(&root_);
+    }
+
+    bool empty() const {
+        return !root_;
+    }
+
+    // Removes every item in O(n) without rebalancing.
+    void clear() {
+        core().impl_clear_all(&root_, nullptr, nullptr);
+    }
+
+    iterator begin() {
+        iterator iter(&root_);
+        core().impl_cursor_first(&root_, &iter.cursor_);
+        return iter;
+    }
+
+    iterator end() {
+        return iterator(&root_);
+    }
+
+    reverse_iterator rbegin() {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return reverse_iterator(begin());
+    }
+
+    // Returns the root, for reading the links of the items directly.
+    T *root() const {
+        return root_;
+    }
+
+    // Returns the counters of the calling thread for this kind of tree, which
+    // can be read or cleared at any time.
+    static aat_stats &stats() {
+        static_assert(Options::stats, "the stats option is not on");
+        return core::impl_stats();
+    }
+};
+
+#pragma pop_macro("AAT_STATS_ADD")
+#pragma pop_macro("AAT_STATS_DEPTH")
+#pragma pop_macro("AAT_STATS_STEP")
+#pragma pop_macro("AAT_STATS_IMPL")
+
+} // namespace aat
+
+#endif // AAT_HPP
@@ -11,6 +11,13 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#define AAT_POOL
 #include "aat.h"
 
 struct aat_node {
@@ -24,8 +31,20 @@ static int aat_compare(struct aat_node *a, struct aat_node *b) {
 
 #ifdef AAT_DEV
 AAT_DEF(extern, aat, struct aat_node)
+AAT_DEF_TREE(extern, aat, struct aat_node)
 #else
 AAT_IMPL(aat, struct aat_node, left, right, level, aat_compare)
+AAT_DEF_TREE(extern, aat, struct aat_node)
+AAT_IMPL_TREE(aat, struct aat_node)
+#endif
+
+static int aat_getkey(struct aat_node *node) {
+    return node->key;
+}
+
+AAT_IMPL_FREEZE(aat, struct aat_node, int, aat_getkey)
+#ifdef AAT_ATOMIC
+AAT_IMPL_SEQLOCK(aat, struct aat_node)
 #endif
 
 static void aat_valid0(struct aat_node *T, struct aat_node *P, int level, 
@@ -130,77 +149,2174 @@ static void shuffle(void *array, size_t numels, size_t elsize) {
     }
 }
 
-#define key_node(i) (&(struct aat_node){.key=(i)}) 
+#define key_node(i) (&(struct aat_node){.key=(i)}) 
+
+// Generates a validity check for trees made with one of the AAT_IMPL variants,
+// using the same rules as aat_valid. Returns the number of nodes.
+#define VALID_IMPL(prefix, type, compare)                                      \
+static void prefix##_valid0(type *T, type *P, type **last, int *count) {       \
+    int level = prefix##_level(T);                                             \
+    type *left = prefix##_left(T);                                             \
+    type *right = prefix##_right(T);                                           \
+    if (!left && !right) {                                                     \
+        assert(level == 1);                                                    \
+    }                                                                          \
+    if (left) {                                                                \
+        assert(prefix##_level(left) == level-1);                               \
+    }                                                                          \
+    if (right) {                                                               \
+        assert(prefix##_level(right) == level ||                               \
+            prefix##_level(right) == level-1);                                 \
+        if (P) {                                                               \
+            assert(prefix##_level(right) < prefix##_level(P));                 \
+        }                                                                      \
+    }                                                                          \
+    if (level > 1) {                                                           \
+        assert(left && right);                                                 \
+    }                                                                          \
+    if (left) {                                                                \
+        prefix##_valid0(left, T, last, count);                                 \
+    }                                                                          \
+    if (*last) {                                                               \
+        assert(compare(*last, T) < 0);                                         \
+    }                                                                          \
+    *last = T;                                                                 \
+    (*count)++;                                                                \
+    if (right) {                                                               \
+        prefix##_valid0(right, T, last, count);                                \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static int prefix##_valid(type **root) {                                       \
+    int count = 0;                                                             \
+    if (*root) {                                                               \
+        type *last = 0;                                                        \
+        prefix##_valid0(*root, 0, &last, &count);                              \
+    }                                                                          \
+    return count;                                                              \
+}                                                                              \
+
+struct aatp_node {
+    AAT_FIELDS_PARENT(struct aatp_node, left, right, parent, level);
+    int key;
+};
+
+static int aatp_compares = 0;
+
+static int aatp_compare(struct aatp_node *a, struct aatp_node *b) {
+    aatp_compares++;
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+AAT_IMPL_PARENT(aatp, struct aatp_node, left, right, parent, level, 
+    aatp_compare)
+VALID_IMPL(aatp, struct aatp_node, aatp_compare)
+
+static void aatp_valid_parents(struct aatp_node *node) {
+    if (node->left) {
+        assert(node->left->parent == node);
+        aatp_valid_parents(node->left);
+    }
+    if (node->right) {
+        assert(node->right->parent == node);
+        aatp_valid_parents(node->right);
+    }
+}
+
+static void aatp_valid_all(struct aatp_node **root, int count) {
+    assert(aatp_valid(root) == count);
+    if (*root) {
+        assert(!(*root)->parent);
+        aatp_valid_parents(*root);
+    }
+}
+
+static struct aatp_node *aatp_copy(struct aatp_node *item, void *udata) {
+    struct aatp_node **next = udata;
+    (*next)->key = item->key;
+    return (*next)++;
+}
+
+static void test_parent(void) {
+    int N = 1000;
+    struct aatp_node *root = 0;
+    struct aatp_node *nodes = malloc(N*sizeof(struct aatp_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatp_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    shuffle(nodes, N, sizeof(struct aatp_node));
+    for (int i = 0; i < N; i++) {
+        assert(!aatp_insert(&root, &nodes[i]));
+        aatp_valid_all(&root, i+1);
+    }
+    struct aatp_node *item = aatp_first(&root);
+    for (int i = 0; i < N; i++) {
+        assert(item && item->key == i);
+        item = aatp_next(&root, item);
+    }
+    assert(!item);
+    item = aatp_last(&root);
+    for (int i = N-1; i >= 0; i--) {
+        assert(item && item->key == i);
+        item = aatp_prev(&root, item);
+    }
+    assert(!item);
+
+    // replace every other item
+    struct aatp_node *replacements = malloc(N*sizeof(struct aatp_node));
+    assert(replacements);
+    memset(replacements, 0, N*sizeof(struct aatp_node));
+    for (int i = 0; i < N; i += 2) {
+        replacements[i].key = i;
+        struct aatp_node *prev = aatp_insert(&root, &replacements[i]);
+        assert(prev && prev->key == i && !prev->parent);
+        aatp_valid_all(&root, N);
+    }
+
+    // delete in random order, mixing with delete_first and delete_last
+    int *keys = malloc(N*sizeof(int));
+    assert(keys);
+    for (int i = 0; i < N; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, N, sizeof(int));
+    int count = N;
+    for (int i = 0; i < N; i++) {
+        struct aatp_node *deleted;
+        if (i % 3 == 0) {
+            deleted = aatp_delete_first(&root);
+        } else if (i % 3 == 1) {
+            deleted = aatp_delete_last(&root);
+        } else {
+            deleted = aatp_delete(&root, 
+                &(struct aatp_node){ .key = keys[i] });
+        }
+        if (deleted) {
+            assert(!deleted->parent);
+            count--;
+        }
+        aatp_valid_all(&root, count);
+    }
+    while (aatp_delete_first(&root)) {
+        count--;
+    }
+    assert(count == 0);
+
+    // build from sorted items
+    struct aatp_node **items = malloc(N*sizeof(struct aatp_node*));
+    assert(items);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+        items[i] = &nodes[i];
+    }
+    aatp_build_sorted(&root, items, N);
+    aatp_valid_all(&root, N);
+
+    // split and join, keeping the parent links of every tree
+    for (int i = 0; i < 100; i++) {
+        aatp_build_sorted(&root, items, N);
+        int key = rand()%(N+1);
+        struct aatp_node *left, *right;
+        aatp_split_at(&root, &(struct aatp_node){ .key = key }, &left, &right);
+        aatp_valid_all(&root, 0);
+        aatp_valid_all(&left, key);
+        aatp_valid_all(&right, N-key);
+        aatp_join(&left, aatp_delete_last(&left), &right);
+        aatp_valid_all(&left, N);
+        aatp_valid_all(&right, 0);
+    }
+
+    // remove nodes with duplicate keys by pointer, without comparing
+    root = 0;
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i%10;
+        aatp_insert_multi(&root, &nodes[i]);
+    }
+    // a node from another tree is not removed
+    struct aatp_node *other = 0;
+    struct aatp_node foreign[2] = { { .key = 3 }, { .key = 4 } };
+    aatp_insert(&other, &foreign[0]);
+    aatp_insert(&other, &foreign[1]);
+    assert(!aatp_remove_node(&root, &foreign[0]));
+    assert(!aatp_remove_node(&root, &foreign[1]));
+    aatp_valid_parents(root);
+    assert(!root->parent);
+    int n = 0;
+    for (struct aatp_node *item = aatp_first(&root); item;
+        item = aatp_next(&root, item))
+    {
+        n++;
+    }
+    assert(n == N);
+    aatp_valid_all(&other, 2);
+    shuffle(keys, N, sizeof(int));
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aatp_remove_node(&root, &nodes[keys[i]]) == &nodes[keys[i]]);
+        assert(!aatp_remove_node(&root, &nodes[keys[i]]));
+        if (i%50 == 0) {
+            aatp_valid_parents(root);
+            assert(!root->parent);
+        }
+    }
+    assert(!root);
+    assert(aatp_compares == 0);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+
+    // relayout, keeping the parent links of the copy
+    aatp_build_sorted(&root, items, N);
+    struct aatp_node *dst = malloc(N*sizeof(struct aatp_node));
+    assert(dst);
+    assert(aatp_relayout(&root, dst) == (size_t)N);
+    aatp_valid_all(&root, N);
+    free(dst);
+
+    // delete ranges, keeping the parent links of both trees
+    for (int i = 0; i < 100; i++) {
+        aatp_build_sorted(&root, items, N);
+        int lo = rand()%(N+1);
+        int hi = lo+rand()%(N+1-lo);
+        struct aatp_node *removed = aatp_delete_range(&root, 
+            &(struct aatp_node){ .key = lo }, &(struct aatp_node){ .key = hi });
+        aatp_valid_all(&root, N-(hi-lo));
+        aatp_valid_all(&removed, hi-lo);
+    }
+
+    // insert and search from the previous position
+    struct aat_cursor cursor;
+    cursor.depth = 0;
+    root = 0;
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(!aatp_insert_hint(&root, &cursor, &nodes[i]));
+    }
+    aatp_valid_all(&root, N);
+    int hinted = aatp_compares;
+    root = 0;
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(!aatp_insert(&root, &nodes[i]));
+    }
+    assert(hinted*2 < aatp_compares);
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aatp_search(&root, &(struct aatp_node){ .key = i }) == 
+            &nodes[i]);
+    }
+    int plain = aatp_compares;
+    aatp_compares = 0;
+    cursor.depth = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aatp_search_from(&root, &cursor, 
+            &(struct aatp_node){ .key = i }) == &nodes[i]);
+    }
+    assert(aatp_compares*3 < plain*2);
+    for (int i = 0; i < N; i++) {
+        replacements[i].key = i;
+    }
+    shuffle(keys, N, sizeof(int));
+    for (int i = 0; i < N; i++) {
+        struct aatp_node *prev = aatp_insert_hint(&root, &cursor, 
+            &replacements[keys[i]]);
+        assert(prev == &nodes[keys[i]] && !prev->parent);
+        if (i%50 == 0) {
+            aatp_valid_all(&root, N);
+        }
+    }
+    aatp_valid_all(&root, N);
+
+    // clone without comparing, keeping the parent links
+    struct aatp_node *next = nodes;
+    struct aatp_node *croot = 0;
+    aatp_compares = 0;
+    assert(aatp_clone(&root, &croot, aatp_copy, 0, &next));
+    assert(aatp_compares == 0 && next == nodes+N);
+    aatp_valid_all(&croot, N);
+    aatp_clear_all(&croot, 0, 0);
+    assert(!croot && !nodes[0].parent && !nodes[0].left);
+    free(items);
+    free(keys);
+    free(replacements);
+    free(nodes);
+}
+
+#ifdef AAT_STATS
+static void aatp_valid_stats(struct aat_stats *stats) {
+    uint64_t descents = 0;
+    for (int i = 0; i < AAT_STATS_DEPTHS; i++) {
+        descents += stats->depths[i];
+    }
+    assert(descents == stats->descents);
+    assert(stats->compares == (uint64_t)aatp_compares);
+}
+
+static void test_stats(void) {
+    int N = 1000;
+    struct aatp_node *root = 0;
+    struct aatp_node *nodes = malloc(N*sizeof(struct aatp_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatp_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    shuffle(nodes, N, sizeof(struct aatp_node));
+    struct aat_stats *stats = aatp_stats();
+    memset(stats, 0, sizeof(struct aat_stats));
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        aatp_insert(&root, &nodes[i]);
+    }
+    aatp_valid_stats(stats);
+    assert(stats->descents == (uint64_t)N);
+    assert(stats->skews > 0 && stats->splits > 0);
+    assert(stats->decrease_levels == 0);
+
+    // a search visits one node for each compare
+    memset(stats, 0, sizeof(struct aat_stats));
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aatp_search(&root, &(struct aatp_node){ .key = i }));
+    }
+    aatp_valid_stats(stats);
+    assert(stats->descents == (uint64_t)N);
+    assert(stats->depth_total == stats->compares);
+    assert(stats->depths[0] == 0 && stats->depths[1] == 1);
+    assert(stats->skews == 0 && stats->splits == 0);
+
+    memset(stats, 0, sizeof(struct aat_stats));
+    aatp_compares = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aatp_delete(&root, &(struct aatp_node){ .key = i }));
+    }
+    assert(!root);
+    aatp_valid_stats(stats);
+    assert(stats->descents == (uint64_t)N);
+    assert(stats->decrease_levels > 0);
+    free(nodes);
+}
+#endif
+
+struct aatc_node {
+    AAT_FIELDS_COUNTED(struct aatc_node, left, right, level, count);
+    int key;
+};
+
+static int aatc_compare(struct aatc_node *a, struct aatc_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+AAT_IMPL_COUNTED(aatc, struct aatc_node, left, right, level, count, 
+    aatc_compare)
+VALID_IMPL(aatc, struct aatc_node, aatc_compare)
+
+static size_t aatc_valid_counts(struct aatc_node *node) {
+    if (!node) {
+        return 0;
+    }
+    size_t count = 1 + aatc_valid_counts(node->left) + 
+        aatc_valid_counts(node->right);
+    assert(node->count == count);
+    return count;
+}
+
+#define aatc_key(i) (&(struct aatc_node){.key=(i)})
+
+// Copies the key into the next node of an array.
+static struct aatc_node *aatc_copy(struct aatc_node *item, void *udata) {
+    struct aatc_node **next = udata;
+    (*next)->key = item->key;
+    return (*next)++;
+}
+
+AAT_DEF_PERSIST(static, aatc, struct aatc_node)
+AAT_IMPL_PERSIST(aatc, struct aatc_node)
+AAT_DEF_POOL(static, aatc, struct aatc_node)
+AAT_IMPL_POOL(aatc, struct aatc_node)
+
+// Copies nodes for persistent trees out of an array that is never reused, and
+// keeps a list of the nodes that were retired. Copies fail once fail_after
+// reaches zero.
+struct aatc_arena {
+    struct aatc_node *nodes;
+    int count;
+    int cap;
+    int fail_after;
+    struct aatc_node **retired;
+    int nretired;
+};
+
+static struct aatc_node *aatc_arena_copy(struct aatc_node *node, void *udata) {
+    struct aatc_arena *arena = udata;
+    if (arena->fail_after == 0) {
+        return 0;
+    }
+    arena->fail_after--;
+    assert(arena->count < arena->cap);
+    struct aatc_node *copy = &arena->nodes[arena->count++];
+    *copy = *node;
+    return copy;
+}
+
+static void aatc_arena_retire(struct aatc_node *node, void *udata) {
+    struct aatc_arena *arena = udata;
+    assert(arena->nretired < arena->cap);
+    arena->retired[arena->nretired++] = node;
+}
+
+static void aatc_same_keys(struct aatc_node **root, char *in, int n) {
+    assert(aatc_valid(root) == (int)aatc_valid_counts(*root));
+    size_t count = 0;
+    for (int i = 0; i < n; i++) {
+        struct aatc_node *item = aatc_search(root, aatc_key(i*2));
+        assert(in[i] ? item && item->key == i*2 : !item);
+        count += in[i];
+    }
+    assert(aatc_count(root) == count);
+}
+
+#ifdef AAT_PARALLEL
+AAT_DEF_PARALLEL(static, aatc, struct aatc_node)
+AAT_IMPL_PARALLEL(aatc, struct aatc_node)
+
+struct aatc_sum {
+    long long sum;
+    size_t count;
+};
+
+static void aatc_sum_fold(void *acc, struct aatc_node *item, void *udata) {
+    struct aatc_sum *sum = acc;
+    (void)udata;
+    sum->sum += item->key;
+    sum->count++;
+}
+
+static void aatc_sum_merge(void *acc, void *other, void *udata) {
+    struct aatc_sum *sum = acc;
+    struct aatc_sum *add = other;
+    (void)udata;
+    sum->sum += add->sum;
+    sum->count += add->count;
+}
+
+static void aatc_mark(struct aatc_node *item, void *udata) {
+    char *seen = udata;
+    seen[item->key/2]++;
+}
+
+static void test_parallel(void) {
+    int N = 200000;
+    struct aatc_node *nodes = malloc(N*sizeof(struct aatc_node));
+    struct aatc_node **items = malloc(N*sizeof(struct aatc_node*));
+    char *seen = malloc(N);
+    assert(nodes && items && seen);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+        items[i] = &nodes[i];
+    }
+    int sizes[] = { 0, 1, 2, 3, 10, 100, 1000, 4095, 4096, 65537, N };
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(int); i++) {
+        int n = sizes[i];
+        for (int threads = 0; threads <= 9; threads += 3) {
+            struct aatc_node *root = 0;
+            aatc_parallel_build_sorted(&root, items, n, threads);
+            assert(aatc_valid(&root) == n);
+            assert(aatc_valid_counts(root) == (size_t)n);
+            struct aatc_node *expect = 0;
+            aatc_build_sorted(&expect, items, n);
+            assert(root == expect);
+
+            memset(seen, 0, n);
+            aatc_parallel_foreach(&root, aatc_mark, seen, threads);
+            for (int j = 0; j < n; j++) {
+                assert(seen[j] == 1);
+            }
+
+            struct aatc_sum sums[9];
+            memset(sums, 0, sizeof(sums));
+            aatc_parallel_reduce(&root, sums, sizeof(struct aatc_sum), 
+                aatc_sum_fold, aatc_sum_merge, 0, threads);
+            assert(sums[0].count == (size_t)n);
+            assert(sums[0].sum == (long long)n*(n-1));
+        }
+    }
+    free(seen);
+    free(items);
+    free(nodes);
+}
+
+#endif
+
+#if defined(AAT_PARALLEL) && defined(AAT_ATOMIC)
+// A writer moves tokens between the keys of a shared tree, deleting one key
+// and inserting the next one in each write, while readers count the tokens.
+// Any read that saw part of a write must be retried, so every read that was
+// not retried sees exactly the number of tokens that the writer keeps.
+#define SEQ_KEYS 64
+#define SEQ_TOKENS 8
+
+struct aats_node {
+    AAT_FIELDS(struct aats_node, left, right, level);
+    int key;
+};
+
+static int aats_compare(struct aats_node *a, struct aats_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+AAT_IMPL(aats, struct aats_node, left, right, level, aats_compare)
+AAT_IMPL_SEQLOCK(aats, struct aats_node)
+
+#define aats_key(i) (&(struct aats_node){ .key = (i) })
+
+struct seq_shared {
+    struct aat_seqlock lock;
+    struct aats_node *root;
+    struct aats_node nodes[SEQ_KEYS];
+    int done;
+};
+
+struct seq_reader {
+    struct seq_shared *shared;
+    unsigned seed;
+    long reads;
+};
+
+static void *seq_read(void *udata) {
+    struct seq_reader *reader = udata;
+    struct seq_shared *shared = reader->shared;
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE)) {
+        int count;
+        int stored;
+        unsigned seq;
+        for (;;) {
+            seq = aat_seqlock_read_begin(&shared->lock);
+            count = 0;
+            stored = 1;
+            for (int i = 0; i < SEQ_KEYS; i++) {
+                struct aats_node *item = aats_search(&shared->root,
+                    aats_key(i));
+                if (item) {
+                    count++;
+                    stored &= item == &shared->nodes[i];
+                }
+            }
+            if (!aat_seqlock_read_retry(&shared->lock, seq)) {
+                break;
+            }
+        }
+        assert(count == SEQ_TOKENS);
+        assert(stored);
+        reader->seed = reader->seed*1103515245 + 12345;
+        int key = (reader->seed>>16)%SEQ_KEYS;
+        struct aats_node *item = aats_seq_search(&shared->lock,
+            &shared->root, aats_key(key));
+        assert(!item || item == &shared->nodes[key]);
+        reader->reads++;
+    }
+    return 0;
+}
+
+static void test_seqlock_threads(void) {
+    int nreaders = 4;
+    struct seq_shared *shared = malloc(sizeof(struct seq_shared));
+    assert(shared);
+    memset(shared, 0, sizeof(struct seq_shared));
+    char in[SEQ_KEYS] = { 0 };
+    for (int i = 0; i < SEQ_KEYS; i++) {
+        shared->nodes[i].key = i;
+    }
+    for (int i = 0; i < SEQ_TOKENS; i++) {
+        aats_insert(&shared->root, &shared->nodes[i*2]);
+        in[i*2] = 1;
+    }
+    pthread_t threads[4];
+    struct seq_reader readers[4];
+    for (int i = 0; i < nreaders; i++) {
+        readers[i] = (struct seq_reader){ .shared = shared, .seed = i };
+        assert(!pthread_create(&threads[i], 0, seq_read, &readers[i]));
+    }
+    for (int i = 0; i < 200000; i++) {
+        int from = rand()%SEQ_KEYS;
+        int to = (from+1)%SEQ_KEYS;
+        if (!in[from] || in[to]) {
+            continue;
+        }
+        aat_seqlock_write_begin(&shared->lock);
+        assert(aats_delete(&shared->root, aats_key(from)) == 
+            &shared->nodes[from]);
+        assert(!aats_insert(&shared->root, &shared->nodes[to]));
+        aat_seqlock_write_end(&shared->lock);
+        in[from] = 0;
+        in[to] = 1;
+    }
+    __atomic_store_n(&shared->done, 1, __ATOMIC_RELEASE);
+    long reads = 0;
+    for (int i = 0; i < nreaders; i++) {
+        assert(!pthread_join(threads[i], 0));
+        reads += readers[i].reads;
+    }
+    int count = 0;
+    struct aats_node *item = aats_first(&shared->root);
+    while (item) {
+        assert(in[item->key] && item == &shared->nodes[item->key]);
+        item = aats_next(&shared->root, item);
+        count++;
+    }
+    assert(count == SEQ_TOKENS);
+    assert(reads > 0);
+    free(shared);
+}
+#endif
+
+static void test_persist(void) {
+    int N = 200;
+    struct aatc_arena arena = { .cap = 200000, .fail_after = -1 };
+    arena.nodes = malloc(arena.cap*sizeof(struct aatc_node));
+    arena.retired = malloc(arena.cap*sizeof(struct aatc_node*));
+    assert(arena.nodes && arena.retired);
+    struct aatc_persist persist = {
+        .copy = aatc_arena_copy,
+        .retire = aatc_arena_retire,
+        .udata = &arena,
+    };
+    char *in = malloc(N);
+    char *old_in = malloc(N);
+    assert(in && old_in);
+    memset(in, 0, N);
+    struct aatc_node *root = 0;
+    for (int i = 0; i < N*10; i++) {
+        struct aatc_node *snap = aatc_snapshot(&root);
+        memcpy(old_in, in, N);
+        arena.nretired = 0;
+        arena.fail_after = rand()%10 == 0 ? rand()%4 : -1;
+        int j = rand()%N;
+        int ok;
+        if (rand()%3) {
+            struct aatc_node *item = aatc_arena_copy(aatc_key(j*2), &arena);
+            arena.fail_after = item ? arena.fail_after : 0;
+            struct aatc_node *replaced = item;
+            ok = item && aatc_persist_insert(&root, item, &replaced, 
+                &persist);
+            if (ok) {
+                assert(!replaced == !in[j]);
+                in[j] = 1;
+            } else {
+                assert(!replaced);
+            }
+        } else {
+            struct aatc_node *deleted = aatc_key(0);
+            ok = aatc_persist_delete(&root, aatc_key(j*2), &deleted, 
+                &persist);
+            if (ok) {
+                assert(deleted ? in[j] && deleted->key == j*2 : !in[j]);
+                in[j] = 0;
+            } else {
+                assert(!deleted);
+            }
+        }
+        if (!ok) {
+            assert(root == snap);
+        }
+        // the snapshot must be untouched by the change
+        aatc_same_keys(&snap, old_in, N);
+        // and no retired node may be reachable from the new root
+        for (int k = 0; k < arena.nretired; k++) {
+            arena.retired[k]->key = -1;
+            arena.retired[k]->count = 0;
+        }
+        aatc_same_keys(&root, in, N);
+    }
+    free(old_in);
+    free(in);
+    free(arena.retired);
+    free(arena.nodes);
+}
+
+static void test_pool(void) {
+    int N = 5000;
+    struct aatc_pool pool;
+    memset(&pool, 0, sizeof(struct aatc_pool));
+    struct aatc_node *root = 0;
+    int *keys = malloc(N*sizeof(int));
+    assert(keys);
+    for (int i = 0; i < N; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, N, sizeof(int));
+    for (int i = 0; i < N; i++) {
+        struct aatc_node *node = aatc_insert_new(&root, aatc_key(keys[i]), 
+            &pool);
+        assert(node && node->key == keys[i]);
+        if (i == 0) {
+            assert((uintptr_t)node%AAT_CACHE_LINE == 0);
+        }
+    }
+    assert(aatc_valid(&root) == N);
+    aatc_valid_counts(root);
+    assert(pool.count == (size_t)N);
+
+    // replacing an item puts the old node back into the pool
+    struct aatc_node *old = aatc_search(&root, aatc_key(7));
+    struct aatc_node *node = aatc_insert_new(&root, aatc_key(7), &pool);
+    assert(node && node != old && aatc_search(&root, aatc_key(7)) == node);
+    assert(pool.count == (size_t)N);
+    assert(aatc_pool_alloc(&pool) == old);
+    aatc_pool_free(&pool, old);
+
+    for (int i = 0; i < N; i += 2) {
+        assert(aatc_delete_free(&root, aatc_key(keys[i]), &pool));
+        assert(!aatc_delete_free(&root, aatc_key(keys[i]), &pool));
+    }
+    assert(aatc_valid(&root) == N/2);
+    aatc_valid_counts(root);
+    assert(pool.count == (size_t)(N/2));
+
+    // freed nodes are used again before the pool grows
+    struct aat_pool_chunk *chunks = pool.chunks;
+    for (int i = 0; i < N; i += 2) {
+        assert(aatc_insert_new(&root, aatc_key(keys[i]), &pool));
+    }
+    assert(pool.chunks == chunks);
+    assert(aatc_valid(&root) == N);
+
+    aatc_destroy(&root, &pool);
+    assert(!root && pool.count == 0);
+    aatc_pool_release(&pool);
+    assert(!pool.chunks && !pool.free && pool.nunused == 0);
+    free(keys);
+}
+
+static void test_counted(void) {
+    int N = 1000;
+    struct aatc_node *root = 0;
+    struct aatc_node *nodes = malloc(N*sizeof(struct aatc_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatc_node));
+    char *in = malloc(N);
+    assert(in);
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+    }
+    for (int i = 0; i < N*10; i++) {
+        int j = rand()%N;
+        switch (rand()%4) {
+        case 0: case 1:
+            aatc_insert(&root, &nodes[j]);
+            in[j] = 1;
+            break;
+        case 2:
+            if (aatc_delete(&root, &nodes[j])) {
+                in[j] = 0;
+            }
+            break;
+        default: {
+            struct aatc_node *deleted = rand()%2 ? aatc_delete_first(&root) :
+                aatc_delete_last(&root);
+            if (deleted) {
+                in[deleted->key/2] = 0;
+            }
+            break;
+        }}
+        assert(aatc_valid(&root) == (int)aatc_valid_counts(root));
+        if (i%100 != 0) {
+            continue;
+        }
+        // compare with a scan of every position
+        size_t count = 0;
+        for (int j = 0; j < N; j++) {
+            assert(aatc_rank(&root, aatc_key(j*2)) == count);
+            assert(aatc_rank(&root, aatc_key(j*2+1)) == count+in[j]);
+            if (in[j]) {
+                assert(aatc_select(&root, count) == &nodes[j]);
+                count++;
+            }
+        }
+        assert(aatc_count(&root) == count);
+        assert(!aatc_select(&root, count));
+        for (int j = 0; j < 10; j++) {
+            int lo = rand()%(N*2+2)-1;
+            int hi = rand()%(N*2+2)-1;
+            size_t expect = 0;
+            for (int k = 0; k < N; k++) {
+                expect += in[k] && k*2 >= lo && k*2 < hi;
+            }
+            assert(aatc_count_range(&root, aatc_key(lo), aatc_key(hi)) == 
+                expect);
+        }
+    }
+
+    // build from sorted items
+    struct aatc_node **items = malloc(N*sizeof(struct aatc_node*));
+    assert(items);
+    for (int i = 0; i < N; i++) {
+        items[i] = &nodes[i];
+    }
+    aatc_build_sorted(&root, items, N);
+    aatc_valid(&root);
+    aatc_valid_counts(root);
+    for (int i = 0; i < N; i++) {
+        assert(aatc_select(&root, i) == &nodes[i]);
+    }
+
+    // split and join, keeping the counts of every tree
+    for (int i = 0; i < 100; i++) {
+        aatc_build_sorted(&root, items, N);
+        int key = rand()%(N*2+1);
+        struct aatc_node *left, *right;
+        aatc_split_at(&root, aatc_key(key), &left, &right);
+        assert(aatc_valid(&left) == (int)aatc_valid_counts(left));
+        assert(aatc_valid(&right) == (int)aatc_valid_counts(right));
+        assert(aatc_count(&left) == (size_t)(key+1)/2);
+        aatc_join(&left, 0, &right);
+        assert(aatc_valid(&left) == (int)aatc_valid_counts(left));
+        assert(aatc_count(&left) == (size_t)N);
+    }
+
+    // relayout, keeping the counts of the copy
+    aatc_build_sorted(&root, items, N);
+    struct aatc_node *dst = malloc(N*sizeof(struct aatc_node));
+    assert(dst);
+    assert(aatc_relayout(&root, dst) == (size_t)N);
+    assert(aatc_valid(&root) == (int)aatc_valid_counts(root));
+    for (int i = 0; i < N; i++) {
+        assert(aatc_select(&root, i)->key == i*2);
+    }
+    free(dst);
+
+    // delete ranges, keeping the counts of both trees
+    for (int i = 0; i < 100; i++) {
+        aatc_build_sorted(&root, items, N);
+        int lo = rand()%(N*2+1);
+        int hi = lo+rand()%(N*2+1-lo);
+        struct aatc_node *removed = aatc_delete_range(&root, aatc_key(lo), 
+            aatc_key(hi));
+        assert(aatc_valid(&root) == (int)aatc_valid_counts(root));
+        assert(aatc_valid(&removed) == (int)aatc_valid_counts(removed));
+        assert(aatc_count(&removed) == (size_t)((hi+1)/2-(lo+1)/2));
+        assert(aatc_count(&root)+aatc_count(&removed) == (size_t)N);
+    }
+
+    // set operations, keeping the counts of every tree
+    struct aatc_node *keys = malloc(N*sizeof(struct aatc_node));
+    assert(keys);
+    for (int i = 0; i < 20; i++) {
+        struct aatc_node *other = 0;
+        root = 0;
+        for (int j = 0; j < N; j++) {
+            if (rand()%2) {
+                aatc_insert(&root, &nodes[j]);
+            } else {
+                aatc_insert(&other, &nodes[j]);
+            }
+        }
+        struct aatc_node *removed = aatc_union(&root, &other, 0, 0);
+        assert(!removed && !other);
+        assert(aatc_valid(&root) == N);
+        assert(aatc_valid_counts(root) == (size_t)N);
+        for (int j = 0; j < N; j += 1+rand()%3) {
+            keys[j].key = j*2;
+            aatc_insert(&other, &keys[j]);
+        }
+        size_t count = aatc_count(&other);
+        removed = aatc_difference(&root, &other);
+        assert(aatc_valid(&root) == (int)aatc_valid_counts(root));
+        assert(aatc_valid(&removed) == (int)aatc_valid_counts(removed));
+        assert(aatc_count(&removed) == count);
+        assert(aatc_count(&root) == N-count);
+        aatc_union(&root, &removed, 0, 0);
+        removed = aatc_intersect(&root, &other);
+        assert(aatc_valid(&root) == (int)aatc_valid_counts(root));
+        assert(aatc_valid(&removed) == (int)aatc_valid_counts(removed));
+        assert(aatc_count(&root) == count);
+        assert(aatc_count(&removed) == N-count);
+    }
+
+    // clone, keeping the subtree counts
+    struct aatc_node *copies = malloc(N*sizeof(struct aatc_node));
+    assert(copies);
+    struct aatc_node *next = copies;
+    struct aatc_node *croot = 0;
+    assert(aatc_clone(&root, &croot, aatc_copy, 0, &next));
+    assert((size_t)(next-copies) == aatc_count(&root));
+    assert(aatc_valid(&croot) == (int)aatc_count(&root));
+    assert(aatc_valid_counts(croot) == aatc_count(&root));
+    free(copies);
+    free(keys);
+    free(items);
+    free(in);
+    free(nodes);
+}
+
+struct aata_node {
+    AAT_FIELDS(struct aata_node, left, right, level);
+    int key;
+    int value;
+    int sum;   // sum of all values in the subtree
+    int max;   // max of all values in the subtree
+};
+
+static int aata_compare(struct aata_node *a, struct aata_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static void aata_update(struct aata_node *node) {
+    node->sum = node->value;
+    node->max = node->value;
+    if (node->left) {
+        node->sum += node->left->sum;
+        node->max = node->left->max > node->max ? node->left->max : node->max;
+    }
+    if (node->right) {
+        node->sum += node->right->sum;
+        node->max = node->right->max > node->max ? node->right->max : node->max;
+    }
+}
+
+AAT_IMPL_AUGMENTED(aata, struct aata_node, left, right, level, aata_compare,
+    aata_update)
+VALID_IMPL(aata, struct aata_node, aata_compare)
+
+static void aata_valid_sums(struct aata_node *node) {
+    if (node) {
+        aata_valid_sums(node->left);
+        aata_valid_sums(node->right);
+        struct aata_node copy = *node;
+        aata_update(&copy);
+        assert(copy.sum == node->sum && copy.max == node->max);
+    }
+}
+
+// Returns the sum of the values for all keys less than key, skipping over
+// whole subtrees.
+static int aata_sum_less(struct aata_node **root, int key) {
+    int sum = 0;
+    struct aata_node *node = *root;
+    while (node) {
+        if (key <= node->key) {
+            node = node->left;
+        } else {
+            sum += node->value + (node->left ? node->left->sum : 0);
+            node = node->right;
+        }
+    }
+    return sum;
+}
+
+static void test_augmented(void) {
+    int N = 500;
+    struct aata_node *root = 0;
+    struct aata_node *nodes = malloc(N*2*sizeof(struct aata_node));
+    assert(nodes);
+    memset(nodes, 0, N*2*sizeof(struct aata_node));
+    for (int i = 0; i < N*2; i++) {
+        nodes[i].key = i%N;
+    }
+    for (int i = 0; i < N*10; i++) {
+        struct aata_node *node = &nodes[rand()%(N*2)];
+        switch (rand()%4) {
+        case 0: case 1:
+            node->value = rand()%1000;
+            aata_insert(&root, node);
+            break;
+        case 2:
+            aata_delete(&root, node);
+            break;
+        default:
+            if (rand()%2) {
+                aata_delete_first(&root);
+            } else {
+                aata_delete_last(&root);
+            }
+            break;
+        }
+        aata_valid(&root);
+        aata_valid_sums(root);
+    }
+    int key = rand()%N;
+    int sum = 0;
+    struct aata_node *node = aata_first(&root);
+    while (node && node->key < key) {
+        sum += node->value;
+        node = aata_next(&root, node);
+    }
+    assert(aata_sum_less(&root, key) == sum);
+
+    // delete a range and check the sums of both trees
+    int lo = rand()%N;
+    int hi = lo+rand()%(N-lo+1);
+    struct aata_node *removed = aata_delete_range(&root, 
+        &(struct aata_node){ .key = lo }, &(struct aata_node){ .key = hi });
+    aata_valid(&root);
+    aata_valid_sums(root);
+    aata_valid(&removed);
+    aata_valid_sums(removed);
+    free(nodes);
+}
+
+struct aatk_node {
+    AAT_FIELDS_COMPACT(struct aatk_node, left, right);
+    int key;
+    int value;
+};
+
+static int aatk_compare(struct aatk_node *a, struct aatk_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+AAT_IMPL_COMPACT(aatk, struct aatk_node, left, right, aatk_compare)
+VALID_IMPL(aatk, struct aatk_node, aatk_compare)
+
+static void test_compact(void) {
+    int N = 1000;
+    struct aatk_node *root = 0;
+    struct aatk_node *nodes = malloc(N*sizeof(struct aatk_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatk_node));
+    char *in = malloc(N);
+    assert(in);
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    for (int i = 0; i < N*20; i++) {
+        int j = rand()%N;
+        switch (rand()%4) {
+        case 0: case 1:
+            aatk_insert(&root, &nodes[j]);
+            in[j] = 1;
+            break;
+        case 2:
+            if (aatk_delete(&root, &nodes[j])) {
+                in[j] = 0;
+            }
+            break;
+        default: {
+            struct aatk_node *deleted = rand()%2 ? aatk_delete_first(&root) :
+                aatk_delete_last(&root);
+            if (deleted) {
+                in[deleted->key] = 0;
+            }
+            break;
+        }}
+        int count = 0;
+        for (int j = 0; j < N; j++) {
+            count += in[j];
+        }
+        assert(aatk_valid(&root) == count);
+    }
+    struct aatk_node *item = aatk_first(&root);
+    for (int i = 0; i < N; i++) {
+        if (in[i]) {
+            assert(item == &nodes[i]);
+            item = aatk_next(&root, item);
+        }
+    }
+    assert(!item);
+
+    // build from sorted items, high enough for levels to use both links
+    int M = 1<<17;
+    struct aatk_node *many = malloc(M*sizeof(struct aatk_node));
+    assert(many);
+    struct aatk_node **items = malloc(M*sizeof(struct aatk_node*));
+    assert(items);
+    for (int i = 0; i < M; i++) {
+        many[i].key = i;
+        items[i] = &many[i];
+    }
+    aatk_build_sorted(&root, items, M);
+    assert(aatk_level(root) > 8);
+    assert(aatk_valid(&root) == M);
+    for (int i = 0; i < M; i += 2) {
+        assert(aatk_delete(&root, &many[i]) == &many[i]);
+    }
+    assert(aatk_valid(&root) == M/2);
+    free(items);
+    free(many);
+    free(in);
+    free(nodes);
+}
+
+struct aati_node {
+    AAT_FIELDS_INDEXED(left, right, level);
+    int key;
+};
+
+static int aati_compare(struct aati_node *a, struct aati_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static struct aati_node *aati_base;
+
+AAT_IMPL_INDEXED(aati, struct aati_node, left, right, level, aati_compare, 
+    aati_base)
+VALID_IMPL(aati, struct aati_node, aati_compare)
+
+static void test_indexed(void) {
+    int N = 1000;
+    struct aati_node *root = 0;
+    aati_base = malloc(N*sizeof(struct aati_node));
+    assert(aati_base);
+    memset(aati_base, 0, N*sizeof(struct aati_node));
+    char *in = malloc(N);
+    assert(in);
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        aati_base[i].key = i;
+    }
+    int count = 0;
+    for (int i = 0; i < N*20; i++) {
+        int j = rand()%N;
+        switch (rand()%4) {
+        case 0: case 1:
+            if (!aati_insert(&root, &aati_base[j])) {
+                count++;
+            }
+            in[j] = 1;
+            break;
+        case 2:
+            if (aati_delete(&root, &aati_base[j])) {
+                in[j] = 0;
+                count--;
+            }
+            break;
+        default: {
+            struct aati_node *deleted = rand()%2 ? aati_delete_first(&root) :
+                aati_delete_last(&root);
+            if (deleted) {
+                in[deleted->key] = 0;
+                count--;
+            }
+            break;
+        }}
+        assert(aati_valid(&root) == count);
+    }
+
+    // move the array and check that the tree is still the same
+    struct aati_node *moved = malloc(N*sizeof(struct aati_node));
+    assert(moved);
+    memcpy(moved, aati_base, N*sizeof(struct aati_node));
+    if (root) {
+        root = moved+(root-aati_base);
+    }
+    free(aati_base);
+    aati_base = moved;
+    assert(aati_valid(&root) == count);
+    struct aati_node *item = aati_first(&root);
+    for (int i = 0; i < N; i++) {
+        if (in[i]) {
+            assert(item == &aati_base[i]);
+            item = aati_next(&root, item);
+        }
+    }
+    assert(!item);
+
+    // save to a file, read it back and open the copy
+    size_t size = aati_save(&root, N, 0, 0);
+    char *data = malloc(size);
+    assert(data);
+    assert(aati_save(&root, N, data, size) == size);
+    FILE *file = tmpfile();
+    assert(file);
+    assert(fwrite(data, 1, size, file) == size);
+    rewind(file);
+    char *mapped = malloc(size);
+    assert(mapped);
+    assert(fread(mapped, 1, size, file) == size);
+    fclose(file);
+    struct aati_node *mapped_root;
+    struct aati_node *mapped_nodes = aati_open_mapped(mapped, size, 
+        &mapped_root, 1);
+    assert(mapped_nodes == (struct aati_node*)(mapped+
+        sizeof(struct aat_file_header)));
+    free(aati_base);
+    aati_base = mapped_nodes;
+    assert(aati_valid(&mapped_root) == count);
+    for (int i = 0; i < N; i++) {
+        struct aati_node key = { .key = i };
+        assert(!aati_search(&mapped_root, &key) == !in[i]);
+    }
+
+    // reject bad headers, short data and a broken tree
+    struct aat_file_header *header = (struct aat_file_header*)data;
+    struct aati_node *bad_root;
+    assert(aati_open_mapped(data, size, &bad_root, 1));
+    assert(!aati_open_mapped(data, size-1, &bad_root, 0));
+    assert(!aati_open_mapped(data, 4, &bad_root, 0));
+    header->version++;
+    assert(!aati_open_mapped(data, size, &bad_root, 0));
+    header->version--;
+    header->node_size++;
+    assert(!aati_open_mapped(data, size, &bad_root, 0));
+    header->node_size--;
+    if (header->root) {
+        struct aati_node *nodes = (struct aati_node*)(header+1);
+        struct aati_node *node = &nodes[header->root-1];
+        node->right = header->root;
+        assert(aati_open_mapped(data, size, &bad_root, 0));
+        assert(!aati_open_mapped(data, size, &bad_root, 1));
+        node->right = N+1;
+        assert(!aati_open_mapped(data, size, &bad_root, 1));
+    }
+    free(data);
+    free(mapped);
+    free(in);
+    aati_base = 0;
+}
+
+struct aatn_node {
+    AAT_FIELDS(struct aatn_node, left, right, level);
+    int key;
+};
+
+#define aatn_getkey(node) ((node)->key)
+
+AAT_IMPL_KEY(aatn, struct aatn_node, left, right, level, int, aatn_getkey)
+VALID_IMPL(aatn, struct aatn_node, aatn_keycompare)
+
+static void test_key(void) {
+    int N = 1000;
+    struct aatn_node *root = 0;
+    struct aatn_node *nodes = malloc(N*sizeof(struct aatn_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatn_node));
+    char *in = malloc(N);
+    assert(in);
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+    }
+    int count = 0;
+    for (int i = 0; i < N*20; i++) {
+        int j = rand()%N;
+        switch (rand()%4) {
+        case 0: case 1:
+            if (!aatn_insert(&root, &nodes[j])) {
+                count++;
+            }
+            in[j] = 1;
+            break;
+        case 2:
+            if (aatn_delete_key(&root, j*2)) {
+                assert(in[j]);
+                in[j] = 0;
+                count--;
+            } else {
+                assert(!in[j]);
+            }
+            break;
+        default:
+            if (aatn_delete(&root, &nodes[j])) {
+                in[j] = 0;
+                count--;
+            }
+            break;
+        }
+        assert(aatn_valid(&root) == count);
+        if (i%100 != 0) {
+            continue;
+        }
+        struct aat_cursor cursor;
+        for (int k = -1; k <= N*2; k++) {
+            struct aatn_node key = { .key = k };
+            assert(aatn_search_key(&root, k) == aatn_search(&root, &key));
+            assert(aatn_iter_key(&root, k) == aatn_iter(&root, &key));
+            assert(aatn_cursor_seek_key(&root, &cursor, k) == 
+                aatn_iter(&root, &key));
+        }
+    }
+    free(in);
+    free(nodes);
+}
+
+struct aatm_node {
+    AAT_FIELDS(struct aatm_node, left, right, level);
+    int key;
+};
+
+static int aatm_compare(struct aatm_node *a, struct aatm_node *b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+// orders equal keys by address, which is the order they were inserted in
+static int aatm_stable_compare(struct aatm_node *a, struct aatm_node *b) {
+    int cmp = aatm_compare(a, b);
+    return cmp ? cmp : (a > b) - (a < b);
+}
+
+AAT_IMPL(aatm, struct aatm_node, left, right, level, aatm_compare)
+VALID_IMPL(aatm, struct aatm_node, aatm_stable_compare)
+
+static void test_multi(void) {
+    int N = 2000;
+    int K = 50;
+    struct aatm_node *root = 0;
+    struct aatm_node *nodes = malloc(N*sizeof(struct aatm_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aatm_node));
+    int *counts = malloc(K*sizeof(int));
+    assert(counts);
+    memset(counts, 0, K*sizeof(int));
+    int count = 0;
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = rand()%K;
+        aatm_insert_multi(&root, &nodes[i]);
+        counts[nodes[i].key]++;
+        count++;
+        if (rand()%4 == 0) {
+            struct aatm_node key = { .key = rand()%K };
+            struct aatm_node *deleted = aatm_delete(&root, &key);
+            assert(!deleted == !counts[key.key]);
+            if (deleted) {
+                assert(deleted->key == key.key);
+                counts[key.key]--;
+                count--;
+            }
+        }
+        assert(aatm_valid(&root) == count);
+    }
+    struct aat_cursor cursor;
+    struct aat_cursor finger;
+    finger.depth = 0;
+    for (int k = -1; k <= K; k++) {
+        struct aatm_node key = { .key = k };
+        int expect = k >= 0 && k < K ? counts[k] : 0;
+        assert(aatm_count_equal(&root, &key) == (size_t)expect);
+        struct aatm_node *end;
+        struct aatm_node *first = aatm_equal_range(&root, &key, &end);
+        assert(!first == !expect);
+        assert(end == aatm_iter(&root, &(struct aatm_node){ .key = k+1 }));
+        assert(aatm_cursor_seek(&root, &cursor, &key) == (first ? first : end));
+        assert(aatm_cursor_seek_from(&root, &finger, &key) == 
+            (first ? first : end));
+        int n = 0;
+        struct aatm_node *item = first ? first : end;
+        while (item != end) {
+            assert(item->key == k);
+            item = aatm_cursor_next(&cursor);
+            n++;
+        }
+        assert(n == expect);
+        if (first) {
+            assert(aatm_search(&root, &key)->key == k);
+        } else {
+            assert(!aatm_search(&root, &key));
+        }
+    }
+
+    // remove every item by pointer, in random order
+    struct aatm_node **items = malloc(count*sizeof(struct aatm_node*));
+    assert(items);
+    int n = 0;
+    struct aatm_node *item = aatm_cursor_first(&root, &cursor);
+    while (item) {
+        items[n++] = item;
+        item = aatm_cursor_next(&cursor);
+    }
+    assert(n == count);
+
+    // next and prev visit every one of the equal items
+    item = aatm_first(&root);
+    for (int i = 0; i < n; i++) {
+        assert(item == items[i]);
+        item = aatm_next(&root, item);
+    }
+    assert(!item);
+    item = aatm_last(&root);
+    for (int i = n-1; i >= 0; i--) {
+        assert(item == items[i]);
+        item = aatm_prev(&root, item);
+    }
+    assert(!item);
+
+    shuffle(items, n, sizeof(struct aatm_node*));
+    for (int i = 0; i < n; i++) {
+        assert(aatm_remove_node(&root, items[i]) == items[i]);
+        assert(!aatm_remove_node(&root, items[i]));
+        count--;
+        assert(aatm_valid(&root) == count);
+    }
+    assert(!root);
+    free(items);
+    free(counts);
+    free(nodes);
+}
+
+struct make_ctx {
+    struct aat_node *pool;
+    int count;
+    int limit;
+    int freed;
+};
+
+static struct aat_node *make_node(struct aat_node *key, void *udata) {
+    struct make_ctx *ctx = udata;
+    if (ctx->count == ctx->limit) {
+        return 0;
+    }
+    struct aat_node *node = &ctx->pool[ctx->count++];
+    node->key = key->key;
+    return node;
+}
+
+static void free_node(struct aat_node *item, void *udata) {
+    struct make_ctx *ctx = udata;
+    assert(!item->left && !item->right);
+    ctx->freed++;
+}
+
+// Checks that two trees have the same shape, keys and levels.
+static void same_shape(struct aat_node *a, struct aat_node *b) {
+    assert(!a == !b);
+    if (a) {
+        assert(a != b && a->key == b->key && a->level == b->level);
+        same_shape(a->left, b->left);
+        same_shape(a->right, b->right);
+    }
+}
+
+struct scan_ctx {
+    int *keys;
+    int count;
+    int limit;
+};
+
+static int scan_iter(struct aat_node *item, void *udata) {
+    struct scan_ctx *ctx = udata;
+    ctx->keys[ctx->count++] = item->key;
+    return ctx->count < ctx->limit;
+}
+
+// Keeps the item with an even key from the first tree and the item with an
+// odd key from the other, counting the calls.
+static struct aat_node *keep_even(struct aat_node *item, 
+    struct aat_node *other_item, void *udata)
+{
+    assert(item->key == other_item->key);
+    (*(int*)udata)++;
+    return item->key%2 == 0 ? item : other_item;
+}
+
+// Fills the tree with each of n keys picked with a one in every chance.
+static void fill_some(struct aat_node **root, struct aat_node *nodes, 
+    char *in, int n, int every)
+{
+    *root = 0;
+    memset(nodes, 0, n*sizeof(struct aat_node));
+    for (int i = 0; i < n; i++) {
+        nodes[i].key = i;
+        in[i] = every > 0 && rand()%every == 0;
+        if (in[i]) {
+            aat_insert(root, &nodes[i]);
+        }
+    }
+}
+
+void bench() {
+    int N = 1000000;
+    struct aat_node *root = 0;
+    struct aat_node *nodes = malloc(N*sizeof(struct aat_node));
+    assert(nodes);
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    fprintf(stderr, "node-size:    %zu bytes\n", sizeof(struct aat_node));
+    struct aat_node **items = malloc(N*sizeof(struct aat_node*));
+    assert(items);
+    for (int i = 0; i < N; i++) {
+        items[i] = &nodes[i];
+    }
+    int64_t start = getnow();
+    aat_build_sorted(&root, items, N);
+    double elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "build-sorted: %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    aat_valid(&root);
+    free(items);
+    root = 0;
+
+    shuffle(nodes, N, sizeof(struct aat_node));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        aat_insert(&root, &nodes[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "insert:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    int *keys = malloc(N*sizeof(int));
+    assert(keys);
+    for (int i = 0; i < N; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_search(&root, key_node(keys[i]))->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    struct aat_node *relaid = malloc(N*sizeof(struct aat_node));
+    assert(relaid);
+    struct aat_node *relaid_root = root;
+    aat_relayout(&relaid_root, relaid);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_search(&relaid_root, key_node(keys[i]))->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search-veb:   %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(relaid);
+
+    struct aat_node **key_ptrs = malloc(N*sizeof(struct aat_node*));
+    assert(key_ptrs);
+    struct aat_node **found = malloc(N*sizeof(struct aat_node*));
+    assert(found);
+    struct aat_node *key_nodes = malloc(N*sizeof(struct aat_node));
+    assert(key_nodes);
+    shuffle(keys, N, sizeof(int));
+    for (int i = 0; i < N; i++) {
+        key_nodes[i].key = keys[i];
+        key_ptrs[i] = &key_nodes[i];
+    }
+    start = getnow();
+    for (int i = 0; i < N; i += 16) {
+        aat_search_many(&root, key_ptrs+i, found+i, N-i < 16 ? N-i : 16);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search-many:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    for (int i = 0; i < N; i++) {
+        assert(found[i]->key == keys[i]);
+    }
+    free(key_nodes);
+    free(found);
+    free(key_ptrs);
+
+    struct aatn_node *nnodes = malloc(N*sizeof(struct aatn_node));
+    assert(nnodes);
+    memset(nnodes, 0, N*sizeof(struct aatn_node));
+    struct aatn_node *nroot = 0;
+    for (int i = 0; i < N; i++) {
+        nnodes[i].key = i;
+    }
+    shuffle(nnodes, N, sizeof(struct aatn_node));
+    for (int i = 0; i < N; i++) {
+        aatn_insert(&nroot, &nnodes[i]);
+    }
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aatn_search_key(&nroot, keys[i])->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search-key:   %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(nnodes);
+
+    int *frozen_keys = malloc(N*sizeof(int));
+    assert(frozen_keys);
+    struct aat_node **frozen_items = malloc(N*sizeof(struct aat_node*));
+    assert(frozen_items);
+    aat_freeze(&root, frozen_keys, frozen_items, N);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_frozen_search(frozen_keys, frozen_items, N, 
+            keys[i])->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search-eytz:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(frozen_items);
+    free(frozen_keys);
+
+    start = getnow();
+    struct aat_node *iter = aat_first(&root);
+    for (int i = 0; i < N; i++) {
+        assert(iter->key == i);
+        iter = aat_next(&root, iter);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "next:         %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    start = getnow();
+    struct aat_cursor cursor;
+    iter = aat_cursor_first(&root, &cursor);
+    for (int i = 0; i < N; i++) {
+        assert(iter->key == i);
+        iter = aat_cursor_next(&cursor);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "cursor-next:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    start = getnow();
+    cursor.depth = 0;
+    for (int i = 0; i < N; i++) {
+        assert(aat_search_from(&root, &cursor, key_node(i))->key == i);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search-from:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_delete(&root, key_node(keys[i]))->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "delete:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    shuffle(nodes, N, sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        aat_insert(&root, &nodes[i]);
+    }
+
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        aat_delete_first(&root);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "delete-first: %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    shuffle(nodes, N, sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        assert(!aat_insert(&root, &nodes[i]));
+    }
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_delete_last(&root)->key == N-i-1);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "delete-last:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    // pop the first item after looking at it, through the root and through a
+    // tree handle
+    shuffle(nodes, N, sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        assert(!aat_insert(&root, &nodes[i]));
+    }
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_first(&root)->key == i);
+        aat_delete_first(&root);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "pop-first:    %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    struct aat_tree tree = { 0 };
+    shuffle(nodes, N, sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        assert(!aat_tree_insert(&tree, &nodes[i]));
+    }
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        assert(aat_tree_first(&tree)->key == i);
+        aat_tree_delete_first(&tree);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "tree-pop:     %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+
+    // copy a tree, then take the copy apart without rebalancing
+    for (int i = 0; i < N; i++) {
+        aat_insert(&root, &nodes[i]);
+    }
+    struct aat_node *cloned = malloc(N*sizeof(struct aat_node));
+    assert(cloned);
+    struct make_ctx clone = { .pool = cloned, .limit = N };
+    struct aat_node *croot = 0;
+    start = getnow();
+    assert(aat_clone(&root, &croot, make_node, 0, &clone));
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "clone:        %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    start = getnow();
+    aat_clear_all(&croot, 0, 0);
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "clear-all:    %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(cloned);
+    aat_clear_all(&root, 0, 0);
+
+    // insert the odd keys in sorted batches into a tree with the even keys
+    items = malloc(N*sizeof(struct aat_node*));
+    assert(items);
+    int n = 0;
+    for (int i = 0; i < N; i++) {
+        if (nodes[i].key%2 == 0) {
+            aat_insert(&root, &nodes[i]);
+        } else {
+            items[nodes[i].key/2] = &nodes[i];
+            n++;
+        }
+    }
+    start = getnow();
+    for (int i = 0; i < n; i += 1000) {
+        aat_insert_batch(&root, items+i, n-i < 1000 ? n-i : 1000, 0);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "insert-batch: %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        n, elapsed, elapsed*1e9/(double)n, (double)n/elapsed);
+    aat_valid(&root);
+
+    // same as above, inserting one at a time from the previous position
+    root = 0;
+    for (int i = 0; i < N; i++) {
+        if (nodes[i].key%2 == 0) {
+            aat_insert(&root, &nodes[i]);
+        }
+    }
+    start = getnow();
+    cursor.depth = 0;
+    for (int i = 0; i < n; i++) {
+        aat_insert_hint(&root, &cursor, items[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "insert-hint:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        n, elapsed, elapsed*1e9/(double)n, (double)n/elapsed);
+    aat_valid(&root);
+    free(items);
+
+    // merge a tree with the odd keys into a tree with the even keys
+    root = 0;
+    struct aat_node *other = 0;
+    for (int i = 0; i < N; i++) {
+        aat_insert(nodes[i].key%2 == 0 ? &root : &other, &nodes[i]);
+    }
+    start = getnow();
+    assert(!aat_union(&root, &other, 0, 0));
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "union:        %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    aat_valid(&root);
+
+    // same as above using the compact layout with a value next to the key
+    struct aatk_node *knodes = malloc(N*sizeof(struct aatk_node));
+    assert(knodes);
+    memset(knodes, 0, N*sizeof(struct aatk_node));
+    for (int i = 0; i < N; i++) {
+        knodes[i].key = i;
+    }
+    struct aatk_node *kroot = 0;
+    fprintf(stderr, "node-size:    %zu bytes (compact, with a value)\n", 
+        sizeof(struct aatk_node));
+    shuffle(knodes, N, sizeof(struct aatk_node));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        aatk_insert(&kroot, &knodes[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "insert:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        struct aatk_node key = { .key = keys[i] };
+        assert(aatk_search(&kroot, &key)->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        struct aatk_node key = { .key = keys[i] };
+        assert(aatk_delete(&kroot, &key)->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "delete:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(knodes);
+
+    // same as above using 32-bit indexes into the node array
+    aati_base = malloc(N*sizeof(struct aati_node));
+    assert(aati_base);
+    memset(aati_base, 0, N*sizeof(struct aati_node));
+    for (int i = 0; i < N; i++) {
+        aati_base[i].key = i;
+    }
+    struct aati_node *iroot = 0;
+    fprintf(stderr, "node-size:    %zu bytes (indexed)\n", 
+        sizeof(struct aati_node));
+    shuffle(aati_base, N, sizeof(struct aati_node));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        aati_insert(&iroot, &aati_base[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "insert:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        struct aati_node key = { .key = keys[i] };
+        assert(aati_search(&iroot, &key)->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "search:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    shuffle(keys, N, sizeof(int));
+    start = getnow();
+    for (int i = 0; i < N; i++) {
+        struct aati_node key = { .key = keys[i] };
+        assert(aati_delete(&iroot, &key)->key == keys[i]);
+    }
+    elapsed = (getnow()-start)/1e9;
+    fprintf(stderr, "delete:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
+        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    free(aati_base);
+    aati_base = 0;
+}
+
+// The benchmark suite runs each workload on trees from 1K items up to maxn,
+// timing sampled operations one at a time for the latency percentiles. Each
+// result is a CSV row on stdout, with a readable copy on stderr.
+
+#define BENCH_OPS 1000000
+#define BENCH_SAMPLES 1000000
+#define BENCH_SCAN 100
+
+struct bench_run {
+    const char *name;
+    size_t n;
+    size_t ops;
+    size_t stride;
+    size_t nsamples;
+    int64_t *samples;
+    int64_t overhead;
+    int64_t counters[2];
+};
+
+#ifdef __linux__
+static int bench_perf_fds[2] = { -1, -1 };
+
+static int bench_perf_open(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Opens the cache-miss and branch-miss counters, which are reported as
+// missing when the kernel does not allow it.
+static void bench_perf_init(void) {
+#ifdef __linux__
+    bench_perf_fds[0] = bench_perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    bench_perf_fds[1] = bench_perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+}
+
+static void bench_perf_start(void) {
+#ifdef __linux__
+    for (int i = 0; i < 2; i++) {
+        if (bench_perf_fds[i] != -1) {
+            ioctl(bench_perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(bench_perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+static void bench_perf_stop(int64_t counters[2]) {
+    for (int i = 0; i < 2; i++) {
+        counters[i] = -1;
+#ifdef __linux__
+        uint64_t count;
+        if (bench_perf_fds[i] != -1) {
+            ioctl(bench_perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(bench_perf_fds[i], &count, sizeof(count)) == 
+                sizeof(count))
+            {
+                counters[i] = count;
+            }
+        }
+#endif
+    }
+}
+
+// Returns a random number in [0,n), for n larger than RAND_MAX too.
+static size_t bench_rand(size_t n) {
+    uint64_t r = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+    return r % n;
+}
+
+// Returns a rank in [0,n) with a probability proportional to 1/(rank+1). Each
+// power of two octave of 1/x has about the same weight, so an octave is picked
+// uniformly, then a rank in it, rejecting by octave/rank to make it exact.
+static size_t bench_zipf(size_t n) {
+    int octaves = 0;
+    while (((size_t)1 << octaves) <= n) {
+        octaves++;
+    }
+    for (;;) {
+        size_t lo = (size_t)1 << bench_rand(octaves);
+        size_t rank = lo + bench_rand(lo);
+        if (rank <= n && bench_rand(rank) < lo) {
+            return rank-1;
+        }
+    }
+}
+
+static int64_t bench_clock_overhead(void) {
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        int64_t start = getnow();
+        int64_t elapsed = getnow()-start;
+        min = elapsed < min ? elapsed : min;
+    }
+    return min;
+}
+
+static void bench_begin(struct bench_run *run, const char *name, size_t n, 
+    size_t ops)
+{
+    run->name = name;
+    run->n = n;
+    run->ops = ops;
+    run->stride = (ops+BENCH_SAMPLES-1)/BENCH_SAMPLES;
+    run->nsamples = 0;
+    bench_perf_start();
+}
+
+// Returns the start time when operation i is one of the sampled ones.
+static int64_t bench_tick(struct bench_run *run, size_t i) {
+    return i%run->stride == 0 ? getnow() : -1;
+}
+
+static void bench_tock(struct bench_run *run, int64_t start) {
+    if (start != -1) {
+        int64_t elapsed = getnow()-start-run->overhead;
+        run->samples[run->nsamples++] = elapsed < 0 ? 0 : elapsed;
+    }
+}
+
+static int bench_cmp_samples(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
 
-void bench() {
-    int N = 1000000;
+static int64_t bench_percentile(struct bench_run *run, double p) {
+    return run->samples[(size_t)(p*(double)(run->nsamples-1))];
+}
+
+static void bench_end(struct bench_run *run) {
+    bench_perf_stop(run->counters);
+    qsort(run->samples, run->nsamples, sizeof(int64_t), bench_cmp_samples);
+    double sum = 0;
+    for (size_t i = 0; i < run->nsamples; i++) {
+        sum += run->samples[i];
+    }
+    double mean = sum/(double)run->nsamples;
+    printf("%s,%zu,%zu,%.2f,%lld,%lld,%lld", run->name, run->n, run->ops, 
+        mean, (long long)bench_percentile(run, 0.5), 
+        (long long)bench_percentile(run, 0.99), 
+        (long long)bench_percentile(run, 0.999));
+    for (int i = 0; i < 2; i++) {
+        if (run->counters[i] == -1) {
+            printf(",");
+        } else {
+            printf(",%.3f", (double)run->counters[i]/(double)run->ops);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+    fprintf(stderr, "%-14s %9zu items, %9zu ops, mean %7.1f ns, "
+        "p50 %lld, p99 %lld, p999 %lld\n", run->name, run->n, run->ops, mean, 
+        (long long)bench_percentile(run, 0.5), 
+        (long long)bench_percentile(run, 0.99), 
+        (long long)bench_percentile(run, 0.999));
+}
+
+static int bench_scan_iter(struct aat_node *item, void *udata) {
+    (void)item;
+    (*(size_t*)udata)++;
+    return 1;
+}
+
+// Runs every workload on a tree with n items, keyed from 0 to n-1.
+static void bench_size(struct bench_run *run, struct aat_node *nodes, 
+    int *keys, size_t n)
+{
     struct aat_node *root = 0;
-    struct aat_node *nodes = malloc(N*sizeof(struct aat_node));
-    assert(nodes);
-    memset(nodes, 0, N*sizeof(struct aat_node));
-    for (int i = 0; i < N; i++) {
+    struct aat_cursor cursor;
+    for (size_t i = 0; i < n; i++) {
         nodes[i].key = i;
+        keys[i] = i;
     }
-    shuffle(nodes, N, sizeof(struct aat_node));
-    int64_t start = getnow();
-    for (int i = 0; i < N; i++) {
+    bench_begin(run, "insert-seq", n, n);
+    for (size_t i = 0; i < n; i++) {
+        int64_t start = bench_tick(run, i);
         aat_insert(&root, &nodes[i]);
+        bench_tock(run, start);
     }
-    double elapsed = (getnow()-start)/1e9;
-    fprintf(stderr, "insert:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
-        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    bench_end(run);
 
-    int *keys = malloc(N*sizeof(int));
-    assert(keys);
-    for (int i = 0; i < N; i++) {
-        keys[i] = i;
+    bench_begin(run, "search-seq", n, BENCH_OPS);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int key = i%n;
+        int64_t start = bench_tick(run, i);
+        struct aat_node *item = aat_search(&root, key_node(key));
+        bench_tock(run, start);
+        assert(item == &nodes[key]);
     }
-    shuffle(keys, N, sizeof(int));
-    start = getnow();
-    for (int i = 0; i < N; i++) {
-        assert(aat_search(&root, key_node(keys[i]))->key == keys[i]);
+    bench_end(run);
+
+    bench_begin(run, "next", n, BENCH_OPS);
+    struct aat_node *item = aat_first(&root);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int64_t start = bench_tick(run, i);
+        item = item ? aat_next(&root, item) : aat_first(&root);
+        bench_tock(run, start);
     }
-    elapsed = (getnow()-start)/1e9;
-    fprintf(stderr, "search:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
-        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    bench_end(run);
 
-    shuffle(keys, N, sizeof(int));
-    start = getnow();
-    for (int i = 0; i < N; i++) {
-        assert(aat_delete(&root, key_node(keys[i]))->key == keys[i]);
+    bench_begin(run, "prev", n, BENCH_OPS);
+    item = aat_last(&root);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int64_t start = bench_tick(run, i);
+        item = item ? aat_prev(&root, item) : aat_last(&root);
+        bench_tock(run, start);
     }
-    elapsed = (getnow()-start)/1e9;
-    fprintf(stderr, "delete:       %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
-        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    bench_end(run);
 
-    shuffle(nodes, N, sizeof(struct aat_node));
-    for (int i = 0; i < N; i++) {
-        aat_insert(&root, &nodes[i]);
+    bench_begin(run, "cursor-next", n, BENCH_OPS);
+    item = aat_cursor_first(&root, &cursor);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int64_t start = bench_tick(run, i);
+        item = item ? aat_cursor_next(&cursor) : 
+            aat_cursor_first(&root, &cursor);
+        bench_tock(run, start);
     }
+    bench_end(run);
 
-    shuffle(keys, N, sizeof(int));
-    start = getnow();
-    for (int i = 0; i < N; i++) {
-        aat_delete_first(&root);
+    root = 0;
+    shuffle(keys, n, sizeof(int));
+    bench_begin(run, "insert-rand", n, n);
+    for (size_t i = 0; i < n; i++) {
+        int64_t start = bench_tick(run, i);
+        aat_insert(&root, &nodes[keys[i]]);
+        bench_tock(run, start);
     }
-    elapsed = (getnow()-start)/1e9;
-    fprintf(stderr, "delete-first: %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
-        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
+    bench_end(run);
 
-    shuffle(nodes, N, sizeof(struct aat_node));
-    for (int i = 0; i < N; i++) {
-        assert(!aat_insert(&root, &nodes[i]));
+    bench_begin(run, "search-rand", n, BENCH_OPS);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int key = bench_rand(n);
+        int64_t start = bench_tick(run, i);
+        item = aat_search(&root, key_node(key));
+        bench_tock(run, start);
+        assert(item == &nodes[key]);
     }
-    shuffle(keys, N, sizeof(int));
-    start = getnow();
-    for (int i = 0; i < N; i++) {
-        assert(aat_delete_last(&root)->key == N-i-1);
+    bench_end(run);
+
+    // the hottest keys are spread over the tree by the shuffled keys
+    bench_begin(run, "search-zipf", n, BENCH_OPS);
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        int key = keys[bench_zipf(n)];
+        int64_t start = bench_tick(run, i);
+        item = aat_search(&root, key_node(key));
+        bench_tock(run, start);
+        assert(item == &nodes[key]);
+    }
+    bench_end(run);
+
+    // a write deletes a random item and inserts it back
+    static const struct { const char *name; int reads; } mixes[] = {
+        { "mixed-r95-w5", 95 }, { "mixed-r50-w50", 50 }, { "mixed-r5-w95", 5 },
+    };
+    for (size_t m = 0; m < sizeof(mixes)/sizeof(mixes[0]); m++) {
+        bench_begin(run, mixes[m].name, n, BENCH_OPS);
+        for (size_t i = 0; i < BENCH_OPS; i++) {
+            int key = bench_rand(n);
+            int read = (int)bench_rand(100) < mixes[m].reads;
+            int64_t start = bench_tick(run, i);
+            if (read) {
+                item = aat_search(&root, key_node(key));
+            } else {
+                item = aat_delete(&root, key_node(key));
+                aat_insert(&root, item);
+            }
+            bench_tock(run, start);
+            assert(item == &nodes[key]);
+        }
+        bench_end(run);
     }
-    elapsed = (getnow()-start)/1e9;
-    fprintf(stderr, "delete-last:  %d items in %.2f secs, %.2f ns/op, %.0f/sec\n", 
-        N, elapsed, elapsed*1e9/(double)N, (double)N/elapsed);
 
+    size_t scans = BENCH_OPS/BENCH_SCAN;
+    bench_begin(run, "scan-100", n, scans);
+    for (size_t i = 0; i < scans; i++) {
+        int key = bench_rand(n);
+        size_t count = 0;
+        int64_t start = bench_tick(run, i);
+        aat_scan(&root, key_node(key), key_node(key+BENCH_SCAN), 
+            bench_scan_iter, &count);
+        bench_tock(run, start);
+        assert(count == (n-key < BENCH_SCAN ? n-key : BENCH_SCAN));
+    }
+    bench_end(run);
+
+    shuffle(keys, n, sizeof(int));
+    bench_begin(run, "delete-rand", n, n);
+    for (size_t i = 0; i < n; i++) {
+        int64_t start = bench_tick(run, i);
+        item = aat_delete(&root, key_node(keys[i]));
+        bench_tock(run, start);
+        assert(item == &nodes[keys[i]]);
+    }
+    bench_end(run);
+    assert(!root);
+}
 
+static void bench_suite(size_t maxn) {
+    struct bench_run run;
+    run.samples = malloc(BENCH_SAMPLES*sizeof(int64_t));
+    assert(run.samples);
+    run.overhead = bench_clock_overhead();
+    bench_perf_init();
+    fprintf(stderr, "node-size: %zu bytes, clock-overhead: %lld ns\n", 
+        sizeof(struct aat_node), (long long)run.overhead);
+    printf("workload,n,ops,mean_ns,p50_ns,p99_ns,p999_ns,"
+        "cache_misses_per_op,branch_misses_per_op\n");
+    for (size_t n = 1000; n <= maxn; n *= 10) {
+        struct aat_node *nodes = malloc(n*sizeof(struct aat_node));
+        int *keys = malloc(n*sizeof(int));
+        if (!nodes || !keys) {
+            fprintf(stderr, "out of memory for %zu items\n", n);
+            free(nodes);
+            free(keys);
+            break;
+        }
+        memset(nodes, 0, n*sizeof(struct aat_node));
+        bench_size(&run, nodes, keys, n);
+        free(keys);
+        free(nodes);
+    }
+    free(run.samples);
 }
 
 int main(int argc, char *argv[]) {
@@ -212,6 +2328,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Running benchmarks...\n");
         bench();
         return 0;
+    } else if (argc > 1 && strcmp(argv[1], "bench-suite") == 0) {
+        fprintf(stderr, "Running benchmark suite...\n");
+        bench_suite(argc > 2 ? strtoull(argv[2], 0, 10) : 100000000);
+        return 0;
     } else {
         fprintf(stderr, "For benchmarks provide the 'bench' argument.\n");
     }
@@ -385,6 +2505,699 @@ int main(int argc, char *argv[]) {
         assert(iter->key == i);
     }
 
+    // cursors
+    struct aat_cursor cursor;
+    iter = aat_cursor_first(&root, &cursor);
+    for (int i = 0; i < N*10; i += 10) {
+        assert(iter && iter->key == i);
+        assert(aat_cursor_item(&cursor) == iter);
+        iter = aat_cursor_next(&cursor);
+    }
+    assert(!iter);
+    assert(!aat_cursor_next(&cursor));
+
+    iter = aat_cursor_last(&root, &cursor);
+    for (int i = (N-1)*10; i >= 0; i -= 10) {
+        assert(iter && iter->key == i);
+        iter = aat_cursor_prev(&cursor);
+    }
+    assert(!iter);
+    assert(!aat_cursor_prev(&cursor));
+
+    for (int i = -9; i < N*10; i++) {
+        iter = aat_cursor_seek(&root, &cursor, key_node(i));
+        assert(iter == aat_iter(&root, key_node(i)));
+        if (iter) {
+            assert(aat_cursor_next(&cursor) == aat_next(&root, iter));
+            aat_cursor_seek(&root, &cursor, key_node(i));
+            assert(aat_cursor_prev(&cursor) == aat_prev(&root, iter));
+        }
+    }
+
+    struct aat_node *empty = 0;
+    assert(!aat_cursor_first(&empty, &cursor));
+    assert(!aat_cursor_last(&empty, &cursor));
+    assert(!aat_cursor_seek(&empty, &cursor, key_node(0)));
+
+    // seek from the previous position, wandering through nearby keys
+    cursor.depth = 0;
+    int wander = rand()%(N*10);
+    for (int i = 0; i < 10000; i++) {
+        wander += rand()%41-20;
+        wander = wander < -9 ? -9 : wander > N*10 ? N*10 : wander;
+        iter = aat_cursor_seek_from(&root, &cursor, key_node(wander));
+        assert(iter == aat_iter(&root, key_node(wander)));
+        if (iter && i%2 == 0) {
+            assert(aat_cursor_next(&cursor) == aat_next(&root, iter));
+        }
+        assert(aat_search_from(&root, &cursor, key_node(wander)) == 
+            aat_search(&root, key_node(wander)));
+    }
+    cursor.depth = 0;
+    assert(!aat_search_from(&empty, &cursor, key_node(0)));
+
+    // insert near the previous position, in shuffled runs of nearby keys
+    struct aat_node *hinted = malloc(N*2*sizeof(struct aat_node));
+    assert(hinted);
+    memset(hinted, 0, N*2*sizeof(struct aat_node));
+    for (int i = 0; i < N*2; i++) {
+        hinted[i].key = i%N;
+    }
+    for (int h = 0; h < N*2; h += N) {
+        for (int i = 0; i < N; i += 16) {
+            shuffle(&hinted[h+i], N-i < 16 ? N-i : 16, sizeof(struct aat_node));
+        }
+    }
+    struct aat_node *hroot = 0;
+    cursor.depth = 0;
+    for (int i = 0; i < N*2; i++) {
+        struct aat_node *prev = aat_insert_hint(&hroot, &cursor, &hinted[i]);
+        assert(!prev == (i < N));
+        assert(!prev || prev->key == hinted[i].key);
+    }
+    aat_valid(&hroot);
+    iter = aat_first(&hroot);
+    for (int i = 0; i < N; i++) {
+        assert(iter && iter->key == i && iter >= &hinted[N]);
+        iter = aat_next(&hroot, iter);
+    }
+    assert(!iter);
+    free(hinted);
+
+    // clone the tree, then clear the clone
+    struct aat_node *cloned = malloc(N*sizeof(struct aat_node));
+    assert(cloned);
+    struct make_ctx clone = { .pool = cloned, .limit = N };
+    struct aat_node *croot = 0;
+    assert(aat_clone(&root, &croot, make_node, free_node, &clone));
+    assert(clone.count == N);
+    aat_valid(&croot);
+    same_shape(root, croot);
+    aat_clear_all(&croot, free_node, &clone);
+    assert(!croot && clone.freed == N);
+    struct aat_node *empty_clone = key_node(0);
+    assert(aat_clone(&empty, &empty_clone, make_node, free_node, &clone));
+    assert(!empty_clone);
+
+    // a failed clone frees the copies that it made
+    for (int limit = 0; limit < N; limit += 97) {
+        clone = (struct make_ctx){ .pool = cloned, .limit = limit };
+        croot = 0;
+        assert(!aat_clone(&root, &croot, make_node, free_node, &clone));
+        assert(!croot && clone.freed == limit);
+    }
+    free(cloned);
+
+    // build from sorted items
+    struct aat_node **items = malloc(N*sizeof(struct aat_node*));
+    assert(items);
+    for (int n = 0; n <= N; n++) {
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        for (int i = 0; i < n; i++) {
+            nodes[i].key = i;
+            items[i] = &nodes[i];
+        }
+        root = 0;
+        aat_build_sorted(&root, items, n);
+        aat_valid(&root);
+        iter = aat_first(&root);
+        for (int i = 0; i < n; i++) {
+            assert(iter == &nodes[i]);
+            iter = aat_next(&root, iter);
+        }
+        assert(!iter);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(aat_delete(&root, key_node(i))->key == i);
+        aat_valid(&root);
+    }
+
+    // insert sorted batches, first the even keys and then all keys
+    struct aat_node *nodes2 = malloc(N*sizeof(struct aat_node));
+    assert(nodes2);
+    struct aat_node **replaced = malloc(N*sizeof(struct aat_node*));
+    assert(replaced);
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    memset(nodes2, 0, N*sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+        nodes2[i].key = i;
+    }
+    int n = 0;
+    for (int i = 0; i < N; i += 2) {
+        items[n++] = &nodes[i];
+    }
+    root = 0;
+    assert(aat_insert_batch(&root, items, n, 0) == 0);
+    aat_valid(&root);
+    for (int i = 0; i < N; i++) {
+        items[i] = &nodes2[i];
+    }
+    assert(aat_insert_batch(&root, items, N, replaced) == (size_t)n);
+    aat_valid(&root);
+    for (int i = 0; i < N; i++) {
+        assert(replaced[i] == (i%2 == 0 ? &nodes[i] : 0));
+        assert(aat_search(&root, key_node(i)) == &nodes2[i]);
+    }
+
+    // insert random sorted batches into a random tree
+    for (int i = 0; i < 100; i++) {
+        root = 0;
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        n = 0;
+        for (int j = 0; j < N; j++) {
+            nodes[j].key = j;
+            if (rand()%2) {
+                aat_insert(&root, &nodes[j]);
+            } else if (rand()%4 == 0) {
+                items[n++] = &nodes[j];
+            }
+        }
+        assert(aat_insert_batch(&root, items, n, 0) == 0);
+        aat_valid(&root);
+        for (int j = 0; j < n; j++) {
+            assert(aat_search(&root, items[j]) == items[j]);
+        }
+    }
+    free(replaced);
+    free(nodes2);
+    free(items);
+
+    // random mix of inserts and deletes on a small key space
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    for (int i = 0; i < N*20; i++) {
+        struct aat_node *node = &nodes[rand()%64];
+        switch (rand()%4) {
+        case 0: case 1:
+            aat_insert(&root, node);
+            break;
+        case 2:
+            aat_delete(&root, node);
+            break;
+        default:
+            if (rand()%2) {
+                aat_delete_first(&root);
+            } else {
+                aat_delete_last(&root);
+            }
+            break;
+        }
+        aat_valid(&root);
+    }
+
+    // scan random ranges in both directions, stopping at random limits
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    char *in = malloc(N);
+    assert(in);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+        in[i] = rand()%2;
+        if (in[i]) {
+            aat_insert(&root, &nodes[i]);
+        }
+    }
+    struct scan_ctx ctx = { .keys = malloc(N*sizeof(int)) };
+    assert(ctx.keys);
+    for (int i = 0; i < 1000; i++) {
+        int lo = rand()%(N*2+2)-1;
+        int hi = rand()%(N*2+2)-1;
+        struct aat_node *lokey = rand()%8 ? key_node(lo) : 0;
+        struct aat_node *hikey = rand()%8 ? key_node(hi) : 0;
+        int reverse = rand()%2;
+        ctx.count = 0;
+        ctx.limit = rand()%4 ? N : rand()%10+1;
+        if (reverse) {
+            aat_scan_reverse(&root, lokey, hikey, scan_iter, &ctx);
+        } else {
+            aat_scan(&root, lokey, hikey, scan_iter, &ctx);
+        }
+        int count = 0;
+        for (int j = 0; j < N && count < ctx.limit; j++) {
+            int k = reverse ? N-1-j : j;
+            if (in[k] && (!lokey || k*2 >= lo) && (!hikey || k*2 < hi)) {
+                assert(count < ctx.count && ctx.keys[count] == k*2);
+                count++;
+            }
+        }
+        assert(count == ctx.count);
+    }
+    free(ctx.keys);
+
+    // delete random ranges and check both of the resulting trees
+    for (int i = 0; i < 100; i++) {
+        root = 0;
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        for (int j = 0; j < N; j++) {
+            nodes[j].key = j*2;
+            in[j] = rand()%2;
+            if (in[j]) {
+                aat_insert(&root, &nodes[j]);
+            }
+        }
+        int lo = rand()%(N*2+2)-1;
+        int hi = rand()%(N*2+2)-1;
+        struct aat_node *lokey = rand()%8 ? key_node(lo) : 0;
+        struct aat_node *hikey = rand()%8 ? key_node(hi) : 0;
+        struct aat_node *removed = aat_delete_range(&root, lokey, hikey);
+        aat_valid(&root);
+        aat_valid(&removed);
+        for (int j = 0; j < N; j++) {
+            int inrange = (!lokey || j*2 >= lo) && (!hikey || j*2 < hi) &&
+                (!lokey || !hikey || lo < hi);
+            assert(aat_search(&root, key_node(j*2)) == 
+                (in[j] && !inrange ? &nodes[j] : 0));
+            assert(aat_search(&removed, key_node(j*2)) == 
+                (in[j] && inrange ? &nodes[j] : 0));
+        }
+    }
+
+    // split random trees at random keys and join them back together
+    for (int i = 0; i < 100; i++) {
+        root = 0;
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        int count = 0;
+        for (int j = 0; j < N; j++) {
+            nodes[j].key = j*2;
+            in[j] = rand()%2;
+            if (in[j]) {
+                aat_insert(&root, &nodes[j]);
+                count++;
+            }
+        }
+        int key = rand()%(N*2+2)-1;
+        struct aat_node *left = 0;
+        struct aat_node *right = 0;
+        aat_split_at(&root, key_node(key), &left, &right);
+        assert(!root);
+        aat_valid(&left);
+        aat_valid(&right);
+        for (int j = 0; j < N; j++) {
+            assert(aat_search(&left, key_node(j*2)) == 
+                (in[j] && j*2 < key ? &nodes[j] : 0));
+            assert(aat_search(&right, key_node(j*2)) == 
+                (in[j] && j*2 >= key ? &nodes[j] : 0));
+        }
+        struct aat_node *pivot = rand()%2 ? aat_delete_first(&right) : 0;
+        aat_join(&left, pivot, &right);
+        assert(!right);
+        aat_valid(&left);
+        for (int j = 0; j < N; j++) {
+            assert(aat_search(&left, key_node(j*2)) == 
+                (in[j] ? &nodes[j] : 0));
+        }
+    }
+
+    // join trees of very different heights
+    for (int i = 0; i < 1000; i++) {
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        int n = rand()%(N-4);
+        int m = rand()%2 ? rand()%(N-n) : rand()%4;
+        if (rand()%2) {
+            int t = n;
+            n = m;
+            m = t;
+        }
+        struct aat_node *left = 0;
+        struct aat_node *right = 0;
+        for (int j = 0; j < n+1+m; j++) {
+            nodes[j].key = j;
+            if (j < n) {
+                aat_insert(&left, &nodes[j]);
+            } else if (j > n) {
+                aat_insert(&right, &nodes[j]);
+            }
+        }
+        aat_join(&left, &nodes[n], &right);
+        aat_valid(&left);
+        for (int j = 0; j < n+1+m; j++) {
+            assert(aat_search(&left, key_node(j)) == &nodes[j]);
+        }
+    }
+
+    // relayout into a buffer and use the copy while the original stays intact
+    for (int i = 0; i < 10; i++) {
+        root = 0;
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        int count = 0;
+        for (int j = 0; j < N; j++) {
+            nodes[j].key = j;
+            in[j] = rand()%4 > 0;
+            if (in[j]) {
+                aat_insert(&root, &nodes[j]);
+                count++;
+            }
+        }
+        struct aat_node *dst = malloc(N*sizeof(struct aat_node));
+        assert(dst);
+        struct aat_node *copy = root;
+        assert(aat_relayout(&copy, dst) == (size_t)count);
+        assert(count == 0 || copy == dst);
+        aat_valid(&root);
+        aat_valid(&copy);
+        for (int j = 0; j < N; j++) {
+            struct aat_node *found = aat_search(&copy, key_node(j));
+            assert(in[j] ? found >= dst && found < dst+count : !found);
+            assert(aat_search(&root, key_node(j)) == (in[j] ? &nodes[j] : 0));
+        }
+        for (int j = 0; j < N; j++) {
+            if (in[j]) {
+                assert(aat_delete(&copy, key_node(j))->key == j);
+                aat_valid(&copy);
+            }
+        }
+        assert(!copy);
+        free(dst);
+    }
+
+    // freeze random trees and compare with searching the tree itself
+    int *frozen_keys = malloc(N*sizeof(int));
+    assert(frozen_keys);
+    struct aat_node **frozen_items = malloc(N*sizeof(struct aat_node*));
+    assert(frozen_items);
+    for (int i = 0; i < 20; i++) {
+        root = 0;
+        memset(nodes, 0, N*sizeof(struct aat_node));
+        int count = 0;
+        int n = rand()%(N+1);
+        for (int j = 0; j < n; j++) {
+            nodes[j].key = j*2;
+            if (rand()%2) {
+                aat_insert(&root, &nodes[j]);
+                count++;
+            }
+        }
+        if (count > 0) {
+            assert(aat_freeze(&root, frozen_keys, frozen_items, count-1) == 
+                (size_t)count);
+        }
+        assert(aat_freeze(&root, frozen_keys, frozen_items, N) == 
+            (size_t)count);
+        for (int j = -1; j <= n*2; j++) {
+            assert(aat_frozen_lower_bound(frozen_keys, frozen_items, count, j)
+                == aat_iter(&root, key_node(j)));
+            assert(aat_frozen_search(frozen_keys, frozen_items, count, j) == 
+                aat_search(&root, key_node(j)));
+        }
+    }
+    free(frozen_items);
+    free(frozen_keys);
+
+    // search many keys at once, some missing
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+        aat_insert(&root, &nodes[i]);
+    }
+    struct aat_node *many_keys = malloc(N*sizeof(struct aat_node));
+    assert(many_keys);
+    struct aat_node **many_ptrs = malloc(N*sizeof(struct aat_node*));
+    assert(many_ptrs);
+    struct aat_node **many_found = malloc(N*sizeof(struct aat_node*));
+    assert(many_found);
+    for (int i = 0; i < N; i++) {
+        many_keys[i].key = rand()%(N*2+2)-1;
+        many_ptrs[i] = &many_keys[i];
+    }
+    for (int n = 0; n <= 40; n++) {
+        aat_search_many(&root, many_ptrs, many_found, n);
+        for (int i = 0; i < n; i++) {
+            assert(many_found[i] == aat_search(&root, many_ptrs[i]));
+        }
+    }
+    aat_search_many(&root, many_ptrs, many_found, N);
+    for (int i = 0; i < N; i++) {
+        assert(many_found[i] == aat_search(&root, many_ptrs[i]));
+    }
+    free(many_found);
+    free(many_ptrs);
+    free(many_keys);
+
+    // remove nodes by pointer and through a cursor
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+        in[i] = 1;
+        aat_insert(&root, &nodes[i]);
+    }
+    for (int i = 0; i < N; i++) {
+        int j = rand()%N;
+        assert(aat_remove_node(&root, &nodes[j]) == (in[j] ? &nodes[j] : 0));
+        in[j] = 0;
+        aat_valid(&root);
+    }
+    struct aat_node *item = aat_cursor_first(&root, &cursor);
+    while (item) {
+        int key = item->key;
+        if (rand()%2) {
+            assert(aat_cursor_remove(&root, &cursor) == item);
+            assert(!aat_cursor_item(&cursor));
+            in[key] = 0;
+            aat_valid(&root);
+            item = aat_cursor_seek(&root, &cursor, key_node(key));
+        } else {
+            item = aat_cursor_next(&cursor);
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        assert(aat_search(&root, key_node(i)) == (in[i] ? &nodes[i] : 0));
+    }
+
+    // get or insert, with an item and with a function that makes one
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    for (int i = 0; i < N*2; i++) {
+        int j = rand()%N;
+        struct aat_node *item = &(struct aat_node){ .key = j };
+        int inserted = -1;
+        struct aat_node *got = aat_get_or_insert(&root, in[j] ? item : 
+            &nodes[j], &inserted);
+        assert(got == &nodes[j]);
+        assert(inserted == !in[j]);
+        in[j] = 1;
+        aat_valid(&root);
+    }
+    root = 0;
+    struct make_ctx make = { .pool = nodes, .limit = N/2 };
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    memset(in, 0, N);
+    for (int i = 0; i < N*2; i++) {
+        int j = rand()%N;
+        int inserted = -1;
+        int count = make.count;
+        struct aat_node *got = aat_get_or_insert_with(&root, key_node(j), 
+            make_node, &make, &inserted);
+        if (in[j]) {
+            assert(got && got->key == j && !inserted && make.count == count);
+        } else if (count < make.limit) {
+            assert(got && got->key == j && inserted && make.count == count+1);
+            in[j] = 1;
+        } else {
+            assert(!got && !inserted);
+        }
+        assert(aat_search(&root, key_node(j)) == got);
+        aat_valid(&root);
+    }
+    assert(aat_get_or_insert(&root, &nodes[0], 0) == &nodes[0]);
+
+    // tree handle with cached first and last items
+    struct aat_tree tree = { 0 };
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    memset(in, 0, N);
+    size_t count = 0;
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i;
+    }
+    assert(!aat_tree_first(&tree) && !aat_tree_last(&tree));
+    assert(!aat_tree_delete_first(&tree) && !aat_tree_delete_last(&tree));
+    for (int i = 0; i < N*10; i++) {
+        int j = rand()%N;
+        struct aat_node *item;
+        switch (rand()%5) {
+        case 0: case 1:
+            assert(aat_tree_insert(&tree, &nodes[j]) == 
+                (in[j] ? &nodes[j] : 0));
+            count += !in[j];
+            in[j] = 1;
+            break;
+        case 2:
+            assert(aat_tree_delete(&tree, key_node(j)) == 
+                (in[j] ? &nodes[j] : 0));
+            count -= in[j];
+            in[j] = 0;
+            break;
+        case 3:
+            assert(aat_tree_remove_node(&tree, &nodes[j]) == 
+                (in[j] ? &nodes[j] : 0));
+            count -= in[j];
+            in[j] = 0;
+            break;
+        default:
+            item = rand()%2 ? aat_tree_delete_first(&tree) : 
+                aat_tree_delete_last(&tree);
+            if (item) {
+                assert(in[item->key]);
+                in[item->key] = 0;
+                count--;
+            } else {
+                assert(count == 0);
+            }
+        }
+        assert(aat_tree_first(&tree) == aat_first(&tree.root));
+        assert(aat_tree_last(&tree) == aat_last(&tree.root));
+        assert(aat_tree_count(&tree) == count);
+        aat_valid(&tree.root);
+    }
+    item = aat_delete_last(&tree.root);
+    if (item) {
+        in[item->key] = 0;
+        count--;
+    }
+    count += !in[0];
+    aat_insert(&tree.root, &nodes[0]);
+    aat_tree_sync(&tree);
+    assert(aat_tree_first(&tree) == &nodes[0]);
+    assert(aat_tree_last(&tree) == aat_last(&tree.root));
+    assert(aat_tree_count(&tree) == count);
+
+    // union, intersect and difference
+    nodes2 = malloc(N*sizeof(struct aat_node));
+    char *in2 = malloc(N);
+    assert(nodes2 && in2);
+    for (int i = 0; i < 200; i++) {
+        int every[] = { 0, 1, 2, 10, 100 };
+        int a = every[rand()%5];
+        int b = every[rand()%5];
+        struct aat_node *other, *removed;
+        int calls = 0;
+        fill_some(&root, nodes, in, N, a);
+        fill_some(&other, nodes2, in2, N, b);
+        removed = aat_union(&root, &other, keep_even, &calls);
+        aat_valid(&root);
+        aat_valid(&removed);
+        assert(!other);
+        for (int j = 0; j < N; j++) {
+            struct aat_node *item = aat_search(&root, key_node(j));
+            struct aat_node *loser = aat_search(&removed, key_node(j));
+            calls -= in[j] && in2[j];
+            if (in[j] && in2[j]) {
+                assert(item == (j%2 == 0 ? &nodes[j] : &nodes2[j]));
+                assert(loser == (j%2 == 0 ? &nodes2[j] : &nodes[j]));
+            } else {
+                assert(item == (in[j] ? &nodes[j] : in2[j] ? &nodes2[j] : 0));
+                assert(!loser);
+            }
+        }
+        assert(calls == 0);
+
+        fill_some(&root, nodes, in, N, a);
+        fill_some(&other, nodes2, in2, N, b);
+        removed = aat_intersect(&root, &other);
+        aat_valid(&root);
+        aat_valid(&removed);
+        aat_valid(&other);
+        for (int j = 0; j < N; j++) {
+            assert(aat_search(&root, key_node(j)) == 
+                (in[j] && in2[j] ? &nodes[j] : 0));
+            assert(aat_search(&removed, key_node(j)) == 
+                (in[j] && !in2[j] ? &nodes[j] : 0));
+            assert(aat_search(&other, key_node(j)) == 
+                (in2[j] ? &nodes2[j] : 0));
+        }
+
+        fill_some(&root, nodes, in, N, a);
+        fill_some(&other, nodes2, in2, N, b);
+        removed = aat_difference(&root, &other);
+        aat_valid(&root);
+        aat_valid(&removed);
+        aat_valid(&other);
+        for (int j = 0; j < N; j++) {
+            assert(aat_search(&root, key_node(j)) == 
+                (in[j] && !in2[j] ? &nodes[j] : 0));
+            assert(aat_search(&removed, key_node(j)) == 
+                (in[j] && in2[j] ? &nodes[j] : 0));
+            assert(aat_search(&other, key_node(j)) == 
+                (in2[j] ? &nodes2[j] : 0));
+        }
+    }
+    // with no conflict function the item in the first tree is kept
+    fill_some(&root, nodes, in, N, 1);
+    struct aat_node *other = 0;
+    struct aat_node copy = { .key = 5 };
+    aat_insert(&other, &copy);
+    assert(aat_union(&root, &other, 0, 0) == &copy);
+    assert(aat_search(&root, key_node(5)) == &nodes[5]);
+    free(in2);
+    free(nodes2);
+
+#ifdef AAT_ATOMIC
+    // reads and writes through a sequence lock
+    struct aat_seqlock lock = { 0 };
+    root = 0;
+    memset(nodes, 0, N*sizeof(struct aat_node));
+    memset(in, 0, N);
+    for (int i = 0; i < N; i++) {
+        nodes[i].key = i*2;
+    }
+    for (int i = 0; i < N; i++) {
+        int j = rand()%N;
+        if (rand()%3) {
+            assert(aat_seq_insert(&lock, &root, &nodes[j]) == 
+                (in[j] ? &nodes[j] : 0));
+            in[j] = 1;
+        } else {
+            assert(aat_seq_delete(&lock, &root, key_node(j*2)) == 
+                (in[j] ? &nodes[j] : 0));
+            in[j] = 0;
+        }
+        assert(lock.seq == (unsigned)(i+1)*2);
+        assert(aat_seq_first(&lock, &root) == aat_first(&root));
+        assert(aat_seq_last(&lock, &root) == aat_last(&root));
+        j = rand()%N;
+        assert(aat_seq_search(&lock, &root, key_node(j*2)) == 
+            (in[j] ? &nodes[j] : 0));
+        assert(aat_seq_iter(&lock, &root, key_node(j*2-1)) == 
+            aat_iter(&root, key_node(j*2-1)));
+        aat_valid(&root);
+    }
+    unsigned seq = aat_seqlock_read_begin(&lock);
+    assert(!aat_seqlock_read_retry(&lock, seq));
+    aat_seqlock_write_begin(&lock);
+    assert(lock.seq&1);
+    aat_seqlock_write_end(&lock);
+    assert(aat_seqlock_read_retry(&lock, seq));
+#endif
+    free(in);
+
+    test_parent();
+    test_counted();
+    test_persist();
+    test_pool();
+#ifdef AAT_STATS
+    test_stats();
+#endif
+#ifdef AAT_PARALLEL
+    test_parallel();
+#endif
+#if defined(AAT_PARALLEL) && defined(AAT_ATOMIC)
+    test_seqlock_threads();
+#endif
+    test_augmented();
+    test_compact();
+    test_indexed();
+    test_key();
+    test_multi();
+
     fprintf(stderr, "PASSED\n");
 
     return 0;
@@ -0,0 +1,330 @@
+// Tests for aat.hpp.
+//
+// c++ -std=c++17 -Wall -Wextra test.cpp && ./a.out
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include "aat.hpp"
+
+struct item {
+    int key;
+    int count;
+    aat::hook<item> hook;
+    aat::parent_hook<item> phook;
+    aat::hook<item> chook;
+    bool operator<(const item &other) const {
+        return key < other.key;
+    }
+};
+
+struct reverse_compare {
+    int operator()(const item &a, const item &b) const {
+        return a.key < b.key ? 1 : a.key > b.key ? -1 : 0;
+    }
+};
+
+struct parent_options : aat::options {
+    static constexpr bool parent_links = true;
+};
+
+struct counted_options : aat::options {
+    static constexpr bool augmented = true;
+    static void update(item *node) {
+        node->count = 1;
+        if (node->chook.left) {
+            node->count += node->chook.left->count;
+        }
+        if (node->chook.right) {
+            node->count += node->chook.right->count;
+        }
+    }
+};
+
+struct stats_options : aat::options {
+    static constexpr bool stats = true;
+};
+
+using plain_tree = aat::tree<item, &item::hook>;
+using reverse_tree = aat::tree<item, &item::hook, reverse_compare>;
+using parent_tree = aat::tree<item, &item::phook, aat::less_compare<item>,
+    parent_options>;
+using counted_tree = aat::tree<item, &item::chook, aat::less_compare<item>,
+    counted_options>;
+using stats_tree = aat::tree<item, &item::hook, aat::less_compare<item>,
+    stats_options>;
+
+static const int N = 10000;
+
+static std::vector<item> make_items() {
+    std::vector<item> items(N);
+    for (int i = 0; i < N; i++) {
+        items[i].key = i*2;
+    }
+    for (int i = N-1; i > 0; i--) {
+        std::swap(items[i].key, items[rand()%(i+1)].key);
+    }
+    return items;
+}
+
+static int valid_levels(item *node, aat::hook<item> item::*hook) {
+    if (!node) {
+        return 0;
+    }
+    item *left = (node->*hook).left;
+    item *right = (node->*hook).right;
+    int level = (node->*hook).level;
+    if (left) {
+        assert((left->*hook).level == level-1);
+    }
+    if (right) {
+        assert((right->*hook).level == level ||
+            (right->*hook).level == level-1);
+        if ((right->*hook).right) {
+            assert(((right->*hook).right->*hook).level < level);
+        }
+    }
+    return 1 + valid_levels(left, hook) + valid_levels(right, hook);
+}
+
+static int valid_parents(item *node, item *parent) {
+    if (!node) {
+        return 0;
+    }
+    assert(node->phook.parent == parent);
+    return 1 + valid_parents(node->phook.left, node) +
+        valid_parents(node->phook.right, node);
+}
+
+static int valid_counts(item *node) {
+    if (!node) {
+        return 0;
+    }
+    int count = 1 + valid_counts(node->chook.left) +
+        valid_counts(node->chook.right);
+    assert(node->count == count);
+    return count;
+}
+
+template <class Tree>
+static void test_iterators(Tree &tree, int n) {
+    int i = 0;
+    for (item &x : tree) {
+        assert(x.key == i*2);
+        i++;
+    }
+    assert(i == n);
+    for (auto iter = tree.rbegin(); iter != tree.rend(); ++iter) {
+        i--;
+        assert(iter->key == i*2);
+    }
+    assert(i == 0);
+    assert(std::distance(tree.begin(), tree.end()) == n);
+    if (n > 0) {
+        auto iter = tree.end();
+        --iter;
+        assert(iter->key == (n-1)*2);
+        auto copy = iter--;
+        assert(copy->key == (n-1)*2);
+        assert(n == 1 ? iter == tree.end() : iter->key == (n-2)*2);
+    }
+    for (int j = -1; j < n*2+1; j++) {
+        item key;
+        key.key = j;
+        auto iter = tree.lower_bound(key);
+        int want = (j+1)/2*2;
+        if (want >= n*2) {
+            assert(iter == tree.end());
+        } else {
+            assert(iter->key == want);
+        }
+    }
+}
+
+static void test_plain() {
+    std::vector<item> items = make_items();
+    plain_tree tree;
+    assert(tree.empty());
+    assert(tree.begin() == tree.end());
+    for (int i = 0; i < N; i++) {
+        assert(!tree.insert(&items[i]));
+    }
+    assert(valid_levels(tree.root(), &item::hook) == N);
+    test_iterators(tree, N);
+    for (int i = 0; i < N; i++) {
+        item key;
+        key.key = i*2;
+        assert(tree.find(key)->key == i*2);
+        key.key = i*2+1;
+        assert(!tree.find(key));
+    }
+    assert(tree.first()->key == 0);
+    assert(tree.last()->key == (N-1)*2);
+
+    item dup = items[0];
+    assert(tree.insert(&dup) == &items[0]);
+    assert(tree.insert(&items[0]) == &dup);
+
+    plain_tree moved = std::move(tree);
+    assert(tree.empty());
+    assert(std::is_sorted(moved.begin(), moved.end()));
+
+    for (int i = 0; i < N; i += 2) {
+        assert(moved.erase(items[i]) == &items[i]);
+        assert(!moved.erase(items[i]));
+    }
+    for (int i = 1; i < N; i += 4) {
+        assert(moved.remove(&items[i]) == &items[i]);
+    }
+    assert(valid_levels(moved.root(), &item::hook) == N/4);
+    int n = 0;
+    while (!moved.empty()) {
+        item *first = moved.first();
+        item *last = moved.last();
+        assert(n%2 ? moved.pop_first() == first : moved.pop_last() == last);
+        n++;
+    }
+    assert(n == N/4);
+
+    for (int i = 0; i < N; i++) {
+        tree.insert(&items[i]);
+    }
+    tree.clear();
+    assert(tree.empty());
+    assert(!items[0].hook.left && !items[0].hook.right);
+}
+
+static void test_multi() {
+    std::vector<item> items(N);
+    for (int i = 0; i < N; i++) {
+        items[i].key = rand()%50;
+    }
+    plain_tree tree;
+    for (int i = 0; i < N; i++) {
+        tree.insert_multi(&items[i]);
+    }
+    assert(std::is_sorted(tree.begin(), tree.end()));
+    std::vector<item*> order;
+    for (int i = 0; i < N; i++) {
+        order.push_back(&items[i]);
+    }
+    for (int i = N-1; i > 0; i--) {
+        std::swap(order[i], order[rand()%(i+1)]);
+    }
+    for (int i = 0; i < N; i++) {
+        assert(tree.remove(order[i]) == order[i]);
+        assert(!tree.remove(order[i]));
+        assert(valid_levels(tree.root(), &item::hook) == N-i-1);
+    }
+    assert(tree.empty());
+}
+
+static void test_reverse() {
+    std::vector<item> items = make_items();
+    reverse_tree tree;
+    for (int i = 0; i < N; i++) {
+        tree.insert(&items[i]);
+    }
+    int i = N;
+    for (item &x : tree) {
+        i--;
+        assert(x.key == i*2);
+    }
+    assert(i == 0);
+    tree.clear();
+}
+
+static void test_parent() {
+    std::vector<item> items = make_items();
+    parent_tree tree;
+    for (int i = 0; i < N; i++) {
+        tree.insert(&items[i]);
+    }
+    assert(valid_parents(tree.root(), nullptr) == N);
+    test_iterators(tree, N);
+    parent_tree other;
+    item foreign;
+    foreign.key = 1;
+    assert(!tree.remove(&foreign));
+    other.insert(&foreign);
+    assert(!tree.remove(&foreign));
+    assert(valid_parents(tree.root(), nullptr) == N);
+    assert(other.remove(&foreign) == &foreign);
+    for (int i = 0; i < N; i += 2) {
+        assert(tree.remove(&items[i]) == &items[i]);
+    }
+    assert(valid_parents(tree.root(), nullptr) == N/2);
+    assert(std::is_sorted(tree.begin(), tree.end()));
+    tree.clear();
+}
+
+static void test_counted() {
+    std::vector<item> items = make_items();
+    counted_tree tree;
+    for (int i = 0; i < N; i++) {
+        tree.insert(&items[i]);
+        if (i%100 == 0) {
+            assert(valid_counts(tree.root()) == i+1);
+        }
+    }
+    assert(valid_counts(tree.root()) == N);
+    test_iterators(tree, N);
+    for (int i = 0; i < N; i += 3) {
+        tree.erase(items[i]);
+    }
+    assert(valid_counts(tree.root()) == N-(N+2)/3);
+    tree.clear();
+}
+
+static void test_stats() {
+    std::vector<item> items = make_items();
+    stats_tree tree;
+    stats_tree::stats() = aat_stats();
+    for (int i = 0; i < N; i++) {
+        tree.insert(&items[i]);
+    }
+    aat_stats stats = stats_tree::stats();
+    assert(stats.compares > (uint64_t)N);
+    assert(stats.descents == (uint64_t)N);
+    assert(stats.skews > 0 && stats.splits > 0);
+    uint64_t total = 0;
+    for (int i = 0; i < AAT_STATS_DEPTHS; i++) {
+        total += stats.depths[i];
+    }
+    assert(total == stats.descents);
+
+    stats_tree::stats() = aat_stats();
+    for (int i = 0; i < N; i++) {
+        assert(tree.find(items[i]));
+    }
+    stats = stats_tree::stats();
+    assert(stats.descents == (uint64_t)N);
+    assert(stats.skews == 0 && stats.splits == 0);
+    assert(stats.depth_total < (uint64_t)N*32);
+
+    // The other trees do not count.
+    plain_tree plain;
+    item other;
+    other.key = 0;
+    stats_tree::stats() = aat_stats();
+    plain.insert(&other);
+    assert(stats_tree::stats().compares == 0);
+    plain.clear();
+    tree.clear();
+}
+
+int main() {
+    srand(1);
+    test_plain();
+    test_multi();
+    test_reverse();
+    test_parent();
+    test_counted();
+    test_stats();
+    printf("PASSED\n");
+    return 0;
+}